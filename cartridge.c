@@ -5,12 +5,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "cartridge.h"
 #include "cartridge_banner.h"
 #include "cartridge_filetable.h"
 #include "cartridge_header.h"
+#include "cartridge_xattr.h"
 #include "hash_helper.h"
+#include "io_helper.h"
+#include "read_pipeline.h"
 #include "region.h"
 #include "libraries/crc.h"
 #include "libraries/CryptLib/LibMd5.h"
@@ -43,9 +49,63 @@
 static const uint8_t homebrew_header[] = { 0x2e, 0x00, 0x00, 0xea };
 static const uint8_t homebrew_gamecode[] = { '#', '#', '#', '#' };
 
+/* Sniffing only ever looks at the first 512 bytes.  A real header has a
+ * CRC16 over itself and another over the Nintendo logo (which is always
+ * the same logo, so always 0xCF56).  Dumps with a mangled header usually
+ * still have the logo, and hand made homebrew headers usually get the
+ * header CRC right even when they don't bother with the logo, so either
+ * one passing is good enough.
+ */
+const size_t nds_sniff_size = 512;
+static const uint16_t nintendo_logo_crc = 0xCF56;
+
+/* Streamed carts never hold the whole image.  They keep the header, the
+ * handful of tables that get parsed (FAT, FNT, banner) and one bounded
+ * buffer that every digest is pushed through.  Half the memory limit goes
+ * to that buffer; the rest is headroom for the tables, names and hashes.
+ */
+const size_t nds_default_memory_limit = 64 * 1024 * 1024;
+static const size_t stream_chunk_min = 64 * 1024;
+static const size_t stream_chunk_max = 16 * 1024 * 1024;
+static const size_t stream_header_size = sizeof(ndsDsiHeader_t);
+static const size_t segment_slack = 0x100; // An FNT name can run up to 129 bytes past where it starts.
+
+// Heap loads hash each chunk while the next one is still coming off disk.
+static const size_t read_chunk_size = 4 * 1024 * 1024;
+
+typedef struct nds_cartridge_segment_s
+{
+    size_t Offset;
+    size_t Length;
+    uint8_t * Data;
+} nds_cartridge_segment_t;
+typedef struct nds_cartridge_range_s
+{
+    size_t Offset;
+    size_t Length;
+    Sha512Context Context;
+    SHA512_HASH Hash;
+} nds_cartridge_range_t;
+typedef struct nds_cartridge_stream_s
+{
+    int Fd; // -1 when reading through Read or ReadNext instead
+    nds_read_t Read;
+    nds_read_next_t ReadNext; // Only while loading; after that Prefix is all there is
+    void * ReadContext;
+    uint8_t * Prefix; // Forward streams keep the start of the ROM, tables and all
+    size_t PrefixLength;
+    int NumRanges;
+    nds_cartridge_range_t * Ranges; // Forward streams hash these on the way past, sorted by offset
+    bool Cold;
+    io_stats_t IoStats; // Reads made after the cart was loaded
+    size_t ChunkSize;
+    int NumSegments;
+    nds_cartridge_segment_t * Segments;
+} nds_cartridge_stream_t;
+
 
 // Function decs
-const char * validate_cartridge_errmsg(int errno);
+const char * validate_cartridge_errmsg(int err);
 uint16_t get_cart_crc16(const nds_cartridge_t *);
 uint32_t get_cart_crc32(const nds_cartridge_t *);
 MD5_HASH * get_cart_md5(const nds_cartridge_t *);
@@ -93,52 +153,175 @@ SHA512_HASH * get_cart_arm7ovr_sha512(const nds_cartridge_t *);
 void create_cart_hashes(nds_cartridge_t *);
 int validate_cartridge(const nds_cartridge_t *);
 
+static int analyze_cartridge(nds_cartridge_t *);
+static int map_cartridge(nds_cartridge_t *, FILE *);
+static int read_cartridge(nds_cartridge_t *, FILE *, bool);
+static int read_cartridge_stream(nds_cartridge_t *, FILE *);
+static int stream_cartridge(nds_cartridge_t *, FILE *, size_t, bool);
+static nds_cartridge_stream_t * create_stream(size_t);
+static size_t stream_chunk_size(size_t);
+static size_t forward_prefix_size(const uint8_t *, size_t, size_t, nds_cartridge_catalog_t);
+static size_t forward_headroom(size_t, nds_cartridge_catalog_t);
+static int load_forward_prefix(nds_cartridge_t *, nds_cartridge_stream_t *, size_t);
+static int stream_forward_digests(nds_cartridge_t *);
+static void plan_forward_ranges(nds_cartridge_t *);
+static void add_forward_range(nds_cartridge_stream_t *, size_t, size_t);
+static void digest_forward_ranges(nds_cartridge_stream_t *, const uint8_t *, size_t, size_t);
+static int compare_ranges(const void *, const void *);
+static void load_stream_header(nds_cartridge_t *, nds_cartridge_stream_t *);
+static int stream_cart_digests(nds_cartridge_t *);
+static void advise_cartridge(const nds_cartridge_t *, int);
+static void free_stream(nds_cartridge_stream_t *);
+static size_t stream_pread(nds_cartridge_stream_t *, void *, size_t, size_t);
+static void digest_chunk(const uint8_t *, size_t, void *);
+static void count_faults(nds_cartridge_t *, size_t, size_t);
+
 
 
 
 
 
 // Init / Destroy
-nds_cartridge_t * create_nds_cartridge(FILE * fp)
+nds_cartridge_t * create_nds_cartridge(FILE * fp, const nds_load_options_t * options)
 {
     assert(fp != NULL);
 
+    static const nds_load_options_t default_options = { .LoadMode = CART_LOAD_MMAP };
+    if (options == NULL)
+        options = &default_options;
+
     nds_cartridge_t * ret = malloc(sizeof(nds_cartridge_t));
     memset(ret, 0, sizeof(*ret));
+    size_t minor_faults, major_faults;
+    get_thread_faults(&minor_faults, &major_faults);
+
+    // Digests stamped on the file save the pass over all of it.
+    struct stat st;
+    bool stampable = options->Xattr && fstat(fileno(fp), &st) == 0;
+    bool stamped = stampable && load_cart_xattr(ret, fileno(fp), &st);
+
+    // Stream or map the file if we can, read it if we must.  A mapping
+    // can only ever go through the page cache, so cold loads never map.
+    // Catalogs only want a few tables and streaming reads no more than that,
+    // and neither would reading a ROM whose digests we already have.  A
+    // sparse file streams too; mapping it would fault in every page of its
+    // holes just to hash zeros the stream never has to read.
+    int loaded = -1;
+    ret->Catalog = options->Catalog;
+    bool sparse = (options->LoadMode == CART_LOAD_MMAP && is_sparse(fileno(fp)));
+    if (options->LoadMode == CART_LOAD_STREAM || options->Catalog != CART_CATALOG_OFF || stamped || sparse)
+        loaded = stream_cartridge(ret, fp, options->MemoryLimit, options->Cold);
+    else if (options->LoadMode == CART_LOAD_MMAP && !options->Cold)
+        loaded = map_cartridge(ret, fp);
+    if (loaded != 0 && read_cartridge(ret, fp, options->Cold) != 0)
+    {
+        free_nds_cartridge(ret);
+        return NULL;
+    }
 
-    // Get the size...
-    fseek(fp, 0, SEEK_END);
-    ret->Size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    // Read the file
-    ret->Data = (uint8_t *)malloc(ret->Size);
-    if (ret->Size != fread(ret->Data, sizeof(uint8_t), ret->Size, fp))
+    if (analyze_cartridge(ret) != 0)
     {
         free_nds_cartridge(ret);
         return NULL;
     }
+    if (stampable && !stamped && ret->Catalog == CART_CATALOG_OFF)
+        store_cart_xattr(ret, fileno(fp), &st);
+    count_faults(ret, minor_faults, major_faults);
+    return ret;
+}
+nds_cartridge_t * create_nds_cartridge_from_memory(uint8_t * data, size_t size)
+{
+    assert(data != NULL || size == 0);
 
-    // Analyze the file (cutting out early if it's borked)
-    ret->CartCrc = get_cart_crc32(ret);
-    ret->CartHash = get_cart_sha512(ret);
+    nds_cartridge_t * ret = malloc(sizeof(nds_cartridge_t));
+    memset(ret, 0, sizeof(*ret));
+    ret->Data = data;
+    ret->Size = size;
+    ret->LoadMode = CART_LOAD_BORROWED;
+    size_t minor_faults, major_faults;
+    get_thread_faults(&minor_faults, &major_faults);
+
+    if (analyze_cartridge(ret) != 0)
+    {
+        free_nds_cartridge(ret);
+        return NULL;
+    }
+    count_faults(ret, minor_faults, major_faults);
+    return ret;
+}
+nds_cartridge_t * create_nds_cartridge_from_reader(nds_read_t read, void * context, size_t size, const nds_load_options_t * options)
+{
+    assert(read != NULL);
 
-    ret->Status = validate_cartridge(ret);
-    if (ret->Status == 0)
+    nds_cartridge_t * ret = malloc(sizeof(nds_cartridge_t));
+    memset(ret, 0, sizeof(*ret));
+    size_t minor_faults, major_faults;
+    get_thread_faults(&minor_faults, &major_faults);
+
+    // Always streamed; the reader is the only way at the bytes.
+    nds_cartridge_stream_t * stream = create_stream((options != NULL) ? options->MemoryLimit : 0);
+    stream->Fd = -1;
+    stream->Read = read;
+    stream->ReadContext = context;
+    ret->Catalog = (options != NULL) ? options->Catalog : CART_CATALOG_OFF;
+    ret->Size = size;
+    load_stream_header(ret, stream);
+
+    if (analyze_cartridge(ret) != 0)
     {
-        create_cart_hashes(ret);
-        ret->Banner = load_banner(ret);
-        ret->FileTable = load_filetable(ret);
+        free_nds_cartridge(ret);
+        return NULL;
     }
+    count_faults(ret, minor_faults, major_faults);
+    return ret;
+}
+nds_cartridge_t * create_nds_cartridge_from_stream(nds_read_next_t read, void * context, size_t size, const nds_load_options_t * options)
+{
+    assert(read != NULL);
 
+    nds_cartridge_t * ret = malloc(sizeof(nds_cartridge_t));
+    memset(ret, 0, sizeof(*ret));
+    size_t minor_faults, major_faults;
+    get_thread_faults(&minor_faults, &major_faults);
+
+    // Streamed, but with nothing to go back to once it's gone by.
+    size_t memory_limit = (options != NULL) ? options->MemoryLimit : 0;
+    nds_cartridge_stream_t * stream = create_stream(memory_limit);
+    stream->Fd = -1;
+    stream->ReadNext = read;
+    stream->ReadContext = context;
+    ret->Catalog = (options != NULL) ? options->Catalog : CART_CATALOG_OFF;
+    ret->Size = size;
+
+    if (load_forward_prefix(ret, stream, memory_limit) != 0 || analyze_cartridge(ret) != 0)
+    {
+        free_nds_cartridge(ret);
+        return NULL;
+    }
+    stream->ReadNext = NULL;
+    stream->ReadContext = NULL;
+    count_faults(ret, minor_faults, major_faults);
     return ret;
 }
+bool can_stream_nds_forward(const uint8_t * buf, size_t buflen, size_t size, const nds_load_options_t * options)
+{
+    assert(buf != NULL || buflen == 0);
+
+    nds_cartridge_catalog_t catalog = (options != NULL) ? options->Catalog : CART_CATALOG_OFF;
+    size_t memory_limit = (options != NULL) ? options->MemoryLimit : 0;
+    return forward_prefix_size(buf, buflen, size, catalog) <= forward_headroom(memory_limit, catalog);
+}
 void free_nds_cartridge(nds_cartridge_t * cart)
 {
     if (cart == NULL)
         return;
 
-    free(cart->Data);
+    if (cart->LoadMode == CART_LOAD_MMAP)
+        munmap(cart->Data, cart->Size);
+    else if (cart->LoadMode == CART_LOAD_HEAP)
+        free_large(cart->Data, cart->Size);
+    else if (cart->LoadMode != CART_LOAD_BORROWED)
+        free(cart->Data);
     free(cart->CartHash);
     free(cart->TrimHash);
     free(cart->Arm9Hash);
@@ -147,9 +330,572 @@ void free_nds_cartridge(nds_cartridge_t * cart)
     free(cart->Arm7OverlayHash);
     free_banner(cart->Banner);
     free_filetable(cart->FileTable);
+    free(cart->StampedFileHashes);
+    free_stream(cart->Stream);
     free(cart);
 }
 
+// Analysis
+static int analyze_cartridge(nds_cartridge_t * cart)
+{
+    // A catalog is just the header and whatever tables were asked for.
+    if (cart->Catalog != CART_CATALOG_OFF)
+    {
+        cart->Status = validate_cartridge(cart);
+        if (cart->Status == 0)
+        {
+            cart->HeaderCrc16 = get_cart_header_crc16(cart);
+            cart->Banner = load_banner(cart);
+            if (cart->Catalog == CART_CATALOG_FILES)
+                cart->FileTable = load_filetable(cart);
+        }
+        return 0;
+    }
+
+    // Analyze the file (cutting out early if it's borked)
+    // Pipelined reads have already done the whole-cart digests on the way in.
+    // A file that comes up short of its size can't be hashed at all.
+    advise_cartridge(cart, MADV_SEQUENTIAL);
+    if (cart->CartHash == NULL && cart->LoadMode == CART_LOAD_STREAM)
+    {
+        if (stream_cart_digests(cart) != 0)
+            return -1;
+    }
+    else if (cart->CartHash == NULL)
+    {
+        digest_context_t ctx;
+        digest_init(&ctx);
+        digest_update(&ctx, cart->Data, cart->Size);
+        cart->CartHash = malloc(sizeof(SHA512_HASH));
+        digest_finish(&ctx, &cart->CartCrc, cart->CartHash);
+    }
+
+    // Everything past this point hops around the ROM following offsets.
+    advise_cartridge(cart, MADV_RANDOM);
+    cart->Status = validate_cartridge(cart);
+    if (cart->Status == 0)
+    {
+        create_cart_hashes(cart);
+        cart->Banner = load_banner(cart);
+        cart->FileTable = load_filetable(cart);
+    }
+
+    return 0;
+}
+
+// Loading
+static int map_cartridge(nds_cartridge_t * cart, FILE * fp)
+{
+    // Mapping only makes sense for regular files.  Pipes, sockets and
+    // the like (and empty files, which mmap refuses) get read instead.
+    // The mapping is private and read-only so the cart is a view over the
+    // page cache rather than a second copy of the ROM on the heap.
+    // Note that a file truncated out from under us while mapped will
+    // SIGBUS rather than fail a read; the audit roots are assumed stable.
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0)
+        return -1;
+
+    void * data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (data == MAP_FAILED)
+        return -1;
+
+    cart->Size = st.st_size;
+    cart->Data = data;
+    cart->LoadMode = CART_LOAD_MMAP;
+    cart->IoStats.CachedBytes = cart->Size; // Near enough; it all gets faulted in for the digests.
+
+    // The header is the first thing anybody looks at.
+    madvise(cart->Data, (cart->Size < 0x4000) ? cart->Size : 0x4000, MADV_WILLNEED);
+    return 0;
+}
+static int read_cartridge(nds_cartridge_t * cart, FILE * fp, bool cold)
+{
+    // Anything that isn't a regular file (a pipe, say) can't tell us its
+    // size or be seeked around to find out.
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode))
+        return read_cartridge_stream(cart, fp);
+
+    // Read the file.  Cold reads want an O_DIRECT friendly buffer, which
+    // alloc_large always is.  It comes in on a second thread so the
+    // digests can chew on one chunk while the next is being read.
+    cart->Size = st.st_size;
+    cart->Data = alloc_large(cart->Size);
+    cart->LoadMode = CART_LOAD_HEAP;
+
+    digest_context_t ctx;
+    digest_init(&ctx);
+    if (cart->Size != run_read_pipeline(fileno(fp), cart->Size, read_chunk_size, cold, cart->Data, digest_chunk, &ctx, &cart->IoStats))
+        return -1;
+
+    cart->CartHash = malloc(sizeof(SHA512_HASH));
+    digest_finish(&ctx, &cart->CartCrc, cart->CartHash);
+    return 0;
+}
+static int read_cartridge_stream(nds_cartridge_t * cart, FILE * fp)
+{
+    // Read until it runs dry, doubling the buffer whenever it fills and
+    // hashing each chunk as it lands, then trim the buffer to fit.  The
+    // report comes out the same as it would for the file itself.
+    size_t capacity = read_chunk_size;
+    cart->Size = 0;
+    cart->Data = alloc_large(capacity);
+    cart->LoadMode = CART_LOAD_HEAP;
+
+    digest_context_t ctx;
+    digest_init(&ctx);
+    bool full = false;
+    while (cart->Data != NULL)
+    {
+        if (full)
+        {
+            uint8_t * grown = realloc_large(cart->Data, capacity, capacity * 2);
+            if (grown == NULL)
+                break;
+            cart->Data = grown;
+            capacity *= 2;
+        }
+
+        size_t got = fread(cart->Data + cart->Size, sizeof(uint8_t), capacity - cart->Size, fp);
+        digest_update(&ctx, cart->Data + cart->Size, got);
+        cart->Size += got;
+        full = (cart->Size == capacity);
+        if (!full)
+            break;
+    }
+    cart->IoStats.CachedBytes = cart->Size;
+
+    // free_nds_cartridge wants Size to be what was allocated.
+    uint8_t * trimmed = (cart->Data != NULL) ? realloc_large(cart->Data, capacity, cart->Size) : NULL;
+    if (trimmed == NULL || full || ferror(fp))
+    {
+        free_large((trimmed != NULL) ? trimmed : cart->Data, (trimmed != NULL) ? cart->Size : capacity);
+        cart->Data = NULL;
+        cart->Size = 0;
+        return -1;
+    }
+    cart->Data = trimmed;
+
+    cart->CartHash = malloc(sizeof(SHA512_HASH));
+    digest_finish(&ctx, &cart->CartCrc, cart->CartHash);
+    return 0;
+}
+static int stream_cartridge(nds_cartridge_t * cart, FILE * fp, size_t memory_limit, bool cold)
+{
+    // We need pread so this only works on regular files.
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode))
+        return -1;
+
+    nds_cartridge_stream_t * stream = create_stream(memory_limit);
+    stream->Fd = fileno(fp);
+    stream->Cold = cold;
+
+    // Cold streams turn readahead off; it would only pull in pages that
+    // pread_dropping never gets told about.
+    if (cold)
+        posix_fadvise(stream->Fd, 0, 0, POSIX_FADV_RANDOM);
+    cart->Size = st.st_size;
+    load_stream_header(cart, stream);
+
+    return 0;
+}
+static nds_cartridge_stream_t * create_stream(size_t memory_limit)
+{
+    nds_cartridge_stream_t * ret = malloc(sizeof(nds_cartridge_stream_t));
+    memset(ret, 0, sizeof(*ret));
+    ret->ChunkSize = stream_chunk_size(memory_limit);
+
+    return ret;
+}
+static size_t stream_chunk_size(size_t memory_limit)
+{
+    if (memory_limit == 0)
+        memory_limit = nds_default_memory_limit;
+
+    size_t ret = memory_limit / 2;
+    if (ret < stream_chunk_min)
+        ret = stream_chunk_min;
+    if (ret > stream_chunk_max)
+        ret = stream_chunk_max;
+
+    return ret;
+}
+static size_t forward_prefix_size(const uint8_t * buf, size_t buflen, size_t size, nds_cartridge_catalog_t catalog)
+{
+    // The header plus every table that validation would let get_cart_bytes
+    // at, slack and all.  A header too short to say just keeps itself.
+    size_t ret = stream_header_size;
+    if (buflen >= offsetof(ndsHeader_t, IconBannerOffset) + sizeof(uint32_t))
+    {
+        const ndsHeader_t * header = ((const ndsHeader_t *)buf);
+        bool files = (catalog != CART_CATALOG_HEADER);
+        size_t tables[3][2] =
+        {
+            { header->FileAllocationTableOffset, (files) ? header->FileAllocationTableLength : 0 },
+            { header->FileNameTableOffset, (files) ? header->FileNameTableLength : 0 },
+            { header->IconBannerOffset, (header->IconBannerOffset > 0) ? nds_banner_size : 0 },
+        };
+        for (int i = 0; i < 3; i++)
+        {
+            size_t table_end = tables[i][0] + tables[i][1];
+            if (tables[i][1] > 0 && table_end < size && table_end + segment_slack > ret)
+                ret = table_end + segment_slack;
+        }
+    }
+
+    return (ret < size) ? ret : size;
+}
+static size_t forward_headroom(size_t memory_limit, nds_cartridge_catalog_t catalog)
+{
+    // Catalogs hash nothing so the tables can have the whole limit.  A
+    // full load's tables get whatever the digest buffer leaves, or half
+    // when the buffer is held at its minimum.
+    if (memory_limit == 0)
+        memory_limit = nds_default_memory_limit;
+    if (catalog != CART_CATALOG_OFF)
+        return memory_limit;
+
+    size_t chunk_size = stream_chunk_size(memory_limit);
+    return (chunk_size < memory_limit / 2) ? memory_limit - chunk_size : memory_limit / 2;
+}
+static int load_forward_prefix(nds_cartridge_t * cart, nds_cartridge_stream_t * stream, size_t memory_limit)
+{
+    // The header says how far in the tables go and everything up to the
+    // last of them is kept.  The rest is only ever hashed as it goes by.
+    size_t header_length = (cart->Size < stream_header_size) ? cart->Size : stream_header_size;
+    stream->Prefix = malloc(stream_header_size);
+    stream->PrefixLength = stream->ReadNext(stream->ReadContext, stream->Prefix, header_length);
+    load_stream_header(cart, stream);
+    if (stream->PrefixLength < header_length)
+        return -1;
+
+    size_t length = forward_prefix_size(stream->Prefix, header_length, cart->Size, cart->Catalog);
+    if (length > forward_headroom(memory_limit, cart->Catalog))
+        return -1;
+    if (length > header_length)
+    {
+        stream->Prefix = realloc(stream->Prefix, length);
+        stream->PrefixLength += stream->ReadNext(stream->ReadContext, stream->Prefix + header_length, length - header_length);
+        if (stream->PrefixLength < length)
+            return -1;
+    }
+
+    return 0;
+}
+static void load_stream_header(nds_cartridge_t * cart, nds_cartridge_stream_t * stream)
+{
+    // The header is the one thing that is always resident.  Tiny files get
+    // zero padding instead of whatever happened to follow them in memory.
+    cart->Data = malloc(stream_header_size);
+    memset(cart->Data, 0, stream_header_size);
+    stream_pread(stream, cart->Data, (cart->Size < stream_header_size) ? cart->Size : stream_header_size, 0);
+    cart->Stream = stream;
+    cart->LoadMode = CART_LOAD_STREAM;
+}
+static int stream_cart_digests(nds_cartridge_t * cart)
+{
+    // One pass over the file feeds both whole-cart digests.  The buffer
+    // budget is split in two so one half can be hashed while the other
+    // is read into.  A file that shrank or failed part way through gets
+    // no digests rather than ones over whatever of it turned up, the same
+    // as a short read onto the heap.
+    nds_cartridge_stream_t * stream = cart->Stream;
+    digest_context_t ctx;
+
+    if (stream->ReadNext != NULL)
+        return stream_forward_digests(cart);
+
+    digest_init(&ctx);
+    if (stream->Read == NULL)
+    {
+        if (cart->Size != run_read_pipeline(stream->Fd, cart->Size, stream->ChunkSize / 2, stream->Cold, NULL, digest_chunk, &ctx, &cart->IoStats))
+            return -1;
+    }
+    else
+    {
+        // Readers get read in order, which is what they're best at.  One
+        // that comes up short (a truncated or corrupt member, say) fails
+        // the cart like a short file does.
+        uint8_t * buffer = malloc(stream->ChunkSize);
+        for (size_t pos = 0; pos < cart->Size;)
+        {
+            size_t want = (cart->Size - pos < stream->ChunkSize) ? cart->Size - pos : stream->ChunkSize;
+            if (stream_pread(stream, buffer, want, pos) < want)
+            {
+                free(buffer);
+                return -1;
+            }
+            digest_update(&ctx, buffer, want);
+            pos += want;
+        }
+        free(buffer);
+    }
+
+    cart->CartHash = malloc(sizeof(SHA512_HASH));
+    digest_finish(&ctx, &cart->CartCrc, cart->CartHash);
+    return 0;
+}
+static int stream_forward_digests(nds_cartridge_t * cart)
+{
+    // There is one pass and one only, so everything that will ever be
+    // hashed is hashed on it.  The prefix is already in hand; the rest
+    // comes through the one buffer, and a reader that runs dry before
+    // the end fails the cart like any other short read.
+    nds_cartridge_stream_t * stream = cart->Stream;
+    digest_context_t ctx;
+    plan_forward_ranges(cart);
+
+    digest_init(&ctx);
+    uint8_t * buffer = malloc(stream->ChunkSize);
+    for (size_t pos = 0; pos < cart->Size;)
+    {
+        size_t want = (cart->Size - pos < stream->ChunkSize) ? cart->Size - pos : stream->ChunkSize;
+        uint8_t * data = buffer;
+        if (pos < stream->PrefixLength)
+        {
+            want = (stream->PrefixLength - pos < want) ? stream->PrefixLength - pos : want;
+            data = stream->Prefix + pos;
+        }
+        else if (stream->ReadNext(stream->ReadContext, buffer, want) < want)
+        {
+            free(buffer);
+            return -1;
+        }
+
+        digest_update(&ctx, data, want);
+        digest_forward_ranges(stream, data, want, pos);
+        pos += want;
+    }
+
+    // Ranges that run off the end hash zeros for the rest, same as a
+    // streamed range does.
+    memset(buffer, 0, stream->ChunkSize);
+    for (int i = 0; i < stream->NumRanges; i++)
+    {
+        nds_cartridge_range_t * range = stream->Ranges + i;
+        size_t range_end = range->Offset + range->Length;
+        for (size_t pos = (range->Offset > cart->Size) ? range->Offset : cart->Size; pos < range_end;)
+        {
+            size_t want = (range_end - pos < stream->ChunkSize) ? range_end - pos : stream->ChunkSize;
+            Sha512Update(&range->Context, buffer, want);
+            pos += want;
+        }
+        Sha512Finalise(&range->Context, &range->Hash);
+    }
+    free(buffer);
+
+    cart->CartHash = malloc(sizeof(SHA512_HASH));
+    digest_finish(&ctx, &cart->CartCrc, cart->CartHash);
+    return 0;
+}
+static void plan_forward_ranges(nds_cartridge_t * cart)
+{
+    // Every range create_cart_hashes and the file table are going to ask
+    // get_cart_range_sha512 for.  A cart that won't validate asks for none.
+    if (validate_cartridge(cart) != 0)
+        return;
+
+    nds_cartridge_stream_t * stream = cart->Stream;
+    ndsHeader_t * header = ((ndsHeader_t *)(cart->Data));
+    size_t * file_ranges;
+    unsigned int num_files = list_filetable_ranges(cart, &file_ranges);
+    stream->Ranges = malloc(sizeof(nds_cartridge_range_t) * (5 + num_files));
+
+    add_forward_range(stream, header->Arm9RomOffset, header->Arm9Size);
+    add_forward_range(stream, header->Arm7RomOffset, header->Arm7Size);
+    if (header->Arm9OverlayOffset != 0 && header->Arm9OverlayLength != 0)
+        add_forward_range(stream, header->Arm9OverlayOffset, header->Arm9OverlayLength);
+    if (header->Arm7OverlayOffset != 0 && header->Arm7OverlayLength != 0)
+        add_forward_range(stream, header->Arm7OverlayOffset, header->Arm7OverlayLength);
+    if (cart->TrimSize != 0 && cart->TrimSize != cart->Size)
+        add_forward_range(stream, 0, cart->TrimSize);
+    for (unsigned int i = 0; i < num_files; i++)
+    {
+        add_forward_range(stream, file_ranges[i * 2], file_ranges[i * 2 + 1]);
+    }
+    free(file_ranges);
+
+    qsort(stream->Ranges, stream->NumRanges, sizeof(nds_cartridge_range_t), compare_ranges);
+}
+static void add_forward_range(nds_cartridge_stream_t * stream, size_t offset, size_t length)
+{
+    nds_cartridge_range_t * range = stream->Ranges + stream->NumRanges++;
+    range->Offset = offset;
+    range->Length = length;
+    Sha512Initialise(&range->Context);
+}
+static void digest_forward_ranges(nds_cartridge_stream_t * stream, const uint8_t * buf, size_t buflen, size_t offset)
+{
+    // Ranges are in order of where they start so the first one starting
+    // past this chunk means the rest do too.
+    for (int i = 0; i < stream->NumRanges && stream->Ranges[i].Offset < offset + buflen; i++)
+    {
+        nds_cartridge_range_t * range = stream->Ranges + i;
+        size_t start = (range->Offset > offset) ? range->Offset : offset;
+        size_t end = (range->Offset + range->Length < offset + buflen) ? range->Offset + range->Length : offset + buflen;
+        if (start < end)
+            Sha512Update(&range->Context, (void *)(buf + (start - offset)), end - start);
+    }
+}
+static int compare_ranges(const void * a, const void * b)
+{
+    const nds_cartridge_range_t * range_a = a;
+    const nds_cartridge_range_t * range_b = b;
+    if (range_a->Offset != range_b->Offset)
+        return (range_a->Offset < range_b->Offset) ? -1 : 1;
+    if (range_a->Length != range_b->Length)
+        return (range_a->Length < range_b->Length) ? -1 : 1;
+    return 0;
+}
+static void advise_cartridge(const nds_cartridge_t * cart, int advice)
+{
+    // Access pattern hints only mean something for mapped or streamed carts.
+    if (cart->LoadMode == CART_LOAD_MMAP)
+        madvise(cart->Data, cart->Size, advice);
+    else if (cart->LoadMode == CART_LOAD_STREAM && cart->Stream->Fd >= 0 && !cart->Stream->Cold)
+        posix_fadvise(cart->Stream->Fd, 0, 0, (advice == MADV_SEQUENTIAL) ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_RANDOM);
+}
+static void free_stream(nds_cartridge_stream_t * stream)
+{
+    if (stream == NULL)
+        return;
+
+    for (int i = 0; i < stream->NumSegments; i++)
+    {
+        free(stream->Segments[i].Data);
+    }
+
+    free(stream->Segments);
+    free(stream->Prefix);
+    free(stream->Ranges);
+    free(stream);
+}
+
+static size_t stream_pread(nds_cartridge_stream_t * stream, void * buf, size_t buflen, size_t offset)
+{
+    // Readers keep their own books.
+    if (stream->Read != NULL)
+        return stream->Read(stream->ReadContext, buf, buflen, offset);
+
+    // Forward streams can't go back; what they kept is all there is.
+    if (stream->Fd < 0)
+    {
+        size_t got = (offset >= stream->PrefixLength) ? 0 : (stream->PrefixLength - offset < buflen) ? stream->PrefixLength - offset : buflen;
+        memcpy(buf, stream->Prefix + offset, got);
+        return got;
+    }
+
+    // The odd table or sub-range; small enough that O_DIRECT isn't worth it.
+    size_t got = (stream->Cold) ? pread_dropping(stream->Fd, buf, buflen, offset) : pread_fully(stream->Fd, buf, buflen, offset);
+    stream->IoStats.CachedBytes += got;
+    return got;
+}
+static void count_faults(nds_cartridge_t * cart, size_t minor_before, size_t major_before)
+{
+    // Everything from the first read to the last hash happened on this thread.
+    size_t minor, major;
+    get_thread_faults(&minor, &major);
+    cart->IoStats.MinorFaults += minor - minor_before;
+    cart->IoStats.MajorFaults += major - major_before;
+}
+static void digest_chunk(const uint8_t * buf, size_t buflen, void * context)
+{
+    // No buffer means a hole.
+    if (buf == NULL)
+        digest_update_zeros(context, buflen);
+    else
+        digest_update(context, buf, buflen);
+}
+
+// Access
+uint8_t * get_cart_bytes(const nds_cartridge_t * cart, size_t offset, size_t length)
+{
+    assert(cart != NULL);
+
+    // Resident carts are easy.
+    if (cart->LoadMode != CART_LOAD_STREAM)
+        return cart->Data + offset;
+
+    // Streamed carts keep whichever tables they've been asked about.
+    nds_cartridge_stream_t * stream = cart->Stream;
+    if (offset + length <= stream_header_size)
+        return cart->Data + offset;
+    for (int i = 0; i < stream->NumSegments; i++)
+    {
+        nds_cartridge_segment_t * seg = stream->Segments + i;
+        if (offset >= seg->Offset && offset + length <= seg->Offset + seg->Length)
+            return seg->Data + (offset - seg->Offset);
+    }
+
+    // Not resident yet so read it in.  The slack means a lying FNT length
+    // byte runs into the same bytes it would have in a resident cart.
+    nds_cartridge_segment_t seg;
+    seg.Offset = offset;
+    seg.Length = length + segment_slack;
+    seg.Data = malloc(seg.Length);
+    memset(seg.Data, 0, seg.Length);
+    if (offset < cart->Size)
+        stream_pread(stream, seg.Data, (cart->Size - offset < seg.Length) ? cart->Size - offset : seg.Length, offset);
+
+    stream->Segments = realloc(stream->Segments, sizeof(nds_cartridge_segment_t) * (stream->NumSegments + 1));
+    stream->Segments[stream->NumSegments++] = seg;
+    return seg.Data;
+}
+SHA512_HASH * get_cart_range_sha512(const nds_cartridge_t * cart, size_t offset, size_t length)
+{
+    assert(cart != NULL);
+
+    if (cart->LoadMode != CART_LOAD_STREAM)
+        return get_sha512(cart->Data + offset, length);
+
+    // Forward streams hashed what they'd be asked for on the way past.
+    nds_cartridge_stream_t * stream = cart->Stream;
+    nds_cartridge_range_t key = { .Offset = offset, .Length = length };
+    nds_cartridge_range_t * found = (stream->NumRanges > 0) ? bsearch(&key, stream->Ranges, stream->NumRanges, sizeof(nds_cartridge_range_t), compare_ranges) : NULL;
+    if (found != NULL)
+    {
+        SHA512_HASH * ret = malloc(sizeof(SHA512_HASH));
+        *ret = found->Hash;
+        return ret;
+    }
+
+    // Push the range through a buffer no bigger than it needs to be.
+    size_t buffer_size = (length < stream->ChunkSize) ? length : stream->ChunkSize;
+    uint8_t * buffer = malloc(buffer_size + 1);
+    Sha512Context ctx;
+
+    Sha512Initialise(&ctx);
+    for (size_t pos = 0; pos < length;)
+    {
+        size_t want = (length - pos < buffer_size) ? length - pos : buffer_size;
+        size_t got = stream_pread(stream, buffer, want, offset + pos);
+        memset(buffer + got, 0, want - got);
+
+        Sha512Update(&ctx, buffer, want);
+        pos += want;
+    }
+
+    SHA512_HASH * ret = malloc(sizeof(SHA512_HASH));
+    Sha512Finalise(&ctx, ret);
+    free(buffer);
+
+    return ret;
+}
+void get_cart_io_stats(const nds_cartridge_t * cart, io_stats_t * out_stats)
+{
+    assert(cart != NULL);
+    assert(out_stats != NULL);
+
+    *out_stats = cart->IoStats;
+    if (cart->Stream != NULL)
+    {
+        out_stats->DirectBytes += cart->Stream->IoStats.DirectBytes;
+        out_stats->CachedBytes += cart->Stream->IoStats.CachedBytes;
+    }
+}
+
 // Attributes
 bool is_cartridge_homebrew(const nds_cartridge_t * cart)
 {
@@ -177,11 +923,35 @@ bool is_cartridge_dsi(const nds_cartridge_t * cart)
 {
     assert(cart != NULL);
 
-    // I don't know what we're doing here yet.  We could try using the unitCode
-    // we could try for offsets or we could try reading the 0x180+ data and see if it looks like a header.
-    //ndsHeader_t * header = ((ndsHeader_t *)(cart->Data));
+    // The UnitCode has a bit for it.  Carts too small to have one aren't.
+    if (cart->Size <= offsetof(ndsHeader_t, UnitCode))
+        return false;
 
-    return false;
+    ndsHeader_t * header = ((ndsHeader_t *)(cart->Data));
+    return (header->UnitCode & 0x02) != 0;
+}
+nds_rom_kind_t sniff_nds_header(const uint8_t * buf, size_t buflen)
+{
+    assert(buf != NULL || buflen == 0);
+
+    // Everything we check lives before the header CRC.
+    if (buflen < offsetof(ndsHeader_t, HeaderCrc) + sizeof(uint16_t))
+        return ROM_KIND_NONE;
+
+    const ndsHeader_t * header = (const ndsHeader_t *)buf;
+    uint16_t logo_crc = header->NintendoLogoCrc[0] | (header->NintendoLogoCrc[1] << 8);
+    bool logo_ok = (logo_crc == nintendo_logo_crc && crc16(header->NintendoLogo, sizeof(header->NintendoLogo)) == nintendo_logo_crc);
+    bool header_ok = (crc16(buf, offsetof(ndsHeader_t, HeaderCrc)) == header->HeaderCrc);
+    if (!logo_ok && !header_ok)
+        return ROM_KIND_NONE;
+
+    // Only 00h, 02h and 03h have ever shipped.
+    if (header->UnitCode != 0x00 && header->UnitCode != 0x02 && header->UnitCode != 0x03)
+        return ROM_KIND_NONE;
+
+    if (memcmp(header->GameTitle, homebrew_header, sizeof(homebrew_header)) == 0 || memcmp(header->GameCode, homebrew_gamecode, sizeof(homebrew_gamecode)) == 0)
+        return ROM_KIND_HOMEBREW;
+    return (header->UnitCode & 0x02) ? ROM_KIND_TWL : ROM_KIND_NTR;
 }
 
 
@@ -191,10 +961,16 @@ void create_cart_hashes(nds_cartridge_t * cart)
     if (cart->TrimSize != 0 && cart->TrimSize != cart->Size)
         cart->TrimHash = get_trimcart_sha512(cart);
     cart->HeaderCrc16 = get_cart_header_crc16(cart);
-    cart->Arm9Hash = get_cart_arm9_sha512(cart);
-    cart->Arm7Hash = get_cart_arm7_sha512(cart);
-    cart->Arm9OverlayHash = get_cart_arm9ovr_sha512(cart);
-    cart->Arm7OverlayHash = get_cart_arm7ovr_sha512(cart);
+
+    // Some may have come stamped on the file.
+    if (cart->Arm9Hash == NULL)
+        cart->Arm9Hash = get_cart_arm9_sha512(cart);
+    if (cart->Arm7Hash == NULL)
+        cart->Arm7Hash = get_cart_arm7_sha512(cart);
+    if (cart->Arm9OverlayHash == NULL)
+        cart->Arm9OverlayHash = get_cart_arm9ovr_sha512(cart);
+    if (cart->Arm7OverlayHash == NULL)
+        cart->Arm7OverlayHash = get_cart_arm7ovr_sha512(cart);
 }
 int validate_cartridge(const nds_cartridge_t * cart)
 {
@@ -217,7 +993,8 @@ int validate_cartridge(const nds_cartridge_t * cart)
     if (cart->Size < header->Arm7RomOffset + header->Arm7Size)
         return -3;
 
-    int ret = validate_cartridge_filetable(cart);
+    // A header-only catalog never looks at the file table so doesn't check it.
+    int ret = (cart->Catalog == CART_CATALOG_HEADER) ? 0 : validate_cartridge_filetable(cart);
     if (ret < 0) { return ret; }
 
     ret = validate_cartridge_banner(cart);
@@ -225,9 +1002,9 @@ int validate_cartridge(const nds_cartridge_t * cart)
 
     return 0;
 }
-const char * validate_cartridge_errmsg(int errno)
+const char * validate_cartridge_errmsg(int err)
 {
-    switch (errno)
+    switch (err)
     {
         case 0:
             return "No error";
@@ -265,6 +1042,10 @@ const char * validate_cartridge_errmsg(int errno)
 
 
 // Hashing (cart)
+/* Only the SHA512 flavours of the region hashes go through
+ * get_cart_range_sha512 and so work on streamed carts.  The rest are
+ * unused by the loader and still expect the ROM to be resident.
+ **/
 uint16_t get_cart_crc16(const nds_cartridge_t * cart) { return get_crc16(cart->Data, cart->Size); }
 uint32_t get_cart_crc32(const nds_cartridge_t * cart) { return get_crc32(cart->Data, cart->Size); }
 MD5_HASH * get_cart_md5(const nds_cartridge_t * cart) { return get_md5(cart->Data, cart->Size); }
@@ -278,7 +1059,7 @@ uint32_t get_trimcart_crc32(const nds_cartridge_t * cart) { return get_crc32(car
 MD5_HASH * get_trimcart_md5(const nds_cartridge_t * cart) { return get_md5(cart->Data, cart->TrimSize); }
 SHA1_HASH * get_trimcart_sha1(const nds_cartridge_t * cart) { return get_sha1(cart->Data, cart->TrimSize); }
 SHA256_HASH * get_trimcart_sha256(const nds_cartridge_t * cart) { return get_sha256(cart->Data, cart->TrimSize); }
-SHA512_HASH * get_trimcart_sha512(const nds_cartridge_t * cart) { return get_sha512(cart->Data, cart->TrimSize); }
+SHA512_HASH * get_trimcart_sha512(const nds_cartridge_t * cart) { return get_cart_range_sha512(cart, 0, cart->TrimSize); }
 
 // Hashing (cart header aka the first 350 bytes)
 uint16_t get_cart_header_crc16(const nds_cartridge_t * cart) { return get_crc16(cart->Data, offsetof(ndsHeader_t, HeaderCrc)); }
@@ -333,7 +1114,7 @@ SHA512_HASH * get_cart_arm9_sha512(const nds_cartridge_t * cart)
     assert(cart != NULL);
 
     ndsHeader_t * header = ((ndsHeader_t *)(cart->Data));
-    return get_sha512(cart->Data + header->Arm9RomOffset, header->Arm9Size);
+    return get_cart_range_sha512(cart, header->Arm9RomOffset, header->Arm9Size);
 }
 
 // Hashing (cart arm7 blob size and position depends on what the header says)
@@ -377,7 +1158,7 @@ SHA512_HASH * get_cart_arm7_sha512(const nds_cartridge_t * cart)
     assert(cart != NULL);
 
     ndsHeader_t * header = ((ndsHeader_t *)(cart->Data));
-    return get_sha512(cart->Data + header->Arm7RomOffset, header->Arm7Size);
+    return get_cart_range_sha512(cart, header->Arm7RomOffset, header->Arm7Size);
 }
 
 // Hashing (cart arm9 overlay, may not exist)
@@ -439,7 +1220,7 @@ SHA512_HASH * get_cart_arm9ovr_sha512(const nds_cartridge_t * cart)
     if (header->Arm9OverlayOffset == 0 || header->Arm9OverlayLength == 0)
         return NULL;
 
-    return get_sha512(cart->Data + header->Arm9OverlayOffset, header->Arm9OverlayLength);
+    return get_cart_range_sha512(cart, header->Arm9OverlayOffset, header->Arm9OverlayLength);
 }
 
 // Hashing (cart arm7 overlay, may not exist)
@@ -501,7 +1282,7 @@ SHA512_HASH * get_cart_arm7ovr_sha512(const nds_cartridge_t * cart)
     if (header->Arm7OverlayOffset == 0 || header->Arm7OverlayLength == 0)
         return NULL;
 
-    return get_sha512(cart->Data + header->Arm7OverlayOffset, header->Arm7OverlayLength);
+    return get_cart_range_sha512(cart, header->Arm7OverlayOffset, header->Arm7OverlayLength);
 }
 
 // Reporting
@@ -538,10 +1319,13 @@ char * cartridge_info(const nds_cartridge_t * cart)
         s = sdscat(s, "\n");
     }
 
-    // Even bad files get the overall hash
-    sha512_to_hex(cart->CartHash, hash_buffer);
-    s = sdscatprintf(s, " Cart CRC:       %08x\n", cart->CartCrc);
-    s = sdscatprintf(s, " Cart SHA512:    %.32s ... %.8s\n", hash_buffer, hash_buffer+120);
+    // Even bad files get the overall hash (unless we're only cataloguing)
+    if (cart->CartHash != NULL)
+    {
+        sha512_to_hex(cart->CartHash, hash_buffer);
+        s = sdscatprintf(s, " Cart CRC:       %08x\n", cart->CartCrc);
+        s = sdscatprintf(s, " Cart SHA512:    %.32s ... %.8s\n", hash_buffer, hash_buffer+120);
+    }
 
     if (cart->Status == 0)
     {
@@ -552,8 +1336,11 @@ char * cartridge_info(const nds_cartridge_t * cart)
 
         if (cart->Banner != NULL)
         {
-            sha512_to_hex(cart->Banner->BannerHash, hash_buffer);
-            s = sdscatprintf(s, " Banner SHA512:       %.32s ... %.8s\n", hash_buffer, hash_buffer+120);
+            if (cart->Banner->BannerHash != NULL)
+            {
+                sha512_to_hex(cart->Banner->BannerHash, hash_buffer);
+                s = sdscatprintf(s, " Banner SHA512:       %.32s ... %.8s\n", hash_buffer, hash_buffer+120);
+            }
             s = sdscatprintf(s, " Banner Names:\n");
             s = sdscatprintf(s, " * %s (J)\n", cart->Banner->BannerNames[cart->Banner->BannerNameIndexes[0]]);
             s = sdscatprintf(s, " * %s (E)\n", cart->Banner->BannerNames[cart->Banner->BannerNameIndexes[1]]);
@@ -591,6 +1378,12 @@ char * cartridge_info(const nds_cartridge_t * cart)
             for (int i = 0; i < cart->FileTable->NumFiles; i++)
             {
                 nds_cartridge_file_t * cur_file = cart->FileTable->Files + i;
+                if (cur_file->FileHash == NULL)
+                {
+                    s = sdscatprintf(s, "  %05d %s\n", cur_file->FileID, cur_file->FullFileName);
+                    continue;
+                }
+
                 sha512_to_hex(cur_file->FileHash, hash_buffer);
                 s = sdscatprintf(s, "  %05d %s\n   %.32s ... %.8s\n", cur_file->FileID, cur_file->FullFileName, hash_buffer, hash_buffer + 120);
             }
@@ -6,7 +6,9 @@
 #ifndef _CARTRIDGE_H
 #define _CARTRIDGE_H
 
+#include <stdbool.h>
 #include <stdint.h>
+#include "io_helper.h"
 #include "libraries/CryptLib/LibMd5.h"
 #include "libraries/CryptLib/LibSha1.h"
 #include "libraries/CryptLib/LibSha256.h"
@@ -14,11 +16,42 @@
 
 
 // Structs
+typedef enum nds_cartridge_load_e
+{
+    CART_LOAD_HEAP = 0, // Data was malloc'd and the file read into it.
+    CART_LOAD_MMAP, // Data is a read-only view over the page cache.
+    CART_LOAD_STREAM, // Data holds only the header; everything else is pread on demand.
+    CART_LOAD_BORROWED, // Data belongs to the caller and must outlive the cart.
+} nds_cartridge_load_t;
+typedef enum nds_rom_kind_e
+{
+    ROM_KIND_NONE = 0, // Doesn't look like a DS ROM at all.
+    ROM_KIND_NTR, // Plain DS.
+    ROM_KIND_TWL, // DSi enhanced or DSi only (UnitCode bit 1).
+    ROM_KIND_HOMEBREW,
+} nds_rom_kind_t;
+typedef enum nds_cartridge_catalog_e
+{
+    CART_CATALOG_OFF = 0, // The full audit: every byte read and hashed.
+    CART_CATALOG_HEADER, // Header and banner only, by pread.  Nothing is hashed.
+    CART_CATALOG_FILES, // As above plus the FAT/FNT file listing, still unhashed.
+} nds_cartridge_catalog_t;
+typedef struct nds_load_options_s
+{
+    nds_cartridge_load_t LoadMode; // MMAP maps when it can and reads when it can't.
+    size_t MemoryLimit; // Ceiling on the buffers a streamed load holds at once.  0 == default.
+    bool Cold; // Keep the ROM out of the page cache.  Mapping can't, so MMAP reads instead.
+    nds_cartridge_catalog_t Catalog; // Anything but OFF streams regardless of LoadMode.
+    bool Xattr; // Trust digests stamped on the file itself, and stamp the ones we work out.
+} nds_load_options_t;
 typedef struct nds_cartridge_s
 {
     int Status; // 0 == good, < 0 == validation failed and only the base hash will be available.
     size_t Size; // Must be a power of 2, if it isn't this is either homebrew or a trimmed/overdumped rom
     uint8_t * Data; // Pointer to blob of data, it should match the headers we have defined elsewhere
+    nds_cartridge_load_t LoadMode; // How Data was acquired and therefore how it must be released.
+    io_stats_t IoStats; // What loading it cost (streamed carts keep adding to this).
+    nds_cartridge_catalog_t Catalog; // Catalogued carts have no hashes at all.
 
     uint32_t CartCrc;
     SHA512_HASH * CartHash;
@@ -32,12 +65,48 @@ typedef struct nds_cartridge_s
     SHA512_HASH * Arm7OverlayHash;
     struct nds_cartridge_banner_s * Banner;
     struct nds_cartridge_filetable_s * FileTable;
+    SHA512_HASH * StampedFileHashes; // By file ID, off the xattr.  The file table takes these instead of hashing.
+    unsigned int NumStampedFiles;
+    struct nds_cartridge_stream_s * Stream; // Only streamed carts have one.
 } nds_cartridge_t;
 
 
 // Decs
-nds_cartridge_t * create_nds_cartridge(FILE * fp);
+// The file must stay open until the cart has been freed.  Options may be NULL.
+nds_cartridge_t * create_nds_cartridge(FILE * fp, const nds_load_options_t * options);
+nds_cartridge_t * create_nds_cartridge_from_memory(uint8_t * data, size_t size);
+
+// ROMs that aren't files of their own (archive members, say) are streamed
+// through read, which fills buf from offset and says how much it managed.
+// Of the options only MemoryLimit and Catalog apply.  Context has to
+// outlive the cart.
+typedef size_t (*nds_read_t)(void * context, void * buf, size_t buflen, size_t offset);
+nds_cartridge_t * create_nds_cartridge_from_reader(nds_read_t read, void * context, size_t size, const nds_load_options_t * options);
+
+// Some ROMs can only be read once, front to back (a tar member, say).
+// Everything is hashed on the way past, so all the cart keeps is the
+// start of the ROM up to the last table it parses.  When that won't fit
+// in MemoryLimit beside the digest buffer the cart is refused (NULL), and
+// can_stream_nds_forward says so beforehand going by the start of the
+// header (nds_sniff_size bytes is plenty).  The reader is done with by
+// the time the cart is returned.
+typedef size_t (*nds_read_next_t)(void * context, void * buf, size_t buflen);
+nds_cartridge_t * create_nds_cartridge_from_stream(nds_read_next_t read, void * context, size_t size, const nds_load_options_t * options);
+bool can_stream_nds_forward(const uint8_t * buf, size_t buflen, size_t size, const nds_load_options_t * options);
 void free_nds_cartridge(nds_cartridge_t * cart);
 char * cartridge_info(const nds_cartridge_t * cart);
 
+// Sniffing.  Judges a file by the start of its header (nds_sniff_size
+// bytes is plenty) without loading or validating the rest of it.
+extern const size_t nds_sniff_size;
+nds_rom_kind_t sniff_nds_header(const uint8_t * buf, size_t buflen);
+
+// What a streamed cart holds at most when its options leave MemoryLimit 0.
+extern const size_t nds_default_memory_limit;
+
+// Access to parts of the ROM that works regardless of how it was loaded.
+uint8_t * get_cart_bytes(const nds_cartridge_t * cart, size_t offset, size_t length);
+SHA512_HASH * get_cart_range_sha512(const nds_cartridge_t * cart, size_t offset, size_t length);
+void get_cart_io_stats(const nds_cartridge_t * cart, io_stats_t * out_stats);
+
 #endif
@@ -28,6 +28,7 @@ typedef struct __attribute__((__packed__)) ndsBanner_s
     uint8_t BannerNameS[256];
     uint8_t BannerNameC[256]; // Exists only in v2
 } ndsBanner_t;
+const size_t nds_banner_size = sizeof(ndsBanner_t);
 
 
 // Constructor / Destructor
@@ -45,8 +46,9 @@ void create_banner(const nds_cartridge_t * cart, nds_cartridge_banner_t * out_ba
 
     // The structure is very flat.  Extract, hash, and re-encode
     // those pesky UTF16 strings into UTF8.
-    ndsBanner_t * banner = ((ndsBanner_t *)(cart->Data + header->IconBannerOffset));
-    out_banner->BannerHash = get_sha512(banner->Banner, sizeof(banner->Banner));
+    ndsBanner_t * banner = ((ndsBanner_t *)get_cart_bytes(cart, header->IconBannerOffset, sizeof(ndsBanner_t)));
+    if (cart->Catalog == CART_CATALOG_OFF)
+        out_banner->BannerHash = get_sha512(banner->Banner, sizeof(banner->Banner));
 
     uint8_t * name_table[] = { banner->BannerNameJ, banner->BannerNameE, banner->BannerNameF, banner->BannerNameG, banner->BannerNameI, banner->BannerNameS, banner->BannerNameC };
     int name_cnt = (banner->BannerVersion >= 2) ? 7 : 6;
@@ -6,6 +6,7 @@
 #ifndef _CARTRIDGE_BANNER_H
 #define _CARTRIDGE_BANNER_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include "cartridge.h"
 
@@ -27,4 +28,7 @@ void free_banner(nds_cartridge_banner_t * banner);
 
 int validate_cartridge_banner(const nds_cartridge_t * cart);
 
+// How much of the ROM the banner takes up, from IconBannerOffset on.
+extern const size_t nds_banner_size;
+
 #endif
@@ -33,6 +33,10 @@ typedef struct __attribute__((__packed__)) ndsFntEntry_s
 } ndsFntEntry_t;
 
 
+// Decs
+static SHA512_HASH * hash_file(const nds_cartridge_t *, const nds_cartridge_filetable_t *, int, const ndsFat_t *);
+
+
 // Constructor / Destructor
 void create_filetable(const nds_cartridge_t * cart, nds_cartridge_filetable_t * out_table)
 {
@@ -47,8 +51,9 @@ void create_filetable(const nds_cartridge_t * cart, nds_cartridge_filetable_t *
         return;
 
     sds messages = sdsempty();
-    ndsFat_t * fat = ((ndsFat_t *)(cart->Data + header->FileAllocationTableOffset));
-    ndsFnt_t * fnt = ((ndsFnt_t *)(cart->Data + header->FileNameTableOffset));
+    ndsFat_t * fat = ((ndsFat_t *)get_cart_bytes(cart, header->FileAllocationTableOffset, header->FileAllocationTableLength));
+    uint8_t * fnt_base = get_cart_bytes(cart, header->FileNameTableOffset, header->FileNameTableLength);
+    ndsFnt_t * fnt = ((ndsFnt_t *)fnt_base);
 
     out_table->NumFiles = header->FileAllocationTableLength / sizeof(ndsFat_t);
     out_table->NumDirectories = fnt[0].DirectoryCountOrParentID;
@@ -78,12 +83,13 @@ void create_filetable(const nds_cartridge_t * cart, nds_cartridge_filetable_t *
 
         // Now we start allocating the file and directory names.
         // Files also need to be hashed.  For our purposes that's all we need.
-        int cur_offset = header->FileNameTableOffset + fnt[i].NameOffset;
+        // Offsets from here on are relative to the start of the FNT.
+        int cur_offset = fnt[i].NameOffset;
         int file_index_base = fnt[i].FileID;
         for (int j = 0;; j++)
         {
             // This struct is of variable size.  Get the offsets.
-            uint8_t * name_len_ptr = cart->Data + cur_offset;
+            uint8_t * name_len_ptr = fnt_base + cur_offset;
             int name_len = ((*name_len_ptr) & 0x7F);
             bool is_dir = ((*name_len_ptr) & 0x80);
             uint8_t * name_ptr = name_len_ptr + 1;
@@ -114,7 +120,8 @@ void create_filetable(const nds_cartridge_t * cart, nds_cartridge_filetable_t *
                 cur_file->DirectoryID = cur_directory->DirectoryID;
                 cur_file->FileName = name;
                 cur_file->FileSize = fat[file_index].FileEnd - fat[file_index].FileStart;
-                cur_file->FileHash = get_sha512(cart->Data + fat[file_index].FileStart, cur_file->FileSize);
+                if (cart->Catalog == CART_CATALOG_OFF)
+                    cur_file->FileHash = hash_file(cart, out_table, file_index, fat);
             }
 
             // Move our pointer up
@@ -134,7 +141,8 @@ void create_filetable(const nds_cartridge_t * cart, nds_cartridge_filetable_t *
             cur_file->DirectoryID = 0;
             asprintf(&(cur_file->FileName), "_unnamed_file_%08d", file_index);
             cur_file->FileSize = fat[file_index].FileEnd - fat[file_index].FileStart;
-            cur_file->FileHash = get_sha512(cart->Data + fat[file_index].FileStart, cur_file->FileSize);
+            if (cart->Catalog == CART_CATALOG_OFF)
+                cur_file->FileHash = hash_file(cart, out_table, file_index, fat);
         }
 
         assert(cur_file->FileID == file_index);
@@ -221,6 +229,41 @@ void free_filetable(nds_cartridge_filetable_t * table)
     clear_filetable(table);
     free(table);
 }
+unsigned int list_filetable_ranges(const nds_cartridge_t * cart, size_t ** out_ranges)
+{
+    assert(cart != NULL);
+    assert(out_ranges != NULL);
+
+    // Same early out as create_filetable; no names means nothing hashed.
+    ndsHeader_t * header = ((ndsHeader_t *)(cart->Data));
+    *out_ranges = NULL;
+    if (header->FileAllocationTableLength == 0 || header->FileNameTableLength == 0)
+        return 0;
+
+    ndsFat_t * fat = ((ndsFat_t *)get_cart_bytes(cart, header->FileAllocationTableOffset, header->FileAllocationTableLength));
+    unsigned int num_files = header->FileAllocationTableLength / sizeof(ndsFat_t);
+    *out_ranges = malloc(sizeof(size_t) * 2 * (num_files + 1));
+    for (unsigned int i = 0; i < num_files; i++)
+    {
+        (*out_ranges)[i * 2] = fat[i].FileStart;
+        (*out_ranges)[i * 2 + 1] = fat[i].FileEnd - fat[i].FileStart;
+    }
+
+    return num_files;
+}
+static SHA512_HASH * hash_file(const nds_cartridge_t * cart, const nds_cartridge_filetable_t * table, int file_index, const ndsFat_t * fat)
+{
+    // Digests stamped on the ROM save reading the file at all, as long as
+    // there's one for every file the table lists.
+    if (cart->StampedFileHashes != NULL && cart->NumStampedFiles == table->NumFiles)
+    {
+        SHA512_HASH * ret = malloc(sizeof(SHA512_HASH));
+        *ret = cart->StampedFileHashes[file_index];
+        return ret;
+    }
+
+    return get_cart_range_sha512(cart, fat[file_index].FileStart, fat[file_index].FileEnd - fat[file_index].FileStart);
+}
 
 
 // Validation
@@ -239,7 +282,7 @@ int validate_cartridge_filetable(const nds_cartridge_t * cart)
         if (header->FileAllocationTableOffset + header->FileAllocationTableLength >= cart->Size)
             return -20;
 
-        ndsFat_t * fat = ((ndsFat_t *)(cart->Data + header->FileAllocationTableOffset));
+        ndsFat_t * fat = ((ndsFat_t *)get_cart_bytes(cart, header->FileAllocationTableOffset, header->FileAllocationTableLength));
         for (int i = 0; i < header->FileAllocationTableLength / sizeof(ndsFat_t); i++)
         {
             if (fat[i].FileEnd - fat[i].FileStart < 0)
@@ -258,7 +301,8 @@ int validate_cartridge_filetable(const nds_cartridge_t * cart)
         if (header->FileNameTableLength < sizeof(ndsFnt_t))
             return -31;
 
-        ndsFnt_t * fnt = ((ndsFnt_t *)(cart->Data + header->FileNameTableOffset));
+        uint8_t * fnt_base = get_cart_bytes(cart, header->FileNameTableOffset, header->FileNameTableLength);
+        ndsFnt_t * fnt = ((ndsFnt_t *)fnt_base);
         int num_dirs = fnt[0].DirectoryCountOrParentID;
         if (num_dirs * sizeof(ndsFnt_t) >= header->FileNameTableLength)
             return -31;
@@ -274,16 +318,16 @@ int validate_cartridge_filetable(const nds_cartridge_t * cart)
             if (i > 0 && (fnt[i].DirectoryCountOrParentID & 0x0FFF) >= num_dirs)
                 return -33;
 
-            int cur_offset = header->FileNameTableOffset + fnt[i].NameOffset;
+            int cur_offset = fnt[i].NameOffset;
             int file_index_base = fnt[i].FileID;
             for (int j = 0;; j++)
             {
-                if (cur_offset >= header->FileNameTableOffset + header->FileNameTableLength)
+                if (cur_offset >= header->FileNameTableLength)
                     return -32;
 
 
                 // This struct is of variable size.  Get the offsets.
-                uint8_t * name_len_ptr = cart->Data + cur_offset;
+                uint8_t * name_len_ptr = fnt_base + cur_offset;
                 int name_len = ((*name_len_ptr) & 0x7F);
                 bool is_dir = ((*name_len_ptr) & 0x80);
                 uint8_t * name_ptr = name_len_ptr + 1;
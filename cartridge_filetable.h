@@ -58,6 +58,11 @@ void create_filetable(const nds_cartridge_t * cart, nds_cartridge_filetable_t *
 nds_cartridge_filetable_t * load_filetable(const nds_cartridge_t * cart);
 void clear_filetable(nds_cartridge_filetable_t * table);
 void free_filetable(nds_cartridge_filetable_t * table);
+// Where each file create_filetable hashes sits, by file ID, for loads
+// that have to hash them before the table is built.  Offset and length
+// pairs, one per file; the count is returned and the array is the
+// caller's to free.
+unsigned int list_filetable_ranges(const nds_cartridge_t * cart, size_t ** out_ranges);
 
 int validate_cartridge_filetable(const nds_cartridge_t * cart);
 
@@ -0,0 +1,167 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "cartridge.h"
+#include "cartridge_filetable.h"
+#include "cartridge_xattr.h"
+
+
+// The attribute as it exists on disk.  Host byte order; the header
+// structs make the same assumption.
+typedef struct __attribute__((__packed__)) cart_xattr_s
+{
+    uint32_t Version;
+    uint32_t Regions; // Which of RegionHashes are real, by xattr_region_t bit.
+    uint64_t Size;
+    int64_t MtimeNs;
+    uint32_t CartCrc;
+    SHA512_HASH CartHash;
+    SHA512_HASH RegionHashes[4];
+} cart_xattr_t;
+typedef struct __attribute__((__packed__)) cart_files_xattr_s
+{
+    uint32_t Version;
+    uint32_t NumFiles;
+    uint64_t Size;
+    int64_t MtimeNs;
+    SHA512_HASH FileHashes[]; // By file ID
+} cart_files_xattr_t;
+typedef enum xattr_region_e
+{
+    XATTR_ARM9 = 0,
+    XATTR_ARM7,
+    XATTR_ARM9_OVERLAY,
+    XATTR_ARM7_OVERLAY,
+} xattr_region_t;
+
+static const char * xattr_name = "user.ungood.digest";
+static const char * files_xattr_name = "user.ungood.files";
+static const uint32_t xattr_version = 1;
+
+
+// Decs
+static void load_files_xattr(nds_cartridge_t *, int, const struct stat *);
+static void store_files_xattr(const nds_cartridge_t *, int, const struct stat *);
+static SHA512_HASH * copy_hash(const SHA512_HASH *);
+
+
+// Procs
+bool load_cart_xattr(nds_cartridge_t * cart, int fd, const struct stat * st)
+{
+    assert(cart != NULL);
+    assert(st != NULL);
+
+    cart_xattr_t record;
+    if (!S_ISREG(st->st_mode) || fgetxattr(fd, xattr_name, &record, sizeof(record)) != sizeof(record))
+        return false;
+    if (record.Version != xattr_version || record.Size != (uint64_t)st->st_size || record.MtimeNs != stat_mtime_ns(st))
+        return false;
+
+    cart->CartCrc = record.CartCrc;
+    cart->CartHash = copy_hash(&record.CartHash);
+    if (record.Regions & (1 << XATTR_ARM9))
+        cart->Arm9Hash = copy_hash(record.RegionHashes + XATTR_ARM9);
+    if (record.Regions & (1 << XATTR_ARM7))
+        cart->Arm7Hash = copy_hash(record.RegionHashes + XATTR_ARM7);
+    if (record.Regions & (1 << XATTR_ARM9_OVERLAY))
+        cart->Arm9OverlayHash = copy_hash(record.RegionHashes + XATTR_ARM9_OVERLAY);
+    if (record.Regions & (1 << XATTR_ARM7_OVERLAY))
+        cart->Arm7OverlayHash = copy_hash(record.RegionHashes + XATTR_ARM7_OVERLAY);
+    load_files_xattr(cart, fd, st);
+    return true;
+}
+void store_cart_xattr(const nds_cartridge_t * cart, int fd, const struct stat * st)
+{
+    assert(cart != NULL);
+    assert(st != NULL);
+
+    if (cart->CartHash == NULL || !S_ISREG(st->st_mode))
+        return;
+
+    // Only stamp what we actually read.  If the file moved underneath us
+    // (or may yet, unnoticed) leave it for next time.
+    struct stat now;
+    if (fstat(fd, &now) != 0 || now.st_size != st->st_size || stat_mtime_ns(&now) != stat_mtime_ns(st))
+        return;
+    if (is_mtime_racy(stat_mtime_ns(st)))
+        return;
+
+    cart_xattr_t record;
+    memset(&record, 0, sizeof(record));
+    record.Version = xattr_version;
+    record.Size = st->st_size;
+    record.MtimeNs = stat_mtime_ns(st);
+    record.CartCrc = cart->CartCrc;
+    record.CartHash = *cart->CartHash;
+
+    const SHA512_HASH * regions[4] = { cart->Arm9Hash, cart->Arm7Hash, cart->Arm9OverlayHash, cart->Arm7OverlayHash };
+    for (int i = 0; i < 4; i++)
+    {
+        if (regions[i] == NULL)
+            continue;
+
+        record.Regions |= 1 << i;
+        record.RegionHashes[i] = *regions[i];
+    }
+
+    // Read-only media, filesystems without user xattrs, files that aren't
+    // ours...  None of that is worth a complaint; it just means no stamp.
+    fsetxattr(fd, xattr_name, &record, sizeof(record), 0);
+    store_files_xattr(cart, fd, st);
+}
+static void load_files_xattr(nds_cartridge_t * cart, int fd, const struct stat * st)
+{
+    // Optional, and checked against the file the same way the main record is.
+    ssize_t length = fgetxattr(fd, files_xattr_name, NULL, 0);
+    if (length < (ssize_t)sizeof(cart_files_xattr_t))
+        return;
+
+    cart_files_xattr_t * record = malloc(length);
+    bool good = fgetxattr(fd, files_xattr_name, record, length) == length && record->Version == xattr_version;
+    good = good && record->Size == (uint64_t)st->st_size && record->MtimeNs == stat_mtime_ns(st);
+    good = good && (size_t)length == sizeof(cart_files_xattr_t) + sizeof(SHA512_HASH) * record->NumFiles;
+    if (good && record->NumFiles > 0)
+    {
+        cart->NumStampedFiles = record->NumFiles;
+        cart->StampedFileHashes = malloc(sizeof(SHA512_HASH) * record->NumFiles);
+        memcpy(cart->StampedFileHashes, record->FileHashes, sizeof(SHA512_HASH) * record->NumFiles);
+    }
+    free(record);
+}
+static void store_files_xattr(const nds_cartridge_t * cart, int fd, const struct stat * st)
+{
+    // Every file has to have its digest or the record is no use.  A
+    // filesystem with no room for it (E2BIG, ENOSPC) is no worse off.
+    const nds_cartridge_filetable_t * table = cart->FileTable;
+    if (table == NULL || table->NumFiles == 0)
+        return;
+
+    size_t length = sizeof(cart_files_xattr_t) + sizeof(SHA512_HASH) * table->NumFiles;
+    cart_files_xattr_t * record = malloc(length);
+    record->Version = xattr_version;
+    record->NumFiles = table->NumFiles;
+    record->Size = st->st_size;
+    record->MtimeNs = stat_mtime_ns(st);
+    bool complete = true;
+    for (unsigned int i = 0; i < table->NumFiles && complete; i++)
+    {
+        complete = (table->Files[i].FileHash != NULL);
+        if (complete)
+            record->FileHashes[i] = *table->Files[i].FileHash;
+    }
+
+    if (complete)
+        fsetxattr(fd, files_xattr_name, record, length, 0);
+    free(record);
+}
+static SHA512_HASH * copy_hash(const SHA512_HASH * hash)
+{
+    SHA512_HASH * ret = malloc(sizeof(SHA512_HASH));
+    *ret = *hash;
+    return ret;
+}
@@ -0,0 +1,32 @@
+/* Digests can be left on the ROM itself in a user.* extended attribute so
+ * they travel with it (rsync -X, tar --xattrs, most backup tools) instead
+ * of living in one machine's cache.  Each record is stamped with the size
+ * and mtime of the file it was made from and is only trusted while both
+ * still match.
+ *
+ * What's kept is what costs a pass over the whole ROM: the cart CRC32 and
+ * SHA-512, plus the ARM9/ARM7 and overlay hashes.  The banner and file
+ * table are small and are always read fresh.
+ *
+ * The files in the file table cover most of the ROM between them, so
+ * their digests go in a second attribute (user.ungood.files, 64 bytes a
+ * file) where the filesystem will take it.  Plenty won't: ext4 without
+ * ea_inode fits all of a file's attributes in one 4K block, which is a
+ * few dozen files' worth.  A ROM whose file digests didn't fit still
+ * has its files hashed, which reads most of it.
+ */
+
+#ifndef _CARTRIDGE_XATTR_H
+#define _CARTRIDGE_XATTR_H
+
+#include <stdbool.h>
+#include <sys/stat.h>
+#include "cartridge.h"
+
+
+// Procs
+// st is the file as it was before anything was read from it.
+bool load_cart_xattr(nds_cartridge_t * cart, int fd, const struct stat * st);
+void store_cart_xattr(const nds_cartridge_t * cart, int fd, const struct stat * st);
+
+#endif
@@ -12,11 +12,16 @@
 /* Misc helper procs for converting between hex strings and byte arrays.
  * They don't do any validation so it's assumed you're not screwing around.
  **/
+static const uint32_t digest_slice_size = 256 * 1024; // Comfortably inside L2
+static uint8_t zero_slice[64 * 1024];
 
 
 // Decs
 static void byte_to_hex(uint8_t, char *);
 static uint8_t hex_to_byte(const char * hex);
+static uint32_t crc32_skip_zeros(uint32_t, size_t);
+static uint32_t gf2_matrix_times(const uint32_t *, uint32_t);
+static void gf2_matrix_square(uint32_t *, const uint32_t *);
 
 
 // Blob to hash
@@ -85,6 +90,107 @@ SHA512_HASH * get_sha512(void * buf, size_t buflen)
     return sha512Hash;
 }
 
+// Chunk by chunk
+void digest_init(digest_context_t * ctx)
+{
+    assert(ctx != NULL);
+
+    ctx->Crc = 0xFFFFFFFF;
+    Sha512Initialise(&ctx->Sha512);
+}
+void digest_update(digest_context_t * ctx, const void * buf, size_t buflen)
+{
+    assert(ctx != NULL);
+    assert(buf != NULL || buflen == 0);
+
+    // Both digests take a slice at a time so the SHA512 pass finds the
+    // bytes the CRC just pulled in still sitting in cache.
+    while (buflen > 0)
+    {
+        uint32_t slice = (buflen > digest_slice_size) ? digest_slice_size : (uint32_t)buflen;
+        ctx->Crc = crc32buf_update(ctx->Crc, buf, slice);
+        Sha512Update(&ctx->Sha512, (void *)buf, slice);
+        buf = (const uint8_t *)buf + slice;
+        buflen -= slice;
+    }
+}
+void digest_update_zeros(digest_context_t * ctx, size_t count)
+{
+    assert(ctx != NULL);
+
+    // The CRC of a run of zeros is a few matrix squarings no matter how
+    // long it is.  SHA512 has no such shortcut; it still has to chew
+    // through every block, but at least they come out of one small
+    // buffer rather than off the disk.
+    ctx->Crc = crc32_skip_zeros(ctx->Crc, count);
+    while (count > 0)
+    {
+        size_t slice = (count > sizeof(zero_slice)) ? sizeof(zero_slice) : count;
+        Sha512Update(&ctx->Sha512, zero_slice, slice);
+        count -= slice;
+    }
+}
+void digest_finish(digest_context_t * ctx, uint32_t * out_crc, SHA512_HASH * out_hash)
+{
+    assert(ctx != NULL);
+
+    if (out_crc != NULL)
+        *out_crc = ~ctx->Crc;
+    if (out_hash != NULL)
+        Sha512Finalise(&ctx->Sha512, out_hash);
+}
+static uint32_t crc32_skip_zeros(uint32_t crc, size_t count)
+{
+    // Feeding the CRC register a zero bit is linear in the register, so
+    // count zero bytes is that operator raised to the 8*count.  Same trick
+    // as zlib's crc32_combine: build the one-bit operator and square it up
+    // through the bits of count.
+    uint32_t even[32];
+    uint32_t odd[32];
+    odd[0] = 0xedb88320; // The reflected CRC-32 polynomial
+    for (int n = 1; n < 32; n++)
+    {
+        odd[n] = 1u << (n - 1);
+    }
+    gf2_matrix_square(even, odd); // 2 bits
+    gf2_matrix_square(odd, even); // 4 bits
+
+    while (count > 0)
+    {
+        gf2_matrix_square(even, odd); // 8 bits (1 byte) the first time around
+        if (count & 1)
+            crc = gf2_matrix_times(even, crc);
+        count >>= 1;
+        if (count == 0)
+            break;
+
+        gf2_matrix_square(odd, even);
+        if (count & 1)
+            crc = gf2_matrix_times(odd, crc);
+        count >>= 1;
+    }
+
+    return crc;
+}
+static uint32_t gf2_matrix_times(const uint32_t * mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+    for (; vec != 0; vec >>= 1, mat++)
+    {
+        if (vec & 1)
+            sum ^= *mat;
+    }
+
+    return sum;
+}
+static void gf2_matrix_square(uint32_t * square, const uint32_t * mat)
+{
+    for (int n = 0; n < 32; n++)
+    {
+        square[n] = gf2_matrix_times(mat, mat[n]);
+    }
+}
+
 // Hash to hex string
 void md5_to_hex(const MD5_HASH * hash, char * out_hex)
 {
@@ -16,6 +16,18 @@ SHA1_HASH * get_sha1(void * buf, size_t buflen);
 SHA256_HASH * get_sha256(void * buf, size_t buflen);
 SHA512_HASH * get_sha512(void * buf, size_t buflen);
 
+// Chunk by chunk (for data that never sits in memory all at once)
+// Produces the same CRC32 and SHA512 as the blob versions above.
+typedef struct digest_context_s
+{
+    uint32_t Crc;
+    Sha512Context Sha512;
+} digest_context_t;
+void digest_init(digest_context_t * ctx);
+void digest_update(digest_context_t * ctx, const void * buf, size_t buflen);
+void digest_update_zeros(digest_context_t * ctx, size_t count); // Same as count zero bytes, without the bytes
+void digest_finish(digest_context_t * ctx, uint32_t * out_crc, SHA512_HASH * out_hash);
+
 
 // Hash to hex string
 void md5_to_hex(const MD5_HASH * hash, char * out_hex);
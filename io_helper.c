@@ -0,0 +1,309 @@
+#define _GNU_SOURCE // O_DIRECT
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include "io_helper.h"
+
+/* Misc helper procs for getting bytes off the disk.  The plain syscalls
+ * are allowed to hand back less than you asked for, which is never what
+ * the callers in here want.
+ **/
+static const size_t direct_io_alignment = 4096; // Covers every logical block size we'll meet
+static const size_t huge_page_size = 2 * 1024 * 1024;
+static const size_t huge_page_threshold = 8 * 1024 * 1024; // Below this it's not worth rounding up to 2M
+const int64_t racy_mtime_ns = 2000000000ll;
+
+
+// Reading and writing
+size_t pread_fully(int fd, void * buf, size_t buflen, off_t offset)
+{
+    assert(buf != NULL || buflen == 0);
+
+    // Returns how much was actually read.  Anything short of buflen means
+    // we hit the end of the file or the read failed outright.
+    size_t total = 0;
+    while (total < buflen)
+    {
+        ssize_t ret = pread(fd, (uint8_t *)buf + total, buflen - total, offset + total);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+
+        total += ret;
+    }
+
+    return total;
+}
+bool write_fully(int fd, const void * buf, size_t buflen)
+{
+    assert(buf != NULL || buflen == 0);
+
+    const uint8_t * pos = buf;
+    while (buflen > 0)
+    {
+        ssize_t wrote = write(fd, pos, buflen);
+        if (wrote < 0 && errno == EINTR)
+            continue;
+        if (wrote <= 0)
+            return false;
+
+        pos += wrote;
+        buflen -= wrote;
+    }
+
+    return true;
+}
+
+// Reading (cold)
+int open_direct(int fd)
+{
+    // Reopening through /proc gets us a separate open file description
+    // so the O_DIRECT flag doesn't leak into the caller's FILE.  tmpfs and
+    // friends refuse O_DIRECT outright, which is fine; they ARE the cache.
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    return open(path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+}
+size_t pread_direct(int fd, void * buf, size_t buflen, off_t offset)
+{
+    assert(is_direct_aligned(buf, buflen, offset));
+
+    // Same as pread_fully except an unaligned short read can only be the
+    // end of the file, and going back for more there would be refused.
+    size_t total = 0;
+    while (total < buflen)
+    {
+        ssize_t ret = pread(fd, (uint8_t *)buf + total, buflen - total, offset + total);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+
+        total += ret;
+        if (ret % direct_io_alignment != 0)
+            break;
+    }
+
+    return total;
+}
+size_t pread_dropping(int fd, void * buf, size_t buflen, off_t offset)
+{
+    // DONTNEED only drops clean pages nobody else has mapped, so this
+    // can't hurt another process that actually wanted the file.
+    // The kernel only drops whole pages inside the range, so widen it out
+    // to take the partial pages at either end with it.
+    size_t got = pread_fully(fd, buf, buflen, offset);
+    off_t start = offset & ~(off_t)(direct_io_alignment - 1);
+    posix_fadvise(fd, start, align_direct(offset + got - start), POSIX_FADV_DONTNEED);
+    return got;
+}
+void * alloc_direct(size_t size)
+{
+    void * ret = NULL;
+    if (posix_memalign(&ret, direct_io_alignment, align_direct(size)) != 0)
+        return NULL;
+    return ret;
+}
+size_t align_direct(size_t size)
+{
+    return (size + direct_io_alignment - 1) & ~(direct_io_alignment - 1);
+}
+bool is_direct_aligned(const void * buf, size_t buflen, off_t offset)
+{
+    return ((uintptr_t)buf % direct_io_alignment) == 0 && (buflen % direct_io_alignment) == 0 && (offset % direct_io_alignment) == 0;
+}
+
+// Large buffers
+void * alloc_large(size_t size)
+{
+    if (size < huge_page_threshold)
+        return alloc_direct(size);
+
+    // Pages the admin set aside in hugetlbfs if there are any, and
+    // otherwise ordinary memory that khugepaged and the fault handler are
+    // asked to back with transparent huge pages.
+    size_t length = (size + huge_page_size - 1) & ~(huge_page_size - 1);
+    void * ret = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ret != MAP_FAILED)
+        return ret;
+
+    ret = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ret == MAP_FAILED)
+        return NULL;
+
+    madvise(ret, length, MADV_HUGEPAGE);
+    return ret;
+}
+void * realloc_large(void * buf, size_t size, size_t new_size)
+{
+    // Mappings grow and shrink in place or get moved by the kernel without
+    // a copy.  Only a buffer that starts or ends up small gets copied.
+    if (buf == NULL)
+        return alloc_large(new_size);
+    if (size >= huge_page_threshold && new_size >= huge_page_threshold)
+    {
+        size_t length = (size + huge_page_size - 1) & ~(huge_page_size - 1);
+        size_t new_length = (new_size + huge_page_size - 1) & ~(huge_page_size - 1);
+        if (length == new_length)
+            return buf;
+
+        void * ret = mremap(buf, length, new_length, MREMAP_MAYMOVE);
+        if (ret != MAP_FAILED)
+            return ret;
+    }
+
+    void * ret = alloc_large(new_size);
+    if (ret == NULL)
+        return NULL;
+
+    memcpy(ret, buf, (size < new_size) ? size : new_size);
+    free_large(buf, size);
+    return ret;
+}
+void free_large(void * buf, size_t size)
+{
+    if (buf == NULL)
+        return;
+
+    if (size < huge_page_threshold)
+        free(buf);
+    else
+        munmap(buf, (size + huge_page_size - 1) & ~(huge_page_size - 1));
+}
+void get_thread_faults(size_t * out_minor, size_t * out_major)
+{
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    getrusage(RUSAGE_THREAD, &usage);
+    *out_minor = usage.ru_minflt;
+    *out_major = usage.ru_majflt;
+}
+
+// Holes
+bool is_sparse(int fd)
+{
+    // Fewer blocks than bytes is the cheap tell, but compressed
+    // filesystems say the same about files without a single hole.  Only
+    // a hole that SEEK_HOLE finds before the end counts.  The file offset
+    // goes back where it was for anyone still reading through stdio.
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (off_t)st.st_blocks * 512 >= st.st_size)
+        return false;
+
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    off_t hole = lseek(fd, 0, SEEK_HOLE);
+    if (pos >= 0)
+        lseek(fd, pos, SEEK_SET);
+    return (hole >= 0 && hole < st.st_size);
+}
+size_t next_file_run(int fd, off_t offset, off_t end, bool * out_hole)
+{
+    assert(out_hole != NULL);
+    assert(offset < end);
+
+    // SEEK_DATA and SEEK_HOLE move the file offset, which is fine as
+    // everybody in here uses pread.  ENXIO means it's hole from here to
+    // the end of the file; anything else means the filesystem can't tell.
+    *out_hole = false;
+    off_t data = lseek(fd, offset, SEEK_DATA);
+    if (data < 0)
+    {
+        *out_hole = (errno == ENXIO);
+        return end - offset;
+    }
+    if (data > offset)
+    {
+        *out_hole = true;
+        return ((data < end) ? data : end) - offset;
+    }
+
+    off_t hole = lseek(fd, offset, SEEK_HOLE);
+    if (hole <= offset || hole > end)
+        hole = end;
+    return hole - offset;
+}
+
+// Devices
+bool is_rotational(dev_t device)
+{
+    // sysfs knows for whole disks, and a partition's disk is one level up.
+    // Anything without a block device behind it (network, tmpfs, fuse) or
+    // a sysfs to ask is taken to be fine with seeking.
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/rotational", major(device), minor(device));
+    FILE * fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/rotational", major(device), minor(device));
+        fp = fopen(path, "r");
+    }
+    if (fp == NULL)
+        return false;
+
+    int rotational = 0;
+    if (fscanf(fp, "%d", &rotational) != 1)
+        rotational = 0;
+    fclose(fp);
+
+    return (rotational != 0);
+}
+bool get_physical_offset(int fd, uint64_t * out_offset)
+{
+    assert(out_offset != NULL);
+
+    // One extent is all it takes; FIEMAP hands back the first one that
+    // covers the range.  Extents that haven't been allocated yet (delayed
+    // allocation) or that live somewhere odd have nowhere useful to say.
+    struct fiemap * map = malloc(sizeof(struct fiemap) + sizeof(struct fiemap_extent));
+    memset(map, 0, sizeof(struct fiemap) + sizeof(struct fiemap_extent));
+    map->fm_start = 0;
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = 1;
+
+    bool ret = false;
+    if (ioctl(fd, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents > 0)
+    {
+        const struct fiemap_extent * extent = map->fm_extents;
+        if (!(extent->fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_NOT_ALIGNED | FIEMAP_EXTENT_DATA_INLINE)))
+        {
+            *out_offset = extent->fe_physical;
+            ret = true;
+        }
+    }
+
+    free(map);
+    return ret;
+}
+
+
+// Times
+int64_t stat_mtime_ns(const struct stat * st)
+{
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+bool is_mtime_racy(int64_t mtime_ns)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec - mtime_ns < racy_mtime_ns;
+}
+int64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,66 @@
+#ifndef _IO_HELPER_H
+#define _IO_HELPER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+
+// Where the bytes we read came from, and what getting at them cost.
+typedef struct io_stats_s
+{
+    size_t DirectBytes; // O_DIRECT, never touched the page cache
+    size_t CachedBytes; // Through the page cache
+    size_t MinorFaults;
+    size_t MajorFaults; // The ones that had to wait on the disk
+} io_stats_t;
+
+// Reading and writing
+size_t pread_fully(int fd, void * buf, size_t buflen, off_t offset);
+bool write_fully(int fd, const void * buf, size_t buflen); // False if any of it didn't make it
+
+// Reading without leaving a mess in the page cache.  O_DIRECT wants its
+// buffers, offsets and lengths aligned; alloc_direct and align_direct
+// take care of the first and the last.
+int open_direct(int fd); // A second O_DIRECT descriptor for fd, or -1 if the filesystem won't
+size_t pread_direct(int fd, void * buf, size_t buflen, off_t offset);
+size_t pread_dropping(int fd, void * buf, size_t buflen, off_t offset); // Cached read, then evicted
+void * alloc_direct(size_t size); // Release with free()
+size_t align_direct(size_t size);
+bool is_direct_aligned(const void * buf, size_t buflen, off_t offset);
+
+// Whole-ROM sized buffers.  Big ones come in huge pages where the kernel
+// will give us them, so hashing 512M isn't 131072 page faults and as
+// many TLB misses.  Always O_DIRECT friendly.  Free with free_large and
+// the same size.
+void * alloc_large(size_t size);
+void * realloc_large(void * buf, size_t size, size_t new_size); // NULL (and buf untouched) if it can't
+void free_large(void * buf, size_t size);
+void get_thread_faults(size_t * out_minor, size_t * out_major); // Running totals for the calling thread
+
+// Holes.  A sparse file's holes read back as zeros the kernel makes up on
+// the spot; there's no point fetching them.  Filesystems that can't say
+// where the holes are just report one long run of data.
+bool is_sparse(int fd);
+size_t next_file_run(int fd, off_t offset, off_t end, bool * out_hole); // Length of the run at offset
+
+// Devices.  Spinning disks want one reader at a time; seeking between
+// several sequential reads costs far more than the reads themselves.
+bool is_rotational(dev_t device);
+bool get_physical_offset(int fd, uint64_t * out_offset); // Where the first byte is on the device, if the filesystem says
+
+// Modification times.  A file touched within racy_mtime_ns of now could
+// be written again inside the same mtime tick and come out looking
+// untouched, so nothing worked out from it should be saved against that
+// mtime until it has settled.
+extern const int64_t racy_mtime_ns;
+int64_t stat_mtime_ns(const struct stat * st);
+bool is_mtime_racy(int64_t mtime_ns);
+
+// Milliseconds on a clock that only ever goes forward, for timing things.
+int64_t now_ms(void);
+
+
+#endif
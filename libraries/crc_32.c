@@ -156,17 +156,17 @@ Boolean_T crc32file(char *name, DWORD *crc, long *charcnt)
 
 DWORD crc32buf(const uint8_t *buf, size_t len)
 {
-      register DWORD oldcrc32;
-
-      oldcrc32 = 0xFFFFFFFF;
+      return ~crc32buf_update(0xFFFFFFFF, buf, len);
+}
 
+DWORD crc32buf_update(DWORD oldcrc32, const uint8_t *buf, size_t len)
+{
       for ( ; len; --len, ++buf)
       {
             oldcrc32 = UPDC32(*buf, oldcrc32);
       }
 
-      return ~oldcrc32;
-
+      return oldcrc32;
 }
 
 #ifdef TEST
@@ -1,62 +1,1219 @@
-#include <dirent.h>
-#include <sqlite3.h>
+#define _GNU_SOURCE // qsort_r
+#include <getopt.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "cartridge.h"
+#include "scan_cache.h"
+#include "scan_journal.h"
+#include "scanner.h"
+#include "solid_archive.h"
+#include "tar_stream.h"
+#include "unpack_cache.h"
+#include "uring_reader.h"
+#include "watcher.h"
+#include "worker_pool.h"
+#include "zip_archive.h"
+#include "libraries/asprintf.h"
 #include "libraries/sds/sds.h"
 
+// Members of solid archives, by index.  Whichever job gets to a block
+// first unpacks it for every member anyone still wants and leaves their
+// reports here.
+typedef enum solid_state_e
+{
+    SOLID_NONE = 0, // Not a solid member, or already reported on
+    SOLID_WANTED,
+    SOLID_UNPACKING, // Some job is decoding its block
+    SOLID_DONE, // Its report is waiting (NULL if the block was bad)
+} solid_state_t;
+typedef struct solid_unpacks_s
+{
+    const rom_list_t * Roms;
+    size_t * ByPath; // Indexes into Roms, sorted by path
+    solid_state_t * States;
+    char ** Reports;
+    pthread_mutex_t Lock;
+    pthread_cond_t Done;
+} solid_unpacks_t;
+
+// What every job gets handed.  Watch mode's later passes hand it nothing.
+typedef struct rom_job_s
+{
+    uring_reader_t * Reader;
+    size_t * ReaderIndexes; // Our index to the reader's, SIZE_MAX for none.  NULL == the same.
+    char ** Cached; // Reports the journal or scan cache already had, by index.  NULL == not looked up yet.
+    size_t ReaderArena; // The biggest ROM the reader will take
+    solid_unpacks_t * Unpacks; // NULL == each solid member unpacks its own block
+} rom_job_t;
+
+// One go at a solid block, as the members come out of it.
+typedef struct solid_unpack_s
+{
+    solid_unpacks_t * Unpacks;
+    const rom_entry_t * Rom; // Who asked, when there's nowhere to leave reports
+    size_t * Indexes; // Each wanted entry's index in Unpacks->Roms
+    char * Report; // Rom's, when there's nowhere to leave it
+} solid_unpack_t;
+typedef struct solid_reader_s
+{
+    solid_member_t * Member;
+    const uint8_t * Head; // Already read off the member to size up its tables
+    size_t HeadSize;
+    size_t Pos;
+} solid_reader_t;
+typedef struct tar_reader_s
+{
+    tar_stream_t * Stream;
+    const uint8_t * Head; // Already read off the stream to sniff it
+    size_t HeadSize;
+    size_t Pos;
+} tar_reader_t;
+
 // decs
-void checkdir(const char *);
+char * process_rom(const rom_entry_t *, size_t, void *);
+static char * process_file(const rom_entry_t *, FILE *);
+static char * process_stdin(void);
+static char * process_member(const rom_entry_t *);
+static size_t read_member(void *, void *, size_t, size_t);
+static char * process_solid_member(const rom_entry_t *, size_t, solid_unpacks_t *);
+static void unpacked_member(const solid_entry_t *, size_t, solid_member_t *, void *);
+static char * stream_solid_member(const rom_entry_t *, const solid_entry_t *, solid_member_t *);
+static size_t read_solid_next(void *, void *, size_t);
+static size_t read_solid_at(void *, void *, size_t, size_t);
+static char * process_tar(const rom_entry_t *);
+static char * process_tar_member(const rom_entry_t *, tar_stream_t *, bool);
+static size_t read_tar_next(void *, void *, size_t);
+static solid_unpacks_t * create_solid_unpacks(const rom_list_t *, char **);
+static void free_solid_unpacks(solid_unpacks_t *);
+static size_t find_rom_path(const solid_unpacks_t *, const char *);
+static int compare_rom_paths(const void *, const void *, void *);
+static size_t rom_cost(const rom_entry_t *, size_t, void *);
+static unsigned rom_device_limit(const rom_entry_t *, size_t, void *);
+static bool read_by_job(const rom_job_t *, const rom_entry_t *, size_t);
+static bool on_rotational(dev_t);
+static rom_list_t * list_cache_misses(const rom_list_t *, char **, size_t *);
+static void remember_rom(const rom_entry_t *, const nds_cartridge_t *, const char *);
+static char * match_member(const rom_entry_t *);
+static void usage(const char *);
+static size_t parse_size(const char *);
+static void count_io(const io_stats_t *);
 
-int main()
+// How every cart gets loaded.  Set once from the command line.
+static nds_load_options_t load_options = { .LoadMode = CART_LOAD_MMAP };
+static const size_t default_uring_arena = 256 * 1024 * 1024;
+static const unsigned uring_queue_depth = 64;
+static scan_cache_t * scan_cache = NULL;
+static scan_journal_t * scan_journal = NULL;
+static unpack_cache_t * unpack_cache = NULL;
+static const size_t default_unpack_limit = (size_t)2 * 1024 * 1024 * 1024;
+static size_t memory_budget = 0; // 0 == no budget
+static unsigned disk_reads = 1; // ROMs read from each spinning disk at once, 0 == any number
+static bool deep = false; // Hash archive members even when the cache knows them by CRC
+
+// Where the bytes came from, summed over every worker.
+static io_stats_t io_totals;
+static pthread_mutex_t io_totals_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int main(int argc, char ** argv)
 {
-    //Find each file.  And analyze it.
-    checkdir("./roms");
-    checkdir(".");
+    static const struct option long_options[] =
+    {
+        { "read", no_argument, NULL, 'r' },
+        { "stream", no_argument, NULL, 's' },
+        { "memory-limit", required_argument, NULL, 'm' },
+        { "memory-budget", required_argument, NULL, 'B' },
+        { "disk-reads", required_argument, NULL, 'D' },
+        { "jobs", required_argument, NULL, 'j' },
+        { "io-uring", optional_argument, NULL, 'U' },
+        { "cold", no_argument, NULL, 'C' },
+        { "catalog", optional_argument, NULL, 'c' },
+        { "watch", no_argument, NULL, 'w' },
+        { "cache", required_argument, NULL, 'K' },
+        { "xattr", no_argument, NULL, 'X' },
+        { "deep", no_argument, NULL, 'd' },
+        { "unpack-cache", required_argument, NULL, 'P' },
+        { "unpack-limit", required_argument, NULL, 'L' },
+        { "journal", required_argument, NULL, 'J' },
+        { "resume", no_argument, NULL, 'R' },
+        { "stats", no_argument, NULL, 'S' },
+        { "stdin", no_argument, NULL, 'I' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t uring_arena = 0;
+    bool watch = false;
+    const char * cache_path = NULL;
+    const char * unpack_path = NULL;
+    size_t unpack_limit = default_unpack_limit;
+    const char * journal_path = NULL;
+    bool resume = false;
+    bool stats = false;
+    bool from_stdin = false;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "rsm:j:wh", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'j':
+                num_threads = atoi(optarg);
+                if (num_threads < 1)
+                {
+                    fprintf(stderr, "Invalid job count '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'r':
+                load_options.LoadMode = CART_LOAD_HEAP;
+                break;
+            case 's':
+                load_options.LoadMode = CART_LOAD_STREAM;
+                break;
+            case 'C':
+                load_options.Cold = true;
+                break;
+            case 'c':
+                if (optarg == NULL)
+                    load_options.Catalog = CART_CATALOG_HEADER;
+                else if (strcmp(optarg, "files") == 0)
+                    load_options.Catalog = CART_CATALOG_FILES;
+                else
+                {
+                    fprintf(stderr, "Invalid catalog level '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'U':
+                uring_arena = (optarg != NULL) ? parse_size(optarg) : default_uring_arena;
+                if (uring_arena == 0)
+                {
+                    fprintf(stderr, "Invalid io_uring buffer size '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'm':
+                load_options.MemoryLimit = parse_size(optarg);
+                if (load_options.MemoryLimit == 0)
+                {
+                    fprintf(stderr, "Invalid memory limit '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'B':
+                memory_budget = parse_size(optarg);
+                if (memory_budget == 0)
+                {
+                    fprintf(stderr, "Invalid memory budget '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'D':
+                if (sscanf(optarg, "%u", &disk_reads) != 1)
+                {
+                    fprintf(stderr, "Invalid disk read count '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'w':
+                watch = true;
+                break;
+            case 'K':
+                cache_path = optarg;
+                break;
+            case 'X':
+                load_options.Xattr = true;
+                break;
+            case 'd':
+                deep = true;
+                break;
+            case 'P':
+                unpack_path = optarg;
+                break;
+            case 'L':
+                unpack_limit = parse_size(optarg);
+                if (unpack_limit == 0)
+                {
+                    fprintf(stderr, "Invalid unpack cache limit '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'J':
+                journal_path = optarg;
+                break;
+            case 'R':
+                resume = true;
+                break;
+            case 'S':
+                stats = true;
+                break;
+            case 'I':
+                from_stdin = true;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (resume && journal_path == NULL)
+    {
+        fprintf(stderr, "--resume needs a --journal to resume from\n");
+        return 1;
+    }
+    if (journal_path != NULL)
+    {
+        scan_journal = open_scan_journal(journal_path, resume);
+        if (scan_journal == NULL)
+            return 1;
+    }
+
+    // Find each file.  And analyze it.
+    // A root of - is whatever is being piped in.  It's done first so
+    // whoever is writing it isn't left waiting on a walk of the rest.
+    // With no roots given we look where we always have.
+    static char * default_roots[] = { "./roms", "." };
+    char ** roots = argv + optind;
+    int num_roots = 0;
+    for (int i = optind; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-") == 0)
+            from_stdin = true;
+        else
+            roots[num_roots++] = argv[i];
+    }
+    if (num_roots == 0 && !from_stdin)
+    {
+        roots = default_roots;
+        num_roots = sizeof(default_roots) / sizeof(default_roots[0]);
+    }
+    if (from_stdin)
+    {
+        char * report = process_stdin();
+        if (report != NULL)
+            fputs(report, stdout);
+        fflush(stdout);
+        free(report);
+    }
+
+    // The ROMs are worked on in parallel, biggest first, but reported in
+    // scan order.  Spinning disks get read front to back instead.
+    rom_list_t * roms = scan_roots(roots, num_roots, num_threads);
+    schedule_largest_first(roms);
+    schedule_disk_order(roms, on_rotational);
+
+    // Whatever an interrupted run or the cache already knows about is done
+    // before we start.  A catalog never uses the cache; it doesn't hash so
+    // it has nothing to add.  Cache hits go in the journal straight away
+    // so resuming doesn't depend on having the cache too.  Archive members
+    // the cache knows by size and CRC32 count as hits unless we're --deep.
+    rom_job_t job = { NULL, NULL, NULL, 0, NULL };
+    rom_list_t * misses = NULL;
+    size_t matched = 0;
+    if (cache_path != NULL && load_options.Catalog == CART_CATALOG_OFF)
+        scan_cache = open_scan_cache(cache_path);
+    if (unpack_path != NULL)
+        unpack_cache = open_unpack_cache(unpack_path, unpack_limit);
+    if (scan_cache != NULL || (scan_journal != NULL && resume))
+    {
+        job.Cached = malloc(sizeof(char *) * (roms->NumEntries + 1));
+        for (size_t i = 0; i < roms->NumEntries; i++)
+        {
+            const rom_entry_t * rom = roms->Entries + i;
+            job.Cached[i] = (scan_journal != NULL && resume) ? lookup_scan_journal(scan_journal, rom) : NULL;
+            if (job.Cached[i] == NULL && scan_cache != NULL)
+            {
+                job.Cached[i] = lookup_scan_cache(scan_cache, rom);
+                if (job.Cached[i] == NULL && (job.Cached[i] = match_member(rom)) != NULL)
+                    matched++;
+                if (job.Cached[i] != NULL && scan_journal != NULL)
+                    append_scan_journal(scan_journal, rom, job.Cached[i]);
+            }
+        }
+    }
+
+    if (matched > 0)
+        fprintf(stderr, "Matched %zu archive members to ROMs in the cache by size and CRC32 without reading them (--deep to hash them)\n", matched);
+
+    // Solid archive members that still need doing share out their blocks.
+    job.Unpacks = create_solid_unpacks(roms, job.Cached);
+
+    // Reading ahead with io_uring is strictly optional, and pointless for
+    // a catalog which never reads whole ROMs.  Cached ROMs aren't read at
+    // all so the reader only gets to see the rest.  Reading everything
+    // ahead is also exactly what digests stamped on the files save us.
+    if (uring_arena > 0 && load_options.Xattr)
+        fprintf(stderr, "Not reading ahead with io_uring; --xattr only reads what it has to\n");
+    if (uring_arena > 0 && load_options.Catalog == CART_CATALOG_OFF && !load_options.Xattr)
+    {
+        if (job.Cached != NULL)
+        {
+            job.ReaderIndexes = malloc(sizeof(size_t) * (roms->NumEntries + 1));
+            misses = list_cache_misses(roms, job.Cached, job.ReaderIndexes);
+        }
+
+        job.Reader = create_uring_reader((misses != NULL) ? misses : roms, uring_arena, uring_queue_depth, load_options.Cold);
+        job.ReaderArena = uring_arena;
+        if (job.Reader == NULL)
+            fprintf(stderr, "io_uring is unavailable; reading ROMs the ordinary way\n");
+    }
+
+    // Watching only returns once we're told to stop.
+    worker_limits_t limits = { memory_budget, rom_cost, (disk_reads > 0) ? rom_device_limit : NULL };
+    if (watch && num_roots > 0)
+        run_watch(roots, num_roots, roms, num_threads, process_rom, &job, &limits, stdout);
+    else
+        run_worker_pool(roms, num_threads, process_rom, &job, &limits, stdout);
+
+    if (job.Reader != NULL)
+    {
+        io_stats_t stats;
+        get_uring_io_stats(job.Reader, &stats);
+        count_io(&stats);
+    }
+    if (load_options.Cold || stats)
+        fprintf(stderr, "Read %zu bytes directly and %zu through the page cache\n", io_totals.DirectBytes, io_totals.CachedBytes);
+    if (stats)
+        fprintf(stderr, "Took %zu minor and %zu major page faults loading and hashing\n", io_totals.MinorFaults, io_totals.MajorFaults);
 
+    free_uring_reader(job.Reader);
+    free_solid_unpacks(job.Unpacks);
+    close_scan_cache(scan_cache);
+    close_unpack_cache(unpack_cache);
+    close_scan_journal(scan_journal);
+    if (misses != NULL)
+    {
+        free(misses->Entries);
+        free(misses->Schedule);
+        free(misses);
+    }
+    free(job.ReaderIndexes);
+    free(job.Cached);
+    free_rom_list(roms);
     return 0;
 }
 
-void checkdir(const char * dirname)
+static void usage(const char * prog)
 {
-    // Open the directory
-    DIR * dp = opendir(dirname);
-    if (dp == NULL)
-        return;
+    printf("Usage: %s [options] [root...]\n", prog);
+    printf("Scans each root (a directory, searched recursively, or a ROM) and reports on every ROM found,\n");
+    printf("including those inside zip, 7z and xz archives (which are read in place, never extracted) and tars\n");
+    printf("(plain, .gz, .xz or .zst, each read front to back in a single pass).\n");
+    printf("A root of - is a ROM piped in on standard input.  With no roots ./roms and . are scanned.\n\n");
+    printf("  -r, --read               Read each ROM onto the heap, hashing as it comes in, instead of mapping it\n");
+    printf("  -s, --stream             Never hold a whole ROM in memory; read only what is hashed\n");
+    printf("  -m, --memory-limit=SIZE  Buffer ceiling for streamed ROMs (K/M/G suffixes, default 64M)\n");
+    printf("      --memory-budget=SIZE Cap on the ROMs held in memory at once; bigger ROMs are streamed\n");
+    printf("      --disk-reads=N       ROMs read at once from each spinning disk (default 1, 0 for no limit)\n");
+    printf("      --io-uring[=SIZE]    Read ahead with io_uring into a SIZE buffer (default 256M)\n");
+    printf("      --cold               Keep ROMs out of the page cache (O_DIRECT where possible)\n");
+    printf("      --catalog[=files]    Header and banner only (plus the file list with =files); no hashing\n");
+    printf("      --cache=FILE         Remember reports in an SQLite FILE and skip ROMs that haven't changed since\n");
+    printf("      --deep               Hash archive members even when the --cache knows their size and CRC32\n");
+    printf("      --unpack-cache=DIR   Keep what's taken out of archives in DIR (tmpfs is best) for later runs to reuse\n");
+    printf("      --unpack-limit=SIZE  Most the --unpack-cache may hold (default 2G); the longest unused goes first\n");
+    printf("      --xattr              Trust digests stamped on each ROM (user.ungood.digest) and stamp new ones\n");
+    printf("      --journal=FILE       Record each finished ROM in FILE as it's done (started over unless resuming)\n");
+    printf("      --resume             Pick up where the --journal left off; use the same options as before\n");
+    printf("  -w, --watch              Keep watching the roots and report ROMs as they're added, changed or removed\n");
+    printf("      --stats              Say how much was read, and how, and the page faults it took\n");
+    printf("      --stdin              Report on a ROM piped in on standard input (the same as a root of -)\n");
+    printf("  -j, --jobs=N             Threads to work with (default: one per CPU)\n");
+    printf("  -h, --help               Show this help\n");
+}
+static size_t parse_size(const char * text)
+{
+    // Plain bytes or a K/M/G suffix.  Anything unparseable comes back as 0.
+    char * end;
+    unsigned long long value = strtoull(text, &end, 10);
+    switch (*end)
+    {
+        case 'k': case 'K': value <<= 10; end++; break;
+        case 'm': case 'M': value <<= 20; end++; break;
+        case 'g': case 'G': value <<= 30; end++; break;
+    }
 
-    // Start scanning the directory
-    while (1)
+    return (*end == '\0') ? (size_t)value : 0;
+}
+static void count_io(const io_stats_t * stats)
+{
+    pthread_mutex_lock(&io_totals_lock);
+    io_totals.DirectBytes += stats->DirectBytes;
+    io_totals.CachedBytes += stats->CachedBytes;
+    io_totals.MinorFaults += stats->MinorFaults;
+    io_totals.MajorFaults += stats->MajorFaults;
+    pthread_mutex_unlock(&io_totals_lock);
+}
+
+static rom_list_t * list_cache_misses(const rom_list_t * roms, char ** cached, size_t * out_indexes)
+{
+    // A list of just the ROMs that still need reading.  The entries are
+    // shallow copies; the paths still belong to roms.  Its schedule is
+    // roms' with the hits left out, which is the order the workers will
+    // ask for them.
+    rom_list_t * ret = malloc(sizeof(rom_list_t));
+    memset(ret, 0, sizeof(rom_list_t));
+    ret->Entries = malloc(sizeof(rom_entry_t) * (roms->NumEntries + 1));
+    ret->Schedule = malloc(sizeof(size_t) * (roms->NumEntries + 1));
+    for (size_t i = 0; i < roms->NumEntries; i++)
     {
-        // Get an entry...
-        struct dirent * entry = readdir(dp);
-        if (entry == NULL)
-            break;
+        out_indexes[i] = SIZE_MAX;
+        if (cached[i] != NULL)
+            continue;
 
-        // Is it an nds rom?
-        if (strncmp(entry->d_name + strlen(entry->d_name) - 4, ".nds", 4) == 0)
+        out_indexes[i] = ret->NumEntries;
+        ret->Entries[ret->NumEntries] = roms->Entries[i];
+        ret->NumEntries++;
+    }
+
+    size_t scheduled = 0;
+    for (size_t next = 0; next < roms->NumEntries; next++)
+    {
+        size_t index = roms->Schedule[next];
+        if (out_indexes[index] != SIZE_MAX)
+            ret->Schedule[scheduled++] = out_indexes[index];
+    }
+
+    return ret;
+}
+static void remember_rom(const rom_entry_t * rom, const nds_cartridge_t * cart, const char * info)
+{
+    if (scan_cache != NULL)
+        store_scan_cache(scan_cache, rom, cart, info);
+    if (scan_journal != NULL)
+        append_scan_journal(scan_journal, rom, info);
+}
+static char * match_member(const rom_entry_t * rom)
+{
+    // An archive's CRC32 only says what the member should hash to; trusting
+    // it is what saves inflating the member, and --deep is for when that's
+    // not good enough.
+    if (deep || rom->Member == NULL || !rom->HasCrc)
+        return NULL;
+
+    return match_scan_cache(scan_cache, rom->Size, rom->Crc);
+}
+
+static size_t rom_cost(const rom_entry_t * rom, size_t index, void * context)
+{
+    // Roughly what working on a ROM holds in memory.  Reports we already
+    // have and catalogues hold next to nothing, and what the read-ahead
+    // engine loads lives in its arena which is a ceiling of its own.
+    if (!read_by_job(context, rom, index))
+        return 0;
+
+    // A tar streams one member at a time, keeping no more than the memory
+    // limit of it, catalog or not.  So does a solid block, one wanted
+    // member after another.
+    size_t limit = (load_options.MemoryLimit > 0) ? load_options.MemoryLimit : nds_default_memory_limit;
+    if (rom->Tar)
+        return limit;
+    if (rom->Solid)
+        return (rom->Size < limit) ? rom->Size : limit;
+    if (load_options.Catalog != CART_CATALOG_OFF)
+        return 0;
+
+    // Streaming (which is what a ROM bigger than the budget or in a zip
+    // gets) only ever holds its buffer.
+    if (load_options.LoadMode == CART_LOAD_STREAM || rom->Member != NULL || (memory_budget > 0 && rom->Size > memory_budget))
+        return (rom->Size < limit) ? rom->Size : limit;
+
+    return rom->Size;
+}
+static unsigned rom_device_limit(const rom_entry_t * rom, size_t index, void * context)
+{
+    // Only spinning disks mind how many of us read at once.  The
+    // read-ahead engine does its own reading, one ROM after another.
+    if (!read_by_job(context, rom, index))
+        return 0;
+
+    return on_rotational(rom->Device) ? disk_reads : 0;
+}
+static bool read_by_job(const rom_job_t * job, const rom_entry_t * rom, size_t index)
+{
+    // False when the cache already has its report or the read-ahead engine
+    // is reading it for us.
+    if (job != NULL && job->Cached != NULL && job->Cached[index] != NULL)
+        return false;
+    if (job != NULL && job->Reader != NULL && rom->Member == NULL && !rom->Tar && rom->Size <= job->ReaderArena && (job->ReaderIndexes == NULL || job->ReaderIndexes[index] != SIZE_MAX))
+        return false;
+
+    return true;
+}
+static bool on_rotational(dev_t device)
+{
+    // sysfs gets asked once per device.  Only ever asked by the thread
+    // scheduling ROMs or starting the pool, so this needs no lock.
+    static dev_t * devices = NULL;
+    static bool * rotational = NULL;
+    static size_t num_devices = 0;
+    for (size_t i = 0; i < num_devices; i++)
+    {
+        if (devices[i] == device)
+            return rotational[i];
+    }
+
+    devices = realloc(devices, sizeof(dev_t) * (num_devices + 1));
+    rotational = realloc(rotational, sizeof(bool) * (num_devices + 1));
+    devices[num_devices] = device;
+    rotational[num_devices] = is_rotational(device);
+    return rotational[num_devices++];
+}
+char * process_rom(const rom_entry_t * rom, size_t index, void * context)
+{
+    rom_job_t * job = context;
+    uring_reader_t * reader = (job != NULL) ? job->Reader : NULL;
+    size_t reader_index = (job != NULL && job->ReaderIndexes != NULL) ? job->ReaderIndexes[index] : index;
+
+    // Nothing to read if the cache vouches for it.
+    char * cached = NULL;
+    if (job != NULL && job->Cached != NULL)
+    {
+        cached = job->Cached[index];
+        job->Cached[index] = NULL;
+    }
+    else if (scan_cache != NULL && (cached = lookup_scan_cache(scan_cache, rom)) == NULL)
+        cached = match_member(rom);
+    if (cached != NULL)
+    {
+        char * ret;
+        asprintf(&ret, "Processing file %s...\n%s", rom->Path, cached);
+        free(cached);
+        return ret;
+    }
+
+    // If the read-ahead engine already has it in memory use that.
+    sds s = sdsempty();
+    size_t size = 0;
+    uint8_t * data = (reader != NULL) ? acquire_uring_rom(reader, reader_index, &size) : NULL;
+    if (data != NULL)
+    {
+        s = sdscatprintf(s, "Processing file %s...\n", rom->Path);
+
+        nds_cartridge_t * cart = create_nds_cartridge_from_memory(data, size);
+        char * info = cartridge_info(cart);
+        remember_rom(rom, cart, info);
+        s = sdscat(s, info);
+        free(info);
+
+        // The bytes are the reader's to count; the faults are ours.
+        io_stats_t stats;
+        get_cart_io_stats(cart, &stats);
+        count_io(&stats);
+
+        free_nds_cartridge(cart);
+        release_uring_rom(reader, reader_index);
+    }
+    else if (rom->Member != NULL)
+    {
+        if (reader != NULL)
+            release_uring_rom(reader, reader_index);
+
+        char * info = rom->Solid ? process_solid_member(rom, index, (job != NULL) ? job->Unpacks : NULL) : process_member(rom);
+        if (info == NULL)
         {
-            // Open it and print out some useful info.
-            char filename[1024];
-            FILE *fp;
+            sdsfree(s);
+            return NULL;
+        }
 
-            sprintf(filename, "%s/%s", dirname, entry->d_name);
-            fp = fopen(filename, "rb");
-            if (fp != NULL)
+        s = sdscatprintf(s, "Processing file %s...\n", rom->Path);
+        s = sdscat(s, info);
+        free(info);
+    }
+    else if (rom->Tar)
+    {
+        if (reader != NULL)
+            release_uring_rom(reader, reader_index);
+
+        // Every member gets its own heading; the tar itself doesn't.
+        char * info = process_tar(rom);
+        if (info != NULL)
+        {
+            s = sdscat(s, info);
+            free(info);
+        }
+    }
+    else
+    {
+        if (reader != NULL)
+            release_uring_rom(reader, reader_index);
+
+        // Open it and describe what we found.
+        FILE * fp = fopen(rom->Path, "rb");
+        if (fp == NULL)
+        {
+            sdsfree(s);
+            return NULL;
+        }
+
+        s = sdscatprintf(s, "Processing file %s...\n", rom->Path);
+        char * info = process_file(rom, fp);
+        if (info != NULL)
+        {
+            s = sdscat(s, info);
+            free(info);
+        }
+        fclose(fp);
+    }
+
+    // Hand back a plain string; the pool doesn't know about sds.
+    char * ret = malloc(sdslen(s) + 1);
+    memcpy(ret, s, sdslen(s) + 1);
+    sdsfree(s);
+
+    return ret;
+}
+static char * process_file(const rom_entry_t * rom, FILE * fp)
+{
+    // Anything too big for the memory budget is streamed instead.
+    nds_load_options_t options = load_options;
+    if (memory_budget > 0 && rom->Size > memory_budget)
+        options.LoadMode = CART_LOAD_STREAM;
+
+    char * info = NULL;
+    nds_cartridge_t * cart = create_nds_cartridge(fp, &options);
+    if (cart != NULL)
+    {
+        // A member out of the unpack cache still has its archive's CRC to
+        // live up to.  One that doesn't is reported as nothing at all,
+        // and certainly isn't remembered or kept.
+        if (rom->HasCrc && options.Catalog == CART_CATALOG_OFF && cart->CartCrc != rom->Crc)
+        {
+            fprintf(stderr, "%s: CRC32 %08X doesn't match the archive's %08X\n", rom->Path, cart->CartCrc, rom->Crc);
+            if (unpack_cache != NULL)
+                drop_unpack_cache(unpack_cache, rom);
+        }
+        else
+        {
+            info = cartridge_info(cart);
+            remember_rom(rom, cart, info);
+        }
+
+        io_stats_t stats;
+        get_cart_io_stats(cart, &stats);
+        count_io(&stats);
+    }
+
+    free_nds_cartridge(cart);
+    return info;
+}
+static char * process_stdin(void)
+{
+    // There's no file behind it to stamp, cache or journal against, and a
+    // pipe can only be read as it comes, whatever the load mode.  Otherwise
+    // it gets exactly the report the ROM would get as a file.
+    nds_load_options_t options = load_options;
+    options.Xattr = false;
+    nds_cartridge_t * cart = create_nds_cartridge(stdin, &options);
+    if (cart == NULL)
+    {
+        fprintf(stderr, "Couldn't read a ROM from standard input\n");
+        return NULL;
+    }
+
+    char * info = cartridge_info(cart);
+    char * ret;
+    asprintf(&ret, "Processing file -...\n%s", info);
+    free(info);
+
+    io_stats_t stats;
+    get_cart_io_stats(cart, &stats);
+    count_io(&stats);
+
+    free_nds_cartridge(cart);
+    return ret;
+}
+static char * process_member(const rom_entry_t * rom)
+{
+    // Archive members are always streamed straight out of the archive;
+    // nothing gets extracted and only the stream's buffer is held.  The
+    // exception is an unpack cache, which gets a copy of the member that
+    // is then read like any other file, this time and next.
+    FILE * fp = (unpack_cache != NULL) ? lookup_unpack_cache(unpack_cache, rom) : NULL;
+    if (fp != NULL)
+    {
+        char * info = process_file(rom, fp);
+        fclose(fp);
+        return info;
+    }
+
+    char * path = get_rom_archive(rom);
+    zip_archive_t * archive = open_zip_archive(path);
+    const zip_entry_t * entry = (archive != NULL) ? find_zip_entry(archive, rom->Member) : NULL;
+    zip_member_t * member = (entry != NULL) ? open_zip_member(archive, entry) : NULL;
+    free(path);
+    if (member == NULL)
+    {
+        if (archive != NULL)
+            close_zip_archive(archive);
+        return NULL;
+    }
+
+    // A catalog only reads the odd bit of a member; copying all of it
+    // out would cost far more than it saves.
+    if (unpack_cache != NULL && load_options.Catalog == CART_CATALOG_OFF && store_unpack_cache(unpack_cache, rom, read_member, member))
+        fp = lookup_unpack_cache(unpack_cache, rom);
+
+    char * info = NULL;
+    if (fp != NULL)
+    {
+        info = process_file(rom, fp);
+        fclose(fp);
+    }
+    else
+    {
+        nds_cartridge_t * cart = create_nds_cartridge_from_reader(read_member, member, entry->Size, &load_options);
+        if (cart != NULL)
+        {
+            // The archive has its own idea of the CRC; it only means anything
+            // once the whole member has been read.  A member that doesn't
+            // match it is corrupt and gets no report.
+            if (load_options.Catalog == CART_CATALOG_OFF && cart->CartCrc != entry->Crc)
+                fprintf(stderr, "%s: CRC32 %08X doesn't match the archive's %08X\n", rom->Path, cart->CartCrc, entry->Crc);
+            else
             {
-                printf("Processing file %s...\n", filename);
+                info = cartridge_info(cart);
+                remember_rom(rom, cart, info);
+            }
+        }
+        free_nds_cartridge(cart);
+    }
 
-                nds_cartridge_t * cart = create_nds_cartridge(fp);
-                char * info = cartridge_info(cart);
-                printf("%s", info);
-                free(info);
+    io_stats_t stats;
+    get_zip_io_stats(member, &stats);
+    count_io(&stats);
 
-                free_nds_cartridge(cart);
+    close_zip_member(member);
+    close_zip_archive(archive);
+    return info;
+}
+static size_t read_member(void * context, void * buf, size_t buflen, size_t offset)
+{
+    return read_zip_member(context, buf, buflen, offset);
+}
+static char * process_solid_member(const rom_entry_t * rom, size_t index, solid_unpacks_t * unpacks)
+{
+    // Someone may already have been through our block, or be going
+    // through it now.
+    if (unpacks != NULL)
+    {
+        pthread_mutex_lock(&unpacks->Lock);
+        while (unpacks->States[index] == SOLID_UNPACKING)
+        {
+            pthread_cond_wait(&unpacks->Done, &unpacks->Lock);
+        }
+
+        if (unpacks->States[index] == SOLID_DONE)
+        {
+            char * ret = unpacks->Reports[index];
+            unpacks->Reports[index] = NULL;
+            unpacks->States[index] = SOLID_NONE;
+            pthread_mutex_unlock(&unpacks->Lock);
+            return ret;
+        }
+        pthread_mutex_unlock(&unpacks->Lock);
+    }
+
+    // The unpack cache may have it without our going near the block, as
+    // long as nobody has started on the block for us in the meantime.
+    FILE * fp = (unpack_cache != NULL) ? lookup_unpack_cache(unpack_cache, rom) : NULL;
+    if (fp != NULL)
+    {
+        if (unpacks != NULL)
+        {
+            pthread_mutex_lock(&unpacks->Lock);
+            if (unpacks->States[index] == SOLID_UNPACKING || unpacks->States[index] == SOLID_DONE)
+            {
+                pthread_mutex_unlock(&unpacks->Lock);
+                fclose(fp);
+                return process_solid_member(rom, index, unpacks);
             }
+            unpacks->States[index] = SOLID_NONE;
+            pthread_mutex_unlock(&unpacks->Lock);
+        }
+
+        char * info = process_file(rom, fp);
+        fclose(fp);
+        return info;
+    }
+
+    char * path = get_rom_archive(rom);
+    solid_archive_t * archive = open_solid_archive(path);
+    const solid_entry_t * entry = (archive != NULL) ? find_solid_entry(archive, rom->Member) : NULL;
+    if (entry == NULL)
+    {
+        close_solid_archive(archive);
+        free(path);
+        return NULL;
+    }
+
+    // Everyone else in the block still waiting gets unpacked along with
+    // us.  Another job may have beaten us to it while we were opening the
+    // archive, in which case go and wait for it after all.
+    solid_unpack_t unpack = { unpacks, rom, NULL, NULL };
+    bool * wanted = calloc(archive->NumEntries + 1, sizeof(bool));
+    unpack.Indexes = malloc(sizeof(size_t) * (archive->NumEntries + 1));
+    wanted[entry - archive->Entries] = true;
+    unpack.Indexes[entry - archive->Entries] = index;
+    if (unpacks != NULL)
+    {
+        pthread_mutex_lock(&unpacks->Lock);
+        if (unpacks->States[index] == SOLID_UNPACKING || unpacks->States[index] == SOLID_DONE)
+        {
+            pthread_mutex_unlock(&unpacks->Lock);
+            free(wanted);
+            free(unpack.Indexes);
+            close_solid_archive(archive);
+            free(path);
+            return process_solid_member(rom, index, unpacks);
+        }
+
+        unpacks->States[index] = SOLID_UNPACKING;
+        for (size_t i = 0; i < archive->NumEntries; i++)
+        {
+            if (archive->Entries[i].Block != entry->Block || wanted[i])
+                continue;
+
+            char * member_path;
+            asprintf(&member_path, "%s/%s", path, archive->Entries[i].Name);
+            size_t other = find_rom_path(unpacks, member_path);
+            free(member_path);
+            if (other != SIZE_MAX && unpacks->States[other] == SOLID_WANTED)
+            {
+                wanted[i] = true;
+                unpack.Indexes[i] = other;
+                unpacks->States[other] = SOLID_UNPACKING;
+            }
+        }
+        pthread_mutex_unlock(&unpacks->Lock);
+    }
+
+    if (!unpack_solid_block(archive, entry->Block, wanted, unpacked_member, &unpack))
+        fprintf(stderr, "%s: couldn't decode all of the block holding %s\n", path, rom->Member);
+    count_io(&archive->IoStats);
+
+    // Anyone the block let down is done too, with nothing to show for it.
+    char * ret = unpack.Report;
+    if (unpacks != NULL)
+    {
+        pthread_mutex_lock(&unpacks->Lock);
+        for (size_t i = 0; i < archive->NumEntries; i++)
+        {
+            if (wanted[i] && unpacks->States[unpack.Indexes[i]] == SOLID_UNPACKING)
+                unpacks->States[unpack.Indexes[i]] = SOLID_DONE;
+        }
+
+        ret = unpacks->Reports[index];
+        unpacks->Reports[index] = NULL;
+        unpacks->States[index] = SOLID_NONE;
+        pthread_cond_broadcast(&unpacks->Done);
+        pthread_mutex_unlock(&unpacks->Lock);
+    }
+
+    free(wanted);
+    free(unpack.Indexes);
+    close_solid_archive(archive);
+    free(path);
+    return ret;
+}
+static void unpacked_member(const solid_entry_t * entry, size_t entry_index, solid_member_t * member, void * context)
+{
+    // Runs as each wanted member comes out of the block.  An unpack cache
+    // takes all of it, catalog or not, since it has to be decoded past
+    // anyway; then it's read back like any other file.  Otherwise it
+    // streams through once.
+    solid_unpack_t * unpack = context;
+    size_t index = unpack->Indexes[entry_index];
+    const rom_entry_t * rom = (unpack->Unpacks != NULL) ? unpack->Unpacks->Roms->Entries + index : unpack->Rom;
+    solid_reader_t reader = { member, NULL, 0, 0 };
+    char * info = NULL;
+    FILE * fp = NULL;
+    if (unpack_cache != NULL && store_unpack_cache(unpack_cache, rom, read_solid_at, &reader))
+        fp = lookup_unpack_cache(unpack_cache, rom);
+    if (fp != NULL)
+    {
+        info = process_file(rom, fp);
+        fclose(fp);
+    }
+    else if (reader.Pos == 0)
+        info = stream_solid_member(rom, entry, member);
+
+    if (unpack->Unpacks == NULL)
+    {
+        unpack->Report = info;
+        return;
+    }
+
+    pthread_mutex_lock(&unpack->Unpacks->Lock);
+    unpack->Unpacks->Reports[index] = info;
+    unpack->Unpacks->States[index] = SOLID_DONE;
+    pthread_cond_broadcast(&unpack->Unpacks->Done);
+    pthread_mutex_unlock(&unpack->Unpacks->Lock);
+}
+static char * stream_solid_member(const rom_entry_t * rom, const solid_entry_t * entry, solid_member_t * member)
+{
+    // Just like a tar member: hashed as it's decoded, with only the start
+    // of it up to its tables held, and left out if that won't fit within
+    // the memory limit.
+    size_t head_size = (rom->Size < nds_sniff_size) ? rom->Size : nds_sniff_size;
+    uint8_t * head = malloc(nds_sniff_size);
+    size_t got = read_solid_member(member, head, head_size);
+    if (got < head_size)
+    {
+        free(head);
+        return NULL;
+    }
+    if (!can_stream_nds_forward(head, got, rom->Size, &load_options))
+    {
+        fprintf(stderr, "%s: its tables are too far in to stream within the memory limit (-m)\n", rom->Path);
+        free(head);
+        return NULL;
+    }
+
+    solid_reader_t reader = { member, head, head_size, 0 };
+    nds_cartridge_t * cart = create_nds_cartridge_from_stream(read_solid_next, &reader, rom->Size, &load_options);
+    free(head);
+
+    // A member that doesn't match the 7z's CRC is corrupt: no report,
+    // and nothing remembered.
+    char * info = NULL;
+    if (cart != NULL)
+    {
+        if (load_options.Catalog == CART_CATALOG_OFF && entry->HasCrc && cart->CartCrc != entry->Crc)
+            fprintf(stderr, "%s: CRC32 %08X doesn't match the archive's %08X\n", rom->Path, cart->CartCrc, entry->Crc);
+        else
+        {
+            info = cartridge_info(cart);
+            remember_rom(rom, cart, info);
         }
+
+        io_stats_t stats;
+        get_cart_io_stats(cart, &stats);
+        count_io(&stats);
+    }
+
+    free_nds_cartridge(cart);
+    return info;
+}
+static size_t read_solid_next(void * context, void * buf, size_t buflen)
+{
+    // The head goes back in front of whatever's still to come.
+    solid_reader_t * reader = context;
+    size_t got = 0;
+    if (reader->Pos < reader->HeadSize)
+    {
+        got = (reader->HeadSize - reader->Pos < buflen) ? reader->HeadSize - reader->Pos : buflen;
+        memcpy(buf, reader->Head + reader->Pos, got);
+    }
+    if (got < buflen)
+        got += read_solid_member(reader->Member, (uint8_t *)buf + got, buflen - got);
+
+    reader->Pos += got;
+    return got;
+}
+static size_t read_solid_at(void * context, void * buf, size_t buflen, size_t offset)
+{
+    // The unpack cache copies in order, which is the only way a solid
+    // member can be read.
+    solid_reader_t * reader = context;
+    if (offset != reader->Pos)
+        return 0;
+
+    size_t got = read_solid_member(reader->Member, buf, buflen);
+    reader->Pos += got;
+    return got;
+}
+static char * process_tar(const rom_entry_t * tar)
+{
+    // One pass from front to back with no seeking, which is all tape-like
+    // storage is good for.  Each ROM inside is reported on as it goes by,
+    // as tar/member, and cached and journalled in its own right; anything
+    // else is read past.
+    tar_stream_t * stream = open_tar_stream(tar->Path);
+    if (stream == NULL)
+    {
+        fprintf(stderr, "Couldn't read %s as a tar\n", tar->Path);
+        return NULL;
+    }
+
+    sds s = sdsempty();
+    tar_member_t member;
+    while (next_tar_member(stream, &member))
+    {
+        // The same test a file of that name would get on disk.
+        bool sniff;
+        const char * name = strrchr(member.Name, '/');
+        name = (name != NULL) ? name + 1 : member.Name;
+        if (*name == '\0' || !is_rom_file_name(name, &sniff))
+            continue;
+
+        rom_entry_t entry = *tar;
+        asprintf(&entry.Path, "%s/%s", tar->Path, member.Name);
+        entry.Member = (char *)member.Name;
+        entry.Tar = false;
+        entry.Size = member.Size;
+        char * info = process_tar_member(&entry, stream, sniff);
+        if (info != NULL)
+        {
+            s = sdscatprintf(s, "Processing file %s...\n", entry.Path);
+            s = sdscat(s, info);
+            free(info);
+        }
+        free(entry.Path);
+    }
+
+    if (!is_tar_stream_intact(stream))
+        fprintf(stderr, "%s: the tar is damaged or cut short; anything past the damage is missing from the report\n", tar->Path);
+
+    io_stats_t stats;
+    get_tar_io_stats(stream, &stats);
+    count_io(&stats);
+    close_tar_stream(stream);
+
+    char * ret = malloc(sdslen(s) + 1);
+    memcpy(ret, s, sdslen(s) + 1);
+    sdsfree(s);
+    return ret;
+}
+static char * process_tar_member(const rom_entry_t * rom, tar_stream_t * stream, bool sniff)
+{
+    // What a resumed journal or the cache already knows is read past like
+    // anything else; there's no skipping ahead in a stream.
+    char * known = (scan_journal != NULL) ? lookup_scan_journal(scan_journal, rom) : NULL;
+    if (known == NULL && scan_cache != NULL && (known = lookup_scan_cache(scan_cache, rom)) != NULL && scan_journal != NULL)
+        append_scan_journal(scan_journal, rom, known);
+    if (known != NULL)
+        return known;
+
+    // The stream only goes forward, so the member is hashed as it goes by
+    // and only the start of it, up to its tables, is held.  Its head comes
+    // first so anything that has to sniff as a ROM and doesn't costs no
+    // more than that.  One whose tables are too far in to hold within the
+    // memory limit is left out rather than read whole.
+    size_t head_size = (rom->Size < nds_sniff_size) ? rom->Size : nds_sniff_size;
+    uint8_t * head = malloc(nds_sniff_size);
+    size_t got = read_tar_member(stream, head, head_size);
+    if (got < head_size || (sniff && sniff_nds_header(head, got) == ROM_KIND_NONE))
+    {
+        free(head);
+        return NULL;
+    }
+    if (!can_stream_nds_forward(head, got, rom->Size, &load_options))
+    {
+        fprintf(stderr, "%s: its tables are too far in to stream within the memory limit (-m)\n", rom->Path);
+        free(head);
+        return NULL;
     }
 
-    // Cleanup
-    closedir(dp);
+    tar_reader_t reader = { stream, head, head_size, 0 };
+    nds_cartridge_t * cart = create_nds_cartridge_from_stream(read_tar_next, &reader, rom->Size, &load_options);
+    free(head);
+
+    char * info = NULL;
+    if (cart != NULL)
+    {
+        info = cartridge_info(cart);
+        remember_rom(rom, cart, info);
+
+        io_stats_t stats;
+        get_cart_io_stats(cart, &stats);
+        count_io(&stats);
+    }
+
+    free_nds_cartridge(cart);
+    return info;
+}
+static size_t read_tar_next(void * context, void * buf, size_t buflen)
+{
+    // The sniffed head goes back in front of whatever's still to come.
+    tar_reader_t * reader = context;
+    size_t got = 0;
+    if (reader->Pos < reader->HeadSize)
+    {
+        got = (reader->HeadSize - reader->Pos < buflen) ? reader->HeadSize - reader->Pos : buflen;
+        memcpy(buf, reader->Head + reader->Pos, got);
+    }
+    if (got < buflen)
+        got += read_tar_member(reader->Stream, (uint8_t *)buf + got, buflen - got);
+
+    reader->Pos += got;
+    return got;
+}
+static solid_unpacks_t * create_solid_unpacks(const rom_list_t * roms, char ** cached)
+{
+    // Only worth having if there are solid members left to do.
+    solid_unpacks_t * ret = NULL;
+    for (size_t i = 0; i < roms->NumEntries; i++)
+    {
+        if (!roms->Entries[i].Solid || (cached != NULL && cached[i] != NULL))
+            continue;
+
+        if (ret == NULL)
+        {
+            ret = malloc(sizeof(solid_unpacks_t));
+            ret->Roms = roms;
+            ret->States = calloc(roms->NumEntries + 1, sizeof(solid_state_t));
+            ret->Reports = calloc(roms->NumEntries + 1, sizeof(char *));
+            pthread_mutex_init(&ret->Lock, NULL);
+            pthread_cond_init(&ret->Done, NULL);
+        }
+        ret->States[i] = SOLID_WANTED;
+    }
+    if (ret == NULL)
+        return NULL;
+
+    ret->ByPath = malloc(sizeof(size_t) * (roms->NumEntries + 1));
+    for (size_t i = 0; i < roms->NumEntries; i++)
+    {
+        ret->ByPath[i] = i;
+    }
+    qsort_r(ret->ByPath, roms->NumEntries, sizeof(size_t), compare_rom_paths, (void *)roms);
+    return ret;
+}
+static void free_solid_unpacks(solid_unpacks_t * unpacks)
+{
+    if (unpacks == NULL)
+        return;
+
+    for (size_t i = 0; i < unpacks->Roms->NumEntries; i++)
+    {
+        free(unpacks->Reports[i]);
+    }
+
+    pthread_mutex_destroy(&unpacks->Lock);
+    pthread_cond_destroy(&unpacks->Done);
+    free(unpacks->ByPath);
+    free(unpacks->States);
+    free(unpacks->Reports);
+    free(unpacks);
+}
+static size_t find_rom_path(const solid_unpacks_t * unpacks, const char * path)
+{
+    size_t low = 0, high = unpacks->Roms->NumEntries;
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        int cmp = strcmp(unpacks->Roms->Entries[unpacks->ByPath[mid]].Path, path);
+        if (cmp == 0)
+            return unpacks->ByPath[mid];
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return SIZE_MAX;
+}
+static int compare_rom_paths(const void * a, const void * b, void * arg)
+{
+    const rom_list_t * roms = arg;
+    return strcmp(roms->Entries[*(const size_t *)a].Path, roms->Entries[*(const size_t *)b].Path);
 }
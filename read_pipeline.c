@@ -0,0 +1,209 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "io_helper.h"
+#include "read_pipeline.h"
+
+
+// Two slots; the reader fills one while the consumer drains the other.
+typedef struct read_pipeline_s
+{
+    int Fd;
+    int DirectFd; // -1 unless cold and the filesystem takes O_DIRECT
+    bool Cold;
+    bool Sparse; // Only worth looking for holes if there are some
+    io_stats_t Stats;
+    size_t Size;
+    size_t ChunkSize;
+    uint8_t * Dest;
+
+    pthread_mutex_t Lock;
+    pthread_cond_t Changed;
+    uint8_t * Buffers[2];
+    size_t Lengths[2];
+    bool Holes[2];
+    bool Last[2];
+    bool Full[2];
+} read_pipeline_t;
+
+
+// Decs
+static void * reader_thread(void *);
+static size_t read_chunk(read_pipeline_t *, uint8_t *, size_t, size_t);
+
+
+// Running
+size_t run_read_pipeline(int fd, size_t size, size_t chunk_size, bool cold, uint8_t * dest, pipeline_consumer_t consumer, void * context, io_stats_t * stats)
+{
+    assert(consumer != NULL);
+    assert(chunk_size > 0);
+
+    read_pipeline_t pipeline;
+    memset(&pipeline, 0, sizeof(pipeline));
+    pipeline.Fd = fd;
+    pipeline.DirectFd = -1;
+    pipeline.Cold = cold;
+    pipeline.Size = size;
+    pipeline.ChunkSize = chunk_size;
+    pipeline.Dest = dest;
+    if (cold)
+    {
+        pipeline.ChunkSize = align_direct(chunk_size);
+        pipeline.DirectFd = open_direct(fd);
+        if (pipeline.DirectFd < 0)
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    // Small files aren't worth a thread.
+    if (size <= pipeline.ChunkSize)
+    {
+        uint8_t * buf = (dest != NULL) ? dest : alloc_direct(size + 1);
+        size_t got = read_chunk(&pipeline, buf, size, 0);
+        consumer(buf, got, context);
+        if (dest == NULL)
+            free(buf);
+        if (pipeline.DirectFd >= 0)
+            close(pipeline.DirectFd);
+        if (stats != NULL)
+            *stats = pipeline.Stats;
+        return got;
+    }
+
+    chunk_size = pipeline.ChunkSize;
+    pipeline.Sparse = is_sparse(fd);
+    if (dest == NULL)
+    {
+        pipeline.Buffers[0] = alloc_direct(chunk_size);
+        pipeline.Buffers[1] = alloc_direct(chunk_size);
+    }
+    pthread_mutex_init(&pipeline.Lock, NULL);
+    pthread_cond_init(&pipeline.Changed, NULL);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, reader_thread, &pipeline);
+
+    // Consume in order until the reader says that was the last of it.
+    size_t consumed = 0;
+    for (size_t n = 0; ; n++)
+    {
+        int slot = n % 2;
+        pthread_mutex_lock(&pipeline.Lock);
+        while (!pipeline.Full[slot])
+        {
+            pthread_cond_wait(&pipeline.Changed, &pipeline.Lock);
+        }
+        size_t length = pipeline.Lengths[slot];
+        bool hole = pipeline.Holes[slot];
+        bool last = pipeline.Last[slot];
+        pthread_mutex_unlock(&pipeline.Lock);
+
+        uint8_t * buf = (hole) ? NULL : (dest != NULL) ? dest + consumed : pipeline.Buffers[slot];
+        consumer(buf, length, context);
+        consumed += length;
+
+        pthread_mutex_lock(&pipeline.Lock);
+        pipeline.Full[slot] = false;
+        pthread_cond_signal(&pipeline.Changed);
+        pthread_mutex_unlock(&pipeline.Lock);
+
+        if (last)
+            break;
+    }
+
+    pthread_join(thread, NULL);
+    pthread_cond_destroy(&pipeline.Changed);
+    pthread_mutex_destroy(&pipeline.Lock);
+    free(pipeline.Buffers[0]);
+    free(pipeline.Buffers[1]);
+    if (pipeline.DirectFd >= 0)
+        close(pipeline.DirectFd);
+    if (stats != NULL)
+        *stats = pipeline.Stats;
+
+    return consumed;
+}
+static void * reader_thread(void * arg)
+{
+    read_pipeline_t * pipeline = arg;
+
+    // The file is a series of runs, data or hole.  Data goes a chunk at a
+    // time; a hole goes in one piece however big it is.
+    size_t offset = 0;
+    size_t run_end = (pipeline->Sparse) ? 0 : pipeline->Size;
+    bool run_hole = false;
+    for (size_t n = 0; ; n++)
+    {
+        int slot = n % 2;
+        pthread_mutex_lock(&pipeline->Lock);
+        while (pipeline->Full[slot])
+        {
+            pthread_cond_wait(&pipeline->Changed, &pipeline->Lock);
+        }
+        pthread_mutex_unlock(&pipeline->Lock);
+
+        if (offset >= run_end)
+            run_end = offset + next_file_run(pipeline->Fd, offset, pipeline->Size, &run_hole);
+
+        // A short read (the end of the file or an error) is the last chunk.
+        size_t want = run_end - offset;
+        size_t got = want;
+        if (run_hole && pipeline->Dest != NULL)
+            memset(pipeline->Dest + offset, 0, want);
+        if (!run_hole)
+        {
+            want = (want < pipeline->ChunkSize) ? want : pipeline->ChunkSize;
+            uint8_t * buf = (pipeline->Dest != NULL) ? pipeline->Dest + offset : pipeline->Buffers[slot];
+            got = read_chunk(pipeline, buf, want, offset);
+        }
+        offset += got;
+        bool last = (got < want || offset >= pipeline->Size);
+
+        pthread_mutex_lock(&pipeline->Lock);
+        pipeline->Lengths[slot] = got;
+        pipeline->Holes[slot] = run_hole;
+        pipeline->Last[slot] = last;
+        pipeline->Full[slot] = true;
+        pthread_cond_signal(&pipeline->Changed);
+        pthread_mutex_unlock(&pipeline->Lock);
+
+        if (last)
+            break;
+    }
+
+    return NULL;
+}
+static size_t read_chunk(read_pipeline_t * pipeline, uint8_t * buf, size_t want, size_t offset)
+{
+    if (!pipeline->Cold)
+    {
+        size_t got = pread_fully(pipeline->Fd, buf, want, offset);
+        pipeline->Stats.CachedBytes += got;
+        return got;
+    }
+
+    // Buffers come from alloc_direct so rounding the length up is safe.
+    // Whatever O_DIRECT didn't get us (all of it, if the filesystem or
+    // the device changed its mind) is read through the cache and dropped.
+    size_t got = 0;
+    if (pipeline->DirectFd >= 0 && is_direct_aligned(buf, align_direct(want), offset))
+    {
+        got = pread_direct(pipeline->DirectFd, buf, align_direct(want), offset);
+        if (got > want)
+            got = want;
+        pipeline->Stats.DirectBytes += got;
+    }
+    if (got < want)
+    {
+        size_t rest = pread_dropping(pipeline->Fd, buf + got, want - got, offset + got);
+        pipeline->Stats.CachedBytes += rest;
+        got += rest;
+    }
+
+    return got;
+}
@@ -0,0 +1,39 @@
+/* A two stage read/consume pipeline.  A reader thread fills buffer N+1
+ * while the caller chews on buffer N, so on slow disks the time spent
+ * on a file is closer to max(I/O, CPU) than to their sum.
+ *
+ * The reader either ping-pongs between two buffers of its own or, when
+ * the caller wants the whole file anyway, reads straight into the
+ * caller's buffer a chunk at a time; the consumer sees the same chunks
+ * in file order either way.
+ *
+ * Cold pipelines try hard not to leave the file in the page cache:
+ * O_DIRECT where the filesystem allows it, and otherwise cached reads
+ * that are dropped again as soon as they're in.  A cold dest has to come
+ * from alloc_direct() so the last chunk can be rounded up.
+ *
+ * Holes in sparse files are never read.  The consumer is told about them
+ * with a NULL buffer and dest just gets zeros there.
+ */
+
+#ifndef _READ_PIPELINE_H
+#define _READ_PIPELINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "io_helper.h"
+
+
+// Called once per chunk, in order, on the calling thread.  A NULL buf is
+// buflen zero bytes of hole.
+typedef void (*pipeline_consumer_t)(const uint8_t * buf, size_t buflen, void * context);
+
+// Procs
+// Reads [0, size) of fd (dest and stats may be NULL) and returns how much was consumed.
+// Anything short of size means the file shrank or a read failed, and
+// whatever the consumer made of it is no good; hence the warning.
+__attribute__((warn_unused_result))
+size_t run_read_pipeline(int fd, size_t size, size_t chunk_size, bool cold, uint8_t * dest, pipeline_consumer_t consumer, void * context, io_stats_t * stats);
+
+#endif
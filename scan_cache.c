@@ -0,0 +1,270 @@
+#include <assert.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cartridge.h"
+#include "cartridge_banner.h"
+#include "cartridge_filetable.h"
+#include "scan_cache.h"
+
+
+/* One connection shared by every worker behind our own lock.  Lookups are
+ * a single indexed read and stores are one short transaction per ROM, so
+ * there's very little to gain from a connection per thread.
+ */
+struct scan_cache_s
+{
+    sqlite3 * Db;
+    pthread_mutex_t Lock;
+    sqlite3_stmt * Lookup;
+    sqlite3_stmt * Match;
+    sqlite3_stmt * Forget;
+    sqlite3_stmt * InsertRom;
+    sqlite3_stmt * InsertName;
+    sqlite3_stmt * InsertFile;
+};
+
+// Bumped whenever the tables (or what goes into a report) change.  A file
+// from another version is thrown away rather than trusted.
+static const int cache_schema_version = 1;
+static const char * cache_schema =
+    "CREATE TABLE IF NOT EXISTS roms ("
+    " id INTEGER PRIMARY KEY,"
+    " path TEXT NOT NULL UNIQUE,"
+    " dev INTEGER NOT NULL, ino INTEGER NOT NULL, size INTEGER NOT NULL, mtime_ns INTEGER NOT NULL,"
+    " status INTEGER NOT NULL,"
+    " cart_crc INTEGER, cart_hash BLOB,"
+    " header_crc16 INTEGER, trim_size INTEGER, trim_hash BLOB,"
+    " arm9_hash BLOB, arm7_hash BLOB, arm9_overlay_hash BLOB, arm7_overlay_hash BLOB,"
+    " banner_hash BLOB,"
+    " report TEXT NOT NULL);"
+    "CREATE TABLE IF NOT EXISTS banner_names ("
+    " rom_id INTEGER NOT NULL REFERENCES roms(id) ON DELETE CASCADE,"
+    " language TEXT NOT NULL, name TEXT NOT NULL,"
+    " PRIMARY KEY (rom_id, language));"
+    "CREATE TABLE IF NOT EXISTS files ("
+    " rom_id INTEGER NOT NULL REFERENCES roms(id) ON DELETE CASCADE,"
+    " file_id INTEGER NOT NULL, name TEXT NOT NULL, size INTEGER NOT NULL, hash BLOB,"
+    " PRIMARY KEY (rom_id, file_id));"
+    "CREATE INDEX IF NOT EXISTS roms_by_crc ON roms (size, cart_crc);";
+static const char * banner_languages[7] = { "J", "E", "F", "G", "I", "S", "C" };
+
+
+// Decs
+static bool prepare_cache(scan_cache_t *);
+static void bind_hash(sqlite3_stmt *, int, const SHA512_HASH *);
+
+
+// Init / Destroy
+scan_cache_t * open_scan_cache(const char * path)
+{
+    assert(path != NULL);
+
+    scan_cache_t * ret = malloc(sizeof(scan_cache_t));
+    memset(ret, 0, sizeof(scan_cache_t));
+    pthread_mutex_init(&ret->Lock, NULL);
+
+    if (sqlite3_open_v2(path, &ret->Db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK || !prepare_cache(ret))
+    {
+        fprintf(stderr, "Can't use scan cache %s: %s\n", path, sqlite3_errmsg(ret->Db));
+        close_scan_cache(ret);
+        return NULL;
+    }
+
+    return ret;
+}
+void close_scan_cache(scan_cache_t * cache)
+{
+    if (cache == NULL)
+        return;
+
+    sqlite3_finalize(cache->Lookup);
+    sqlite3_finalize(cache->Match);
+    sqlite3_finalize(cache->Forget);
+    sqlite3_finalize(cache->InsertRom);
+    sqlite3_finalize(cache->InsertName);
+    sqlite3_finalize(cache->InsertFile);
+    sqlite3_close(cache->Db);
+    pthread_mutex_destroy(&cache->Lock);
+    free(cache);
+}
+static bool prepare_cache(scan_cache_t * cache)
+{
+    // WAL with NORMAL sync means a store is an append, not an fsync.  Losing
+    // the last few entries to a power cut only costs re-reading those ROMs.
+    sqlite3_exec(cache->Db, "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL; PRAGMA foreign_keys=ON;", NULL, NULL, NULL);
+    sqlite3_busy_timeout(cache->Db, 5000);
+
+    int version = 0;
+    sqlite3_stmt * stmt;
+    if (sqlite3_prepare_v2(cache->Db, "PRAGMA user_version;", -1, &stmt, NULL) != SQLITE_OK)
+        return false;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        version = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+
+    if (version != cache_schema_version)
+    {
+        char * pragma = sqlite3_mprintf("DROP TABLE IF EXISTS files; DROP TABLE IF EXISTS banner_names; DROP TABLE IF EXISTS roms; PRAGMA user_version=%d;", cache_schema_version);
+        int result = sqlite3_exec(cache->Db, pragma, NULL, NULL, NULL);
+        sqlite3_free(pragma);
+        if (result != SQLITE_OK)
+            return false;
+    }
+    if (sqlite3_exec(cache->Db, cache_schema, NULL, NULL, NULL) != SQLITE_OK)
+        return false;
+
+    return
+        sqlite3_prepare_v2(cache->Db, "SELECT dev, ino, size, mtime_ns, report FROM roms WHERE path = ?;", -1, &cache->Lookup, NULL) == SQLITE_OK &&
+        sqlite3_prepare_v2(cache->Db, "SELECT DISTINCT cart_hash, report FROM roms WHERE size = ? AND cart_crc = ? LIMIT 2;", -1, &cache->Match, NULL) == SQLITE_OK &&
+        sqlite3_prepare_v2(cache->Db, "DELETE FROM roms WHERE path = ?;", -1, &cache->Forget, NULL) == SQLITE_OK &&
+        sqlite3_prepare_v2(cache->Db,
+            "INSERT INTO roms (path, dev, ino, size, mtime_ns, status, cart_crc, cart_hash, header_crc16, trim_size, trim_hash,"
+            " arm9_hash, arm7_hash, arm9_overlay_hash, arm7_overlay_hash, banner_hash, report)"
+            " VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);", -1, &cache->InsertRom, NULL) == SQLITE_OK &&
+        sqlite3_prepare_v2(cache->Db, "INSERT INTO banner_names (rom_id, language, name) VALUES (?, ?, ?);", -1, &cache->InsertName, NULL) == SQLITE_OK &&
+        sqlite3_prepare_v2(cache->Db, "INSERT INTO files (rom_id, file_id, name, size, hash) VALUES (?, ?, ?, ?, ?);", -1, &cache->InsertFile, NULL) == SQLITE_OK;
+}
+
+// Procs
+char * lookup_scan_cache(scan_cache_t * cache, const rom_entry_t * rom)
+{
+    assert(cache != NULL);
+    assert(rom != NULL);
+
+    char * ret = NULL;
+    pthread_mutex_lock(&cache->Lock);
+    sqlite3_bind_text(cache->Lookup, 1, rom->Path, -1, SQLITE_STATIC);
+    if (sqlite3_step(cache->Lookup) == SQLITE_ROW &&
+        (dev_t)sqlite3_column_int64(cache->Lookup, 0) == rom->Device &&
+        (ino_t)sqlite3_column_int64(cache->Lookup, 1) == rom->Inode &&
+        (size_t)sqlite3_column_int64(cache->Lookup, 2) == rom->Size &&
+        sqlite3_column_int64(cache->Lookup, 3) == rom->MtimeNs)
+    {
+        ret = strdup((const char *)sqlite3_column_text(cache->Lookup, 4));
+    }
+    sqlite3_reset(cache->Lookup);
+    sqlite3_clear_bindings(cache->Lookup);
+    pthread_mutex_unlock(&cache->Lock);
+
+    return ret;
+}
+char * match_scan_cache(scan_cache_t * cache, size_t size, uint32_t crc)
+{
+    assert(cache != NULL);
+
+    // Two rows back means two different ROMs share the CRC (or one ROM
+    // somehow got two reports); either way only reading it will tell.
+    char * ret = NULL;
+    pthread_mutex_lock(&cache->Lock);
+    sqlite3_bind_int64(cache->Match, 1, (sqlite3_int64)size);
+    sqlite3_bind_int64(cache->Match, 2, crc);
+    if (sqlite3_step(cache->Match) == SQLITE_ROW)
+    {
+        ret = strdup((const char *)sqlite3_column_text(cache->Match, 1));
+        if (sqlite3_step(cache->Match) == SQLITE_ROW)
+        {
+            free(ret);
+            ret = NULL;
+        }
+    }
+    sqlite3_reset(cache->Match);
+    sqlite3_clear_bindings(cache->Match);
+    pthread_mutex_unlock(&cache->Lock);
+
+    return ret;
+}
+void store_scan_cache(scan_cache_t * cache, const rom_entry_t * rom, const nds_cartridge_t * cart, const char * report)
+{
+    assert(cache != NULL);
+    assert(rom != NULL);
+    assert(cart != NULL);
+    assert(report != NULL);
+
+    // A catalogue has no digests to save and isn't what a later full run
+    // would print anyway.
+    if (cart->Catalog != CART_CATALOG_OFF)
+        return;
+
+    // Too fresh to trust; it can go in next time.
+    if (is_mtime_racy(rom->MtimeNs))
+        return;
+
+    pthread_mutex_lock(&cache->Lock);
+    sqlite3_exec(cache->Db, "BEGIN;", NULL, NULL, NULL);
+
+    sqlite3_bind_text(cache->Forget, 1, rom->Path, -1, SQLITE_STATIC);
+    sqlite3_step(cache->Forget);
+    sqlite3_reset(cache->Forget);
+    sqlite3_clear_bindings(cache->Forget);
+
+    sqlite3_stmt * stmt = cache->InsertRom;
+    sqlite3_bind_text(stmt, 1, rom->Path, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)rom->Device);
+    sqlite3_bind_int64(stmt, 3, (sqlite3_int64)rom->Inode);
+    sqlite3_bind_int64(stmt, 4, (sqlite3_int64)rom->Size);
+    sqlite3_bind_int64(stmt, 5, rom->MtimeNs);
+    sqlite3_bind_int(stmt, 6, cart->Status);
+    if (cart->CartHash != NULL)
+        sqlite3_bind_int64(stmt, 7, cart->CartCrc);
+    bind_hash(stmt, 8, cart->CartHash);
+    if (cart->Status == 0)
+    {
+        sqlite3_bind_int(stmt, 9, cart->HeaderCrc16);
+        sqlite3_bind_int64(stmt, 10, (sqlite3_int64)cart->TrimSize);
+    }
+    bind_hash(stmt, 11, cart->TrimHash);
+    bind_hash(stmt, 12, cart->Arm9Hash);
+    bind_hash(stmt, 13, cart->Arm7Hash);
+    bind_hash(stmt, 14, cart->Arm9OverlayHash);
+    bind_hash(stmt, 15, cart->Arm7OverlayHash);
+    bind_hash(stmt, 16, (cart->Banner != NULL) ? cart->Banner->BannerHash : NULL);
+    sqlite3_bind_text(stmt, 17, report, -1, SQLITE_STATIC);
+    int result = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    sqlite3_int64 rom_id = sqlite3_last_insert_rowid(cache->Db);
+
+    if (result == SQLITE_DONE && cart->Banner != NULL)
+    {
+        stmt = cache->InsertName;
+        for (int i = 0; i < 7 && result == SQLITE_DONE; i++)
+        {
+            sqlite3_bind_int64(stmt, 1, rom_id);
+            sqlite3_bind_text(stmt, 2, banner_languages[i], -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 3, cart->Banner->BannerNames[cart->Banner->BannerNameIndexes[i]], -1, SQLITE_STATIC);
+            result = sqlite3_step(stmt);
+            sqlite3_reset(stmt);
+            sqlite3_clear_bindings(stmt);
+        }
+    }
+    if (result == SQLITE_DONE && cart->FileTable != NULL)
+    {
+        stmt = cache->InsertFile;
+        for (unsigned int i = 0; i < cart->FileTable->NumFiles && result == SQLITE_DONE; i++)
+        {
+            const nds_cartridge_file_t * file = cart->FileTable->Files + i;
+            sqlite3_bind_int64(stmt, 1, rom_id);
+            sqlite3_bind_int(stmt, 2, file->FileID);
+            sqlite3_bind_text(stmt, 3, file->FullFileName, -1, SQLITE_STATIC);
+            sqlite3_bind_int64(stmt, 4, file->FileSize);
+            bind_hash(stmt, 5, file->FileHash);
+            result = sqlite3_step(stmt);
+            sqlite3_reset(stmt);
+            sqlite3_clear_bindings(stmt);
+        }
+    }
+
+    // Half an entry is worse than none.
+    sqlite3_exec(cache->Db, (result == SQLITE_DONE) ? "COMMIT;" : "ROLLBACK;", NULL, NULL, NULL);
+    pthread_mutex_unlock(&cache->Lock);
+}
+static void bind_hash(sqlite3_stmt * stmt, int column, const SHA512_HASH * hash)
+{
+    // Missing hashes stay NULL.
+    if (hash != NULL)
+        sqlite3_bind_blob(stmt, column, hash, sizeof(SHA512_HASH), SQLITE_STATIC);
+}
@@ -0,0 +1,43 @@
+/* The scan cache remembers what every ROM came out as in an SQLite file,
+ * so a re-run over a collection that mostly hasn't changed only has to
+ * read the ROMs that have.  A ROM is the same ROM if its path, device,
+ * inode, size and mtime (to the nanosecond) all still match; anything
+ * else and it's audited again and the old entry replaced.
+ *
+ * Alongside the finished report every digest gets its own column (and
+ * the banner names and per-file hashes their own tables) so the file is
+ * useful to query on its own.
+ *
+ * Only full audits are cached.  Catalogues never hash anything so there
+ * is nothing worth saving.
+ *
+ * It doubles as a list of ROMs we know by content.  Archives record each
+ * member's size and CRC32, and where those pick out exactly one ROM ever
+ * hashed (however many copies of it there were) its report can stand in
+ * for reading the member at all.
+ */
+
+#ifndef _SCAN_CACHE_H
+#define _SCAN_CACHE_H
+
+#include "cartridge.h"
+#include "scanner.h"
+
+
+typedef struct scan_cache_s scan_cache_t;
+
+// Procs
+// NULL (and a message on stderr) if the file can't be opened or created.
+scan_cache_t * open_scan_cache(const char * path);
+void close_scan_cache(scan_cache_t * cache);
+
+// Both are safe to call from any number of threads at once.
+// Returns the malloc'd report for a ROM that hasn't changed, or NULL.
+char * lookup_scan_cache(scan_cache_t * cache, const rom_entry_t * rom);
+void store_scan_cache(scan_cache_t * cache, const rom_entry_t * rom, const nds_cartridge_t * cart, const char * report);
+
+// The report for the one ROM with this size and CRC32, or NULL if there's
+// none or they belong to ROMs that hash differently.  Malloc'd, like a lookup.
+char * match_scan_cache(scan_cache_t * cache, size_t size, uint32_t crc);
+
+#endif
@@ -0,0 +1,252 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "io_helper.h"
+#include "scan_journal.h"
+#include "scanner.h"
+#include "libraries/asprintf.h"
+
+
+/* On disk it's a header line and then one record after another:
+ *
+ *   <path length> <report length> <size> <mtime_ns>\n<path><report>\n
+ *
+ * Lengths up front mean reports can hold anything (newlines included)
+ * and a record cut short is easy to spot.
+ */
+typedef struct journal_record_s
+{
+    char * Path;
+    char * Report;
+    size_t Size;
+    int64_t MtimeNs;
+    size_t Order; // Later records win.
+} journal_record_t;
+
+struct scan_journal_s
+{
+    int Fd;
+    pthread_mutex_t Lock;
+    size_t Unsynced;
+    int64_t LastSync;
+
+    size_t NumRecords;
+    journal_record_t * Records; // From earlier runs, by path
+};
+
+static const char * journal_magic = "ungood journal 1\n";
+static const size_t journal_sync_records = 64;
+static const int64_t journal_sync_ms = 2000;
+
+
+// Decs
+static size_t parse_journal(scan_journal_t *, const char *, size_t);
+static void push_record(scan_journal_t *, size_t *, const journal_record_t *);
+static int compare_records(const void *, const void *);
+
+
+// Init / Destroy
+scan_journal_t * open_scan_journal(const char * path, bool resume)
+{
+    assert(path != NULL);
+
+    scan_journal_t * ret = malloc(sizeof(scan_journal_t));
+    memset(ret, 0, sizeof(scan_journal_t));
+    pthread_mutex_init(&ret->Lock, NULL);
+    ret->LastSync = now_ms();
+
+    ret->Fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | (resume ? 0 : O_TRUNC), 0644);
+    if (ret->Fd < 0)
+    {
+        fprintf(stderr, "Can't open journal %s: %s\n", path, strerror(errno));
+        close_scan_journal(ret);
+        return NULL;
+    }
+
+    // Read back whatever is there.  Only complete records count; anything
+    // after the last one is the half-written tail of a run that died.
+    struct stat st;
+    size_t magic_len = strlen(journal_magic);
+    size_t valid = 0;
+    if (fstat(ret->Fd, &st) == 0 && st.st_size > 0)
+    {
+        char * contents = malloc(st.st_size);
+        if (pread(ret->Fd, contents, st.st_size, 0) != st.st_size || (size_t)st.st_size < magic_len || memcmp(contents, journal_magic, magic_len) != 0)
+        {
+            fprintf(stderr, "%s isn't a journal; not touching it\n", path);
+            free(contents);
+            close_scan_journal(ret);
+            return NULL;
+        }
+
+        valid = magic_len + parse_journal(ret, contents + magic_len, st.st_size - magic_len);
+        free(contents);
+    }
+
+    if (valid == 0)
+    {
+        write_fully(ret->Fd, journal_magic, magic_len);
+        valid = magic_len;
+    }
+    if (ftruncate(ret->Fd, valid) != 0 || lseek(ret->Fd, valid, SEEK_SET) < 0)
+    {
+        fprintf(stderr, "Can't use journal %s: %s\n", path, strerror(errno));
+        close_scan_journal(ret);
+        return NULL;
+    }
+
+    // By path (and then age) so a lookup is a binary search.
+    qsort(ret->Records, ret->NumRecords, sizeof(journal_record_t), compare_records);
+    return ret;
+}
+void close_scan_journal(scan_journal_t * journal)
+{
+    if (journal == NULL)
+        return;
+
+    if (journal->Fd >= 0)
+    {
+        fdatasync(journal->Fd);
+        close(journal->Fd);
+    }
+
+    for (size_t i = 0; i < journal->NumRecords; i++)
+    {
+        free(journal->Records[i].Path);
+        free(journal->Records[i].Report);
+    }
+
+    free(journal->Records);
+    pthread_mutex_destroy(&journal->Lock);
+    free(journal);
+}
+static size_t parse_journal(scan_journal_t * journal, const char * buf, size_t buflen)
+{
+    // Returns how much of buf was whole records.
+    size_t capacity = 0;
+    size_t pos = 0;
+    while (pos < buflen)
+    {
+        const char * end = memchr(buf + pos, '\n', buflen - pos);
+        if (end == NULL)
+            break;
+
+        size_t path_len, report_len, size;
+        int64_t mtime_ns;
+        char line[128];
+        size_t line_len = end - (buf + pos);
+        if (line_len >= sizeof(line))
+            break;
+        memcpy(line, buf + pos, line_len);
+        line[line_len] = '\0';
+        if (sscanf(line, "%zu %zu %zu %" SCNd64, &path_len, &report_len, &size, &mtime_ns) != 4)
+            break;
+
+        size_t body = (end + 1) - buf;
+        if (path_len > buflen - body || report_len > buflen - body - path_len || buflen - body - path_len - report_len < 1 || buf[body + path_len + report_len] != '\n')
+            break;
+
+        journal_record_t record;
+        record.Path = strndup(buf + body, path_len);
+        record.Report = strndup(buf + body + path_len, report_len);
+        record.Size = size;
+        record.MtimeNs = mtime_ns;
+        record.Order = journal->NumRecords;
+        push_record(journal, &capacity, &record);
+
+        pos = body + path_len + report_len + 1;
+    }
+
+    return pos;
+}
+static void push_record(scan_journal_t * journal, size_t * capacity, const journal_record_t * record)
+{
+    if (journal->NumRecords == *capacity)
+    {
+        *capacity = (*capacity == 0) ? 256 : *capacity * 2;
+        journal->Records = realloc(journal->Records, sizeof(journal_record_t) * *capacity);
+    }
+
+    journal->Records[journal->NumRecords++] = *record;
+}
+
+// Procs
+char * lookup_scan_journal(scan_journal_t * journal, const rom_entry_t * rom)
+{
+    assert(journal != NULL);
+    assert(rom != NULL);
+
+    // Find the last record for this path.
+    size_t low = 0;
+    size_t high = journal->NumRecords;
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (strcmp(journal->Records[mid].Path, rom->Path) <= 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (low == 0)
+        return NULL;
+
+    const journal_record_t * record = journal->Records + low - 1;
+    if (strcmp(record->Path, rom->Path) != 0 || record->Size != rom->Size || record->MtimeNs != rom->MtimeNs)
+        return NULL;
+
+    return strdup(record->Report);
+}
+void append_scan_journal(scan_journal_t * journal, const rom_entry_t * rom, const char * report)
+{
+    assert(journal != NULL);
+    assert(rom != NULL);
+    assert(report != NULL);
+
+    // One write per record so records from different threads never
+    // interleave.
+    char * header;
+    size_t path_len = strlen(rom->Path);
+    size_t report_len = strlen(report);
+    int header_len = asprintf(&header, "%zu %zu %zu %" PRId64 "\n", path_len, report_len, rom->Size, rom->MtimeNs);
+    size_t record_len = header_len + path_len + report_len + 1;
+    char * record = malloc(record_len);
+    memcpy(record, header, header_len);
+    memcpy(record + header_len, rom->Path, path_len);
+    memcpy(record + header_len + path_len, report, report_len);
+    record[record_len - 1] = '\n';
+    free(header);
+
+    pthread_mutex_lock(&journal->Lock);
+    if (write_fully(journal->Fd, record, record_len))
+        journal->Unsynced++;
+
+    if (journal->Unsynced >= journal_sync_records || (journal->Unsynced > 0 && now_ms() - journal->LastSync >= journal_sync_ms))
+    {
+        fdatasync(journal->Fd);
+        journal->Unsynced = 0;
+        journal->LastSync = now_ms();
+    }
+    pthread_mutex_unlock(&journal->Lock);
+
+    free(record);
+}
+static int compare_records(const void * a, const void * b)
+{
+    const journal_record_t * record_a = a;
+    const journal_record_t * record_b = b;
+    int ret = strcmp(record_a->Path, record_b->Path);
+    if (ret != 0)
+        return ret;
+
+    return (record_a->Order < record_b->Order) ? -1 : (record_a->Order > record_b->Order);
+}
@@ -0,0 +1,34 @@
+/* The journal is an append-only record of every ROM a run has finished
+ * with and the report it came out with, so a run that dies part way (a
+ * crash, the OOM killer, a reboot) doesn't have to start from scratch.
+ * Records are flushed to disk in batches; at worst the last batch is
+ * redone.
+ *
+ * Resuming reads the journal back and hands out the reports for ROMs
+ * whose path, size and mtime still match, so the final report reads as
+ * if it had all been done in one go.  A record torn by the crash is cut
+ * off before anything new is appended.
+ */
+
+#ifndef _SCAN_JOURNAL_H
+#define _SCAN_JOURNAL_H
+
+#include <stdbool.h>
+#include "scanner.h"
+
+
+typedef struct scan_journal_s scan_journal_t;
+
+// Procs
+// Without resume an existing journal is started over.  NULL (and a
+// message on stderr) if the file can't be used.
+scan_journal_t * open_scan_journal(const char * path, bool resume);
+void close_scan_journal(scan_journal_t * journal);
+
+// Returns a malloc'd report from an earlier run, or NULL.
+char * lookup_scan_journal(scan_journal_t * journal, const rom_entry_t * rom);
+
+// Safe to call from any number of threads at once.
+void append_scan_journal(scan_journal_t * journal, const rom_entry_t * rom, const char * report);
+
+#endif
@@ -0,0 +1,879 @@
+#define _GNU_SOURCE // getdents64, statx
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "cartridge.h"
+#include "io_helper.h"
+#include "scanner.h"
+#include "solid_archive.h"
+#include "zip_archive.h"
+#include "libraries/asprintf.h"
+
+
+/* Directories are walked breadth first.  Each level is split among the
+ * threads, and only once the whole level is in do we sort what was found
+ * and decide what's new.  That keeps the "which alias of a bind mounted
+ * directory wins" decision out of the hands of the thread scheduler.
+ *
+ * A level happens in two passes.  First the directories are listed with
+ * big getdents64 reads, which is where huge directories on network
+ * storage used to spend their time one readdir at a time.  Then whatever
+ * might be a ROM or a directory gets a statx, with those spread over the
+ * threads entry by entry so a single 100k entry directory isn't stuck
+ * on one of them.  statx also hands us the size and mtime the scheduler
+ * wants, so nobody has to open a file just to find out how big it is.
+ *
+ * A file named .nds is taken at its word; if it turns out to be broken
+ * that's something the report should say.  Dumps also turn up named
+ * .srl, .dsi, .bin or nothing at all, and those only get in if the first
+ * few hundred bytes look like a DS header.  Anything else is skipped on
+ * its name alone.
+ *
+ * Archives go through the same levels as any other file (so each is only
+ * visited once) and are looked inside at the end, a thread per archive.
+ * Zip members are judged by name and sniffed the same way files are;
+ * members of solid 7z and xz archives go by name alone.  Tars are taken
+ * whole, like ROMs; whoever reads them judges the members on the way.
+ */
+static const size_t dirent_buffer_size = 256 * 1024;
+
+// Anything found while reading a directory.
+typedef struct scan_item_s
+{
+    char * Path;
+    char * Member;
+    bool Solid;
+    bool Tar;
+    bool HasCrc;
+    uint32_t Crc;
+    dev_t Device;
+    ino_t Inode;
+    size_t Size;
+    int64_t MtimeNs;
+    int Root;
+    bool IsDir;
+    bool IsArchive;
+} scan_item_t;
+typedef struct scan_items_s
+{
+    size_t Count;
+    size_t Capacity;
+    scan_item_t * Items;
+} scan_items_t;
+
+// (st_dev, st_ino) pairs we've already seen.  Open addressing, never shrinks.
+typedef struct scan_visited_s
+{
+    size_t Count;
+    size_t Capacity;
+    dev_t * Devices;
+    ino_t * Inodes;
+    bool * Used;
+} scan_visited_t;
+
+// One pass over a level's worth of items shared between the threads.
+typedef void (*scan_work_t)(const scan_item_t *, scan_items_t *);
+typedef struct scan_level_s
+{
+    pthread_mutex_t Lock;
+    size_t Next;
+    const scan_items_t * Items;
+    scan_work_t Work;
+    scan_items_t * Found; // One per thread
+} scan_level_t;
+typedef struct scan_thread_s
+{
+    scan_level_t * Level;
+    int Index;
+} scan_thread_t;
+
+// Where a ROM on a spinning disk sits, for putting them in order.
+typedef struct scan_placement_s
+{
+    size_t Index;
+    dev_t Device;
+    bool Mapped; // Physical came from FIEMAP
+    uint64_t Physical;
+    ino_t Inode;
+} scan_placement_t;
+
+
+// Decs
+static void push_item(scan_items_t *, const scan_item_t *);
+static void clear_items(scan_items_t *);
+static int compare_items(const void *, const void *);
+static bool visit(scan_visited_t *, dev_t, ino_t);
+static bool is_rom_name(const char *);
+static bool is_sniff_name(const char *);
+static bool is_archive_name(const char *);
+static bool is_tar_name(const char *);
+static bool is_zip_name(const char *);
+static bool sniff_file(const char *);
+static bool sniff_member(zip_archive_t *, const zip_entry_t *);
+static bool is_rom_member(zip_archive_t *, const zip_entry_t *, const char *);
+static bool is_solid_rom_member(const solid_archive_t *, const solid_entry_t *, const char *);
+static void list_archive(const scan_item_t *, scan_items_t *);
+static void list_zip_archive(const scan_item_t *, scan_items_t *);
+static void list_solid_archive(const scan_item_t *, scan_items_t *);
+static bool stat_item(const char *, scan_item_t *);
+static void list_directory(const scan_item_t *, scan_items_t *);
+static void stat_candidate(const scan_item_t *, scan_items_t *);
+static void * scan_thread(void *);
+static void scan_level(const scan_items_t *, scan_items_t *, scan_work_t, int);
+static int compare_schedule(const void *, const void *, void *);
+static int compare_placements(const void *, const void *);
+
+
+// Init / Destroy
+rom_list_t * scan_roots(char * const * roots, int num_roots, int num_threads)
+{
+    assert(roots != NULL || num_roots == 0);
+
+    if (num_threads < 1)
+        num_threads = 1;
+
+    scan_visited_t visited;
+    scan_items_t dirs, found, files, walked, archives;
+    memset(&visited, 0, sizeof(visited));
+    memset(&dirs, 0, sizeof(dirs));
+    memset(&found, 0, sizeof(found));
+    memset(&files, 0, sizeof(files));
+    memset(&walked, 0, sizeof(walked));
+    memset(&archives, 0, sizeof(archives));
+
+    // Roots are stat'd up front.  A root that's a file is taken at its
+    // word even if the name doesn't look like a ROM (unless it looks like
+    // an archive).
+    for (int i = 0; i < num_roots; i++)
+    {
+        scan_item_t item;
+        memset(&item, 0, sizeof(item));
+        item.Root = i;
+        if (!stat_item(roots[i], &item))
+            continue;
+
+        const char * name = strrchr(roots[i], '/');
+        name = (name != NULL) ? name + 1 : roots[i];
+        item.IsArchive = !item.IsDir && is_archive_name(name);
+        item.Tar = !item.IsDir && is_tar_name(name);
+        item.Path = strdup(roots[i]);
+        push_item(&found, &item);
+    }
+
+    // Walk a level, sort what it turned up, keep what's new, repeat.
+    while (found.Count > 0)
+    {
+        qsort(found.Items, found.Count, sizeof(scan_item_t), compare_items);
+        for (size_t i = 0; i < found.Count; i++)
+        {
+            scan_item_t * item = found.Items + i;
+            if (!visit(&visited, item->Device, item->Inode))
+                free(item->Path);
+            else if (item->IsDir)
+                push_item(&dirs, item);
+            else if (item->IsArchive)
+                push_item(&archives, item);
+            else
+                push_item(&files, item);
+        }
+        found.Count = 0;
+
+        scan_items_t candidates;
+        memset(&candidates, 0, sizeof(candidates));
+        scan_level(&dirs, &candidates, list_directory, num_threads);
+        scan_level(&candidates, &found, stat_candidate, num_threads);
+        clear_items(&candidates);
+        free(candidates.Items);
+
+        // Hang on to the directories; whoever asked might want to watch them.
+        for (size_t i = 0; i < dirs.Count; i++)
+        {
+            push_item(&walked, dirs.Items + i);
+        }
+        dirs.Count = 0;
+    }
+
+    // Whatever is in the archives joins the files.
+    scan_level(&archives, &files, list_archive, num_threads);
+    clear_items(&archives);
+
+    // Files turned up a level at a time; put them in report order.
+    if (files.Count > 0)
+        qsort(files.Items, files.Count, sizeof(scan_item_t), compare_items);
+
+    rom_list_t * ret = malloc(sizeof(rom_list_t));
+    ret->NumEntries = files.Count;
+    ret->Entries = malloc(sizeof(rom_entry_t) * (files.Count + 1));
+    ret->Schedule = malloc(sizeof(size_t) * (files.Count + 1));
+    for (size_t i = 0; i < files.Count; i++)
+    {
+        ret->Entries[i].Path = files.Items[i].Path;
+        ret->Entries[i].Member = files.Items[i].Member;
+        ret->Entries[i].Solid = files.Items[i].Solid;
+        ret->Entries[i].Tar = files.Items[i].Tar;
+        ret->Entries[i].HasCrc = files.Items[i].HasCrc;
+        ret->Entries[i].Crc = files.Items[i].Crc;
+        ret->Entries[i].Device = files.Items[i].Device;
+        ret->Entries[i].Inode = files.Items[i].Inode;
+        ret->Entries[i].Size = files.Items[i].Size;
+        ret->Entries[i].MtimeNs = files.Items[i].MtimeNs;
+        ret->Schedule[i] = i;
+    }
+    ret->NumDirectories = walked.Count;
+    ret->Directories = malloc(sizeof(char *) * (walked.Count + 1));
+    for (size_t i = 0; i < walked.Count; i++)
+    {
+        ret->Directories[i] = walked.Items[i].Path;
+    }
+
+    free(walked.Items);
+    free(archives.Items);
+    free(files.Items);
+    free(found.Items);
+    free(dirs.Items);
+    free(visited.Devices);
+    free(visited.Inodes);
+    free(visited.Used);
+
+    return ret;
+}
+void free_rom_list(rom_list_t * list)
+{
+    if (list == NULL)
+        return;
+
+    for (size_t i = 0; i < list->NumEntries; i++)
+    {
+        free(list->Entries[i].Path);
+        free(list->Entries[i].Member);
+    }
+
+    for (size_t i = 0; i < list->NumDirectories; i++)
+    {
+        free(list->Directories[i]);
+    }
+
+    free(list->Entries);
+    free(list->Schedule);
+    free(list->Directories);
+    free(list);
+}
+bool scan_file(const char * path, rom_entry_t * out_entry)
+{
+    assert(path != NULL);
+    assert(out_entry != NULL);
+
+    // The same test a file found by walking gets.
+    scan_item_t item;
+    memset(&item, 0, sizeof(item));
+    const char * name = strrchr(path, '/');
+    name = (name != NULL) ? name + 1 : path;
+    if (stat_item(path, &item))
+    {
+        if (item.IsDir || is_archive_name(name))
+            return false;
+        bool tar = is_tar_name(name);
+        if (!tar && !is_rom_name(name) && !(is_sniff_name(name) && sniff_file(path)))
+            return false;
+
+        out_entry->Path = strdup(path);
+        out_entry->Member = NULL;
+        out_entry->Solid = false;
+        out_entry->Tar = tar;
+        out_entry->HasCrc = false;
+        out_entry->Crc = 0;
+        out_entry->Device = item.Device;
+        out_entry->Inode = item.Inode;
+        out_entry->Size = item.Size;
+        out_entry->MtimeNs = item.MtimeNs;
+        return true;
+    }
+
+    // Nothing there; maybe part of the way along is an archive and the
+    // rest is a member of it.
+    for (const char * slash = strchr(path, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+    {
+        char * prefix = strndup(path, slash - path);
+        const char * base = strrchr(prefix, '/');
+        base = (base != NULL) ? base + 1 : prefix;
+        if (!is_archive_name(base) || !stat_item(prefix, &item) || item.IsDir)
+        {
+            free(prefix);
+            continue;
+        }
+
+        // Listing the lot is the only way to be sure it's one we'd list.
+        scan_items_t found;
+        memset(&found, 0, sizeof(found));
+        item.Path = prefix;
+        list_archive(&item, &found);
+
+        bool ret = false;
+        for (size_t i = 0; i < found.Count && !ret; i++)
+        {
+            const scan_item_t * member = found.Items + i;
+            if (strcmp(member->Member, slash + 1) != 0)
+                continue;
+
+            out_entry->Path = strdup(path);
+            out_entry->Member = strdup(member->Member);
+            out_entry->Solid = member->Solid;
+            out_entry->Tar = false;
+            out_entry->HasCrc = member->HasCrc;
+            out_entry->Crc = member->Crc;
+            out_entry->Device = member->Device;
+            out_entry->Inode = member->Inode;
+            out_entry->Size = member->Size;
+            out_entry->MtimeNs = member->MtimeNs;
+            ret = true;
+        }
+
+        clear_items(&found);
+        free(found.Items);
+        free(prefix);
+        return ret;
+    }
+
+    return false;
+}
+size_t scan_archive(const char * path, rom_entry_t ** out_entries)
+{
+    assert(path != NULL);
+    assert(out_entries != NULL);
+
+    scan_item_t item;
+    scan_items_t found;
+    memset(&item, 0, sizeof(item));
+    memset(&found, 0, sizeof(found));
+    if (stat_item(path, &item) && !item.IsDir)
+    {
+        item.Path = (char *)path;
+        list_archive(&item, &found);
+    }
+
+    *out_entries = malloc(sizeof(rom_entry_t) * (found.Count + 1));
+    for (size_t i = 0; i < found.Count; i++)
+    {
+        (*out_entries)[i].Path = found.Items[i].Path;
+        (*out_entries)[i].Member = found.Items[i].Member;
+        (*out_entries)[i].Solid = found.Items[i].Solid;
+        (*out_entries)[i].Tar = found.Items[i].Tar;
+        (*out_entries)[i].HasCrc = found.Items[i].HasCrc;
+        (*out_entries)[i].Crc = found.Items[i].Crc;
+        (*out_entries)[i].Device = found.Items[i].Device;
+        (*out_entries)[i].Inode = found.Items[i].Inode;
+        (*out_entries)[i].Size = found.Items[i].Size;
+        (*out_entries)[i].MtimeNs = found.Items[i].MtimeNs;
+    }
+
+    size_t ret = found.Count;
+    free(found.Items);
+    return ret;
+}
+char * get_rom_archive(const rom_entry_t * rom)
+{
+    assert(rom != NULL);
+
+    if (rom->Member == NULL)
+        return NULL;
+
+    // Path is always the archive, a slash and then the member.
+    size_t path_len = strlen(rom->Path);
+    size_t member_len = strlen(rom->Member);
+    assert(path_len > member_len);
+    return strndup(rom->Path, path_len - member_len - 1);
+}
+bool is_archive_path(const char * path)
+{
+    assert(path != NULL);
+
+    const char * name = strrchr(path, '/');
+    return is_archive_name((name != NULL) ? name + 1 : path);
+}
+bool is_rom_file_name(const char * name, bool * out_sniff)
+{
+    assert(name != NULL);
+    assert(out_sniff != NULL);
+
+    *out_sniff = !is_rom_name(name);
+    return !*out_sniff || is_sniff_name(name);
+}
+
+// Scheduling
+void schedule_largest_first(rom_list_t * list)
+{
+    assert(list != NULL);
+
+    qsort_r(list->Schedule, list->NumEntries, sizeof(size_t), compare_schedule, list);
+}
+void schedule_disk_order(rom_list_t * list, bool (*rotational)(dev_t))
+{
+    assert(list != NULL);
+    assert(rotational != NULL);
+
+    // Note which places in the schedule belong to ROMs on spinning disks
+    // and where each of those ROMs starts.  Opening them is cheap next to
+    // the seeks it saves; the walk just stat'd them all anyway.
+    size_t * slots = malloc(sizeof(size_t) * (list->NumEntries + 1));
+    scan_placement_t * placements = malloc(sizeof(scan_placement_t) * (list->NumEntries + 1));
+    size_t count = 0;
+    for (size_t next = 0; next < list->NumEntries; next++)
+    {
+        const rom_entry_t * rom = list->Entries + list->Schedule[next];
+        if (!rotational(rom->Device))
+            continue;
+
+        scan_placement_t * placement = placements + count;
+        placement->Index = list->Schedule[next];
+        placement->Device = rom->Device;
+        placement->Inode = rom->Inode;
+        placement->Mapped = false;
+        char * archive = get_rom_archive(rom);
+        int fd = open((archive != NULL) ? archive : rom->Path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0)
+        {
+            placement->Mapped = get_physical_offset(fd, &placement->Physical);
+            close(fd);
+        }
+        free(archive);
+
+        slots[count++] = next;
+    }
+
+    // Then hand those places back out in disk order.
+    qsort(placements, count, sizeof(scan_placement_t), compare_placements);
+    for (size_t i = 0; i < count; i++)
+    {
+        list->Schedule[slots[i]] = placements[i].Index;
+    }
+
+    free(slots);
+    free(placements);
+}
+
+
+// Walking
+static void scan_level(const scan_items_t * items, scan_items_t * out_found, scan_work_t work, int num_threads)
+{
+    if (items->Count == 0)
+        return;
+    if ((size_t)num_threads > items->Count)
+        num_threads = items->Count;
+
+    scan_level_t level;
+    pthread_mutex_init(&level.Lock, NULL);
+    level.Next = 0;
+    level.Items = items;
+    level.Work = work;
+    level.Found = malloc(sizeof(scan_items_t) * num_threads);
+    memset(level.Found, 0, sizeof(scan_items_t) * num_threads);
+
+    // The calling thread pulls its weight as thread 0.
+    pthread_t * threads = malloc(sizeof(pthread_t) * num_threads);
+    scan_thread_t * args = malloc(sizeof(scan_thread_t) * num_threads);
+    for (int i = 0; i < num_threads; i++)
+    {
+        args[i].Level = &level;
+        args[i].Index = i;
+        if (i > 0)
+            pthread_create(threads + i, NULL, scan_thread, args + i);
+    }
+    scan_thread(args);
+    for (int i = 1; i < num_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < num_threads; i++)
+    {
+        for (size_t j = 0; j < level.Found[i].Count; j++)
+        {
+            push_item(out_found, level.Found[i].Items + j);
+        }
+        free(level.Found[i].Items);
+    }
+
+    free(args);
+    free(threads);
+    free(level.Found);
+    pthread_mutex_destroy(&level.Lock);
+}
+static void * scan_thread(void * arg)
+{
+    scan_thread_t * self = arg;
+    scan_level_t * level = self->Level;
+
+    while (1)
+    {
+        pthread_mutex_lock(&level->Lock);
+        size_t index = level->Next++;
+        pthread_mutex_unlock(&level->Lock);
+
+        if (index >= level->Items->Count)
+            break;
+
+        level->Work(level->Items->Items + index, level->Found + self->Index);
+    }
+
+    return NULL;
+}
+static void list_directory(const scan_item_t * dir, scan_items_t * out_candidates)
+{
+    int fd = open(dir->Path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    uint8_t * buffer = malloc(dirent_buffer_size);
+    ssize_t got;
+    while ((got = getdents64(fd, buffer, dirent_buffer_size)) > 0)
+    {
+        for (ssize_t pos = 0; pos < got;)
+        {
+            struct dirent64 * entry = (struct dirent64 *)(buffer + pos);
+            pos += entry->d_reclen;
+
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                continue;
+
+            // Plain files we can judge by name without a stat.  Everything
+            // that survives gets one; d_ino isn't trustworthy on every
+            // filesystem (overlayfs) and we're going to open the ROMs anyway.
+            if (entry->d_type == DT_REG && !is_rom_name(entry->d_name) && !is_sniff_name(entry->d_name) && !is_archive_name(entry->d_name) && !is_tar_name(entry->d_name))
+                continue;
+
+            scan_item_t item;
+            memset(&item, 0, sizeof(item));
+            asprintf(&item.Path, "%s/%s", dir->Path, entry->d_name);
+            item.Root = dir->Root;
+            push_item(out_candidates, &item);
+        }
+    }
+
+    free(buffer);
+    close(fd);
+}
+static void stat_candidate(const scan_item_t * candidate, scan_items_t * out_found)
+{
+    // Directories (or links to them), archives, ROM named regular files
+    // and anything else that smells like a ROM survive.
+    scan_item_t item = *candidate;
+    const char * name = strrchr(candidate->Path, '/') + 1;
+    if (!stat_item(candidate->Path, &item))
+        return;
+
+    item.IsArchive = !item.IsDir && is_archive_name(name);
+    item.Tar = !item.IsDir && is_tar_name(name);
+    if (!item.IsDir && !item.IsArchive && !item.Tar && !is_rom_name(name) && !(is_sniff_name(name) && sniff_file(candidate->Path)))
+        return;
+
+    item.Path = strdup(candidate->Path);
+    push_item(out_found, &item);
+}
+static bool stat_item(const char * path, scan_item_t * out_item)
+{
+    // Directories and regular files only.  DONT_SYNC lets network
+    // filesystems answer from what they already know; the sizes are only
+    // for scheduling and the loader looks again when it opens the file.
+    struct statx stx;
+    if (statx(AT_FDCWD, path, AT_STATX_DONT_SYNC, STATX_TYPE | STATX_INO | STATX_SIZE | STATX_MTIME, &stx) == 0)
+    {
+        if (!S_ISDIR(stx.stx_mode) && !S_ISREG(stx.stx_mode))
+            return false;
+
+        out_item->Device = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+        out_item->Inode = stx.stx_ino;
+        out_item->Size = stx.stx_size;
+        out_item->MtimeNs = (int64_t)stx.stx_mtime.tv_sec * 1000000000 + stx.stx_mtime.tv_nsec;
+        out_item->IsDir = S_ISDIR(stx.stx_mode);
+        return true;
+    }
+    if (errno != ENOSYS)
+        return false;
+
+    // Kernels older than 4.11 get the plain version.
+    struct stat st;
+    if (stat(path, &st) != 0 || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)))
+        return false;
+
+    out_item->Device = st.st_dev;
+    out_item->Inode = st.st_ino;
+    out_item->Size = st.st_size;
+    out_item->MtimeNs = stat_mtime_ns(&st);
+    out_item->IsDir = S_ISDIR(st.st_mode);
+    return true;
+}
+static bool is_rom_name(const char * name)
+{
+    size_t len = strlen(name);
+    return (len >= 4 && strcmp(name + len - 4, ".nds") == 0);
+}
+static bool is_sniff_name(const char * name)
+{
+    // Dot files with no other dot count as having no extension.
+    const char * ext = strrchr(name, '.');
+    if (ext == NULL || ext == name)
+        return true;
+
+    return strcasecmp(ext, ".nds") == 0 || strcasecmp(ext, ".srl") == 0 || strcasecmp(ext, ".dsi") == 0 || strcasecmp(ext, ".bin") == 0;
+}
+static bool sniff_file(const char * path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    uint8_t * buffer = malloc(nds_sniff_size);
+    size_t got = pread_fully(fd, buffer, nds_sniff_size, 0);
+    bool ret = (sniff_nds_header(buffer, got) != ROM_KIND_NONE);
+
+    free(buffer);
+    close(fd);
+    return ret;
+}
+static bool is_archive_name(const char * name)
+{
+    // A .tar.xz is a tar first.
+    const char * ext = strrchr(name, '.');
+    return ext != NULL && !is_tar_name(name) && (strcasecmp(ext, ".zip") == 0 || strcasecmp(ext, ".7z") == 0 || strcasecmp(ext, ".xz") == 0);
+}
+static bool is_tar_name(const char * name)
+{
+    static const char * suffixes[] = { ".tar", ".tar.gz", ".tgz", ".tar.xz", ".txz", ".tar.zst", ".tzst" };
+    size_t len = strlen(name);
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++)
+    {
+        size_t suffix_len = strlen(suffixes[i]);
+        if (len > suffix_len && strcasecmp(name + len - suffix_len, suffixes[i]) == 0)
+            return true;
+    }
+
+    return false;
+}
+static bool is_zip_name(const char * name)
+{
+    const char * ext = strrchr(name, '.');
+    return ext != NULL && strcasecmp(ext, ".zip") == 0;
+}
+static bool sniff_member(zip_archive_t * archive, const zip_entry_t * entry)
+{
+    zip_member_t * member = open_zip_member(archive, entry);
+    if (member == NULL)
+        return false;
+
+    uint8_t * buffer = malloc(nds_sniff_size);
+    size_t got = read_zip_member(member, buffer, nds_sniff_size, 0);
+    bool ret = (sniff_nds_header(buffer, got) != ROM_KIND_NONE);
+
+    free(buffer);
+    close_zip_member(member);
+    return ret;
+}
+static bool is_rom_member(zip_archive_t * archive, const zip_entry_t * entry, const char * path)
+{
+    // Members get the same test as files, by the last part of their name.
+    // One we'd have taken but can't read is worth a word; the rest of the
+    // archive is nobody's business.
+    const char * name = strrchr(entry->Name, '/');
+    name = (name != NULL) ? name + 1 : entry->Name;
+    if (*name == '\0')
+        return false;
+
+    bool named = is_rom_name(name);
+    if (!can_read_zip_entry(entry))
+    {
+        if (named)
+            fprintf(stderr, "Skipping %s/%s: can't read that kind of zip member\n", path, entry->Name);
+        return false;
+    }
+
+    return named || (is_sniff_name(name) && sniff_member(archive, entry));
+}
+static bool is_solid_rom_member(const solid_archive_t * archive, const solid_entry_t * entry, const char * path)
+{
+    // Sniffing a member of a solid block means decoding everything in
+    // front of it, so these go by name alone, and only names that can't
+    // be anything but a DS ROM.
+    const char * name = strrchr(entry->Name, '/');
+    name = (name != NULL) ? name + 1 : entry->Name;
+    const char * ext = strrchr(name, '.');
+    if (ext == NULL || ext == name || !(strcasecmp(ext, ".nds") == 0 || strcasecmp(ext, ".srl") == 0 || strcasecmp(ext, ".dsi") == 0))
+        return false;
+
+    if (!can_read_solid_entry(archive, entry))
+    {
+        fprintf(stderr, "Skipping %s/%s: can't decode that kind of block\n", path, entry->Name);
+        return false;
+    }
+
+    return true;
+}
+static void list_archive(const scan_item_t * archive_item, scan_items_t * out_found)
+{
+    // Members share the archive's identity (which is what anything cached
+    // against them is checked by) and carry their own size.
+    const char * name = strrchr(archive_item->Path, '/');
+    if (is_zip_name((name != NULL) ? name + 1 : archive_item->Path))
+        list_zip_archive(archive_item, out_found);
+    else
+        list_solid_archive(archive_item, out_found);
+}
+static void list_zip_archive(const scan_item_t * archive_item, scan_items_t * out_found)
+{
+    zip_archive_t * archive = open_zip_archive(archive_item->Path);
+    if (archive == NULL)
+        return;
+
+    for (size_t i = 0; i < archive->NumEntries; i++)
+    {
+        const zip_entry_t * entry = archive->Entries + i;
+        if (!is_rom_member(archive, entry, archive_item->Path))
+            continue;
+
+        scan_item_t item = *archive_item;
+        asprintf(&item.Path, "%s/%s", archive_item->Path, entry->Name);
+        item.Member = strdup(entry->Name);
+        item.Size = entry->Size;
+        item.HasCrc = true;
+        item.Crc = entry->Crc;
+        item.IsArchive = false;
+        push_item(out_found, &item);
+    }
+
+    close_zip_archive(archive);
+}
+static void list_solid_archive(const scan_item_t * archive_item, scan_items_t * out_found)
+{
+    solid_archive_t * archive = open_solid_archive(archive_item->Path);
+    if (archive == NULL)
+        return;
+
+    for (size_t i = 0; i < archive->NumEntries; i++)
+    {
+        const solid_entry_t * entry = archive->Entries + i;
+        if (!is_solid_rom_member(archive, entry, archive_item->Path))
+            continue;
+
+        scan_item_t item = *archive_item;
+        asprintf(&item.Path, "%s/%s", archive_item->Path, entry->Name);
+        item.Member = strdup(entry->Name);
+        item.Solid = true;
+        item.Size = entry->Size;
+        item.HasCrc = entry->HasCrc;
+        item.Crc = entry->Crc;
+        item.IsArchive = false;
+        push_item(out_found, &item);
+    }
+
+    close_solid_archive(archive);
+}
+
+// Bookkeeping
+static void push_item(scan_items_t * items, const scan_item_t * item)
+{
+    if (items->Count == items->Capacity)
+    {
+        items->Capacity = (items->Capacity == 0) ? 64 : items->Capacity * 2;
+        items->Items = realloc(items->Items, sizeof(scan_item_t) * items->Capacity);
+    }
+
+    items->Items[items->Count++] = *item;
+}
+static void clear_items(scan_items_t * items)
+{
+    for (size_t i = 0; i < items->Count; i++)
+    {
+        free(items->Items[i].Path);
+        free(items->Items[i].Member);
+    }
+
+    items->Count = 0;
+}
+static int compare_schedule(const void * a, const void * b, void * arg)
+{
+    const rom_list_t * list = arg;
+    size_t index_a = *(const size_t *)a;
+    size_t index_b = *(const size_t *)b;
+
+    // Ties keep report order.
+    if (list->Entries[index_a].Size != list->Entries[index_b].Size)
+        return (list->Entries[index_a].Size > list->Entries[index_b].Size) ? -1 : 1;
+    return (index_a < index_b) ? -1 : (index_a > index_b);
+}
+static int compare_placements(const void * a, const void * b)
+{
+    // A device at a time.  Anything FIEMAP couldn't place goes after the
+    // rest by inode number, which on most filesystems roughly follows
+    // where things were allocated.
+    const scan_placement_t * placement_a = a;
+    const scan_placement_t * placement_b = b;
+
+    if (placement_a->Device != placement_b->Device)
+        return (placement_a->Device < placement_b->Device) ? -1 : 1;
+    if (placement_a->Mapped != placement_b->Mapped)
+        return placement_a->Mapped ? -1 : 1;
+    if (placement_a->Mapped && placement_a->Physical != placement_b->Physical)
+        return (placement_a->Physical < placement_b->Physical) ? -1 : 1;
+    if (placement_a->Inode != placement_b->Inode)
+        return (placement_a->Inode < placement_b->Inode) ? -1 : 1;
+    return (placement_a->Index < placement_b->Index) ? -1 : (placement_a->Index > placement_b->Index);
+}
+static int compare_items(const void * a, const void * b)
+{
+    const scan_item_t * item_a = a;
+    const scan_item_t * item_b = b;
+
+    if (item_a->Root != item_b->Root)
+        return (item_a->Root < item_b->Root) ? -1 : 1;
+    return strcmp(item_a->Path, item_b->Path);
+}
+static bool visit(scan_visited_t * visited, dev_t device, ino_t inode)
+{
+    // Returns true the first time a given file is seen.
+    if ((visited->Count + 1) * 2 > visited->Capacity)
+    {
+        scan_visited_t grown;
+        grown.Count = 0;
+        grown.Capacity = (visited->Capacity == 0) ? 1024 : visited->Capacity * 2;
+        grown.Devices = malloc(sizeof(dev_t) * grown.Capacity);
+        grown.Inodes = malloc(sizeof(ino_t) * grown.Capacity);
+        grown.Used = malloc(sizeof(bool) * grown.Capacity);
+        memset(grown.Used, 0, sizeof(bool) * grown.Capacity);
+
+        for (size_t i = 0; i < visited->Capacity; i++)
+        {
+            if (visited->Used[i])
+                visit(&grown, visited->Devices[i], visited->Inodes[i]);
+        }
+
+        free(visited->Devices);
+        free(visited->Inodes);
+        free(visited->Used);
+        *visited = grown;
+    }
+
+    size_t slot = (((uint64_t)device * 0x9E3779B97F4A7C15ull) ^ ((uint64_t)inode * 0xC2B2AE3D27D4EB4Full)) % visited->Capacity;
+    while (visited->Used[slot])
+    {
+        if (visited->Devices[slot] == device && visited->Inodes[slot] == inode)
+            return false;
+        slot = (slot + 1) % visited->Capacity;
+    }
+
+    visited->Used[slot] = true;
+    visited->Devices[slot] = device;
+    visited->Inodes[slot] = inode;
+    visited->Count++;
+    return true;
+}
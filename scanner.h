@@ -0,0 +1,85 @@
+/* The scanner walks one or more roots looking for ROMs.  Directories are
+ * read level by level with a pool of threads so slow (network) storage
+ * gets more than one outstanding request.  Every directory and file is
+ * only ever visited once no matter how many ways there are to reach it;
+ * symlink loops and bind mounts resolve to the same (st_dev, st_ino).
+ *
+ * Zip, 7z and xz archives are looked inside and every ROM in one is
+ * listed as archive.zip/member.nds, with the archive's identity and mtime
+ * and the member's (uncompressed) size and CRC32 where the archive has one.
+ * Tars (plain or .gz, .xz, .zst) have no index to list without reading
+ * the lot, so each is listed once, as itself, and read as a stream later.
+ *
+ * The list that comes back is in a stable order (by root, then path) so
+ * two runs over the same tree report in the same order.  The order the
+ * ROMs get worked on is a separate thing (Schedule) and is free to be
+ * whatever keeps the machine busiest.
+ */
+
+#ifndef _SCANNER_H
+#define _SCANNER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+// Our storage records
+typedef struct rom_entry_s
+{
+    char * Path;
+    char * Member; // Archive members only: the name inside it.  Path is archive/Member.
+    bool Solid; // A member of a solid (7z, xz) archive, which only decodes front to back
+    bool Tar; // A tar stream, not a ROM; it stands for whatever ROMs turn up inside
+    bool HasCrc; // Members only: the archive recorded the member's CRC32...
+    uint32_t Crc; // ...which is this, and is good for telling ROMs apart without reading them
+    dev_t Device;
+    ino_t Inode;
+    size_t Size; // As of the scan
+    int64_t MtimeNs;
+} rom_entry_t;
+typedef struct rom_list_s
+{
+    size_t NumEntries;
+    rom_entry_t * Entries; // Report order
+    size_t * Schedule; // Work order, as indexes into Entries
+    size_t NumDirectories;
+    char ** Directories; // Every directory walked to find them
+} rom_list_t;
+
+
+// Procs
+rom_list_t * scan_roots(char * const * roots, int num_roots, int num_threads);
+void free_rom_list(rom_list_t * list);
+
+// Would a walk have picked this file up?  Fills in out_entry (Path and
+// Member are the caller's to free) if so.  Paths into an archive work too.
+bool scan_file(const char * path, rom_entry_t * out_entry);
+
+// Every ROM in the archive at path, as a walk would list them.  Returns
+// how many; the entries and their strings are the caller's to free.
+size_t scan_archive(const char * path, rom_entry_t ** out_entries);
+
+// The path of the archive a member is in (malloc'd), or NULL if it isn't one.
+char * get_rom_archive(const rom_entry_t * rom);
+
+// Would a walk look inside this file?  Goes by the name alone.
+bool is_archive_path(const char * path);
+
+// Would a walk take a file called this (the last part of a path)?  If
+// out_sniff comes back true, only once its header sniffs as a DS ROM.
+bool is_rom_file_name(const char * name, bool * out_sniff);
+
+// Biggest first, so the long jobs start early and the small ones fill
+// in around them rather than one big ROM finishing the run on its own.
+void schedule_largest_first(rom_list_t * list);
+
+// Spinning disks would rather be read front to back.  The ROMs on any
+// device rotational says yes to trade places in the schedule among
+// themselves so they go in the order they sit on the disk (by where
+// FIEMAP says each starts, or by inode number where it won't say).
+// Everything else keeps its place.  Run it after schedule_largest_first.
+void schedule_disk_order(rom_list_t * list, bool (*rotational)(dev_t));
+
+#endif
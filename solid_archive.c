@@ -0,0 +1,1224 @@
+#define _GNU_SOURCE // qsort_r
+#include <assert.h>
+#include <fcntl.h>
+#include <lzma.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "io_helper.h"
+#include "solid_archive.h"
+
+
+/* A 7z starts with a fixed header pointing at the real one at the end.
+ * That's a tree of properties, each introduced by an id byte, with
+ * numbers in a variable length encoding where the leading ones of the
+ * first byte say how many more bytes follow.  7-Zip usually compresses
+ * the header too (an "encoded header"), which takes decoding a block to
+ * get at.
+ *
+ * Blocks ("folders") are chains of coders.  The ones we read are a
+ * straight line of one-in one-out coders ending in LZMA or LZMA2, which
+ * is a filter chain liblzma can take as it is, or a lone copy.
+ */
+static const uint8_t sevenzip_signature[] = { '7', 'z', 0xBC, 0xAF, 0x27, 0x1C };
+static const uint8_t xz_signature[] = { 0xFD, '7', 'z', 'X', 'Z', 0x00 };
+static const size_t sevenzip_start_size = 32;
+static const uint64_t max_header_size = 64 * 1024 * 1024;
+static const int max_encoded_headers = 4;
+static const size_t max_coders = 64;
+
+static const uint8_t sevenzip_end = 0x00;
+static const uint8_t sevenzip_header = 0x01;
+static const uint8_t sevenzip_archive_properties = 0x02;
+static const uint8_t sevenzip_additional_streams = 0x03;
+static const uint8_t sevenzip_main_streams = 0x04;
+static const uint8_t sevenzip_files = 0x05;
+static const uint8_t sevenzip_pack_info = 0x06;
+static const uint8_t sevenzip_unpack_info = 0x07;
+static const uint8_t sevenzip_substreams = 0x08;
+static const uint8_t sevenzip_size = 0x09;
+static const uint8_t sevenzip_crc = 0x0A;
+static const uint8_t sevenzip_folder = 0x0B;
+static const uint8_t sevenzip_unpack_size = 0x0C;
+static const uint8_t sevenzip_num_unpack_streams = 0x0D;
+static const uint8_t sevenzip_empty_stream = 0x0E;
+static const uint8_t sevenzip_name = 0x11;
+static const uint8_t sevenzip_encoded_header = 0x17;
+
+typedef struct sevenzip_codec_s
+{
+    uint64_t Id;
+    lzma_vli Filter;
+} sevenzip_codec_t;
+static const uint64_t sevenzip_copy = 0x00;
+static const sevenzip_codec_t sevenzip_codecs[] =
+{
+    { 0x030101, LZMA_FILTER_LZMA1 },
+    { 0x21, LZMA_FILTER_LZMA2 },
+    { 0x03, LZMA_FILTER_DELTA },
+    { 0x03030103, LZMA_FILTER_X86 },
+    { 0x03030205, LZMA_FILTER_POWERPC },
+    { 0x03030401, LZMA_FILTER_IA64 },
+    { 0x03030501, LZMA_FILTER_ARM },
+    { 0x03030701, LZMA_FILTER_ARMTHUMB },
+    { 0x03030805, LZMA_FILTER_SPARC },
+};
+
+static const size_t solid_input_size = 256 * 1024;
+static const size_t solid_discard_size = 64 * 1024;
+
+struct solid_block_s
+{
+    uint64_t PackOffset; // In the archive
+    uint64_t PackSize;
+    uint64_t Size; // Once decoded
+    uint32_t Crc;
+    bool HasCrc;
+    bool Readable;
+    bool Xz; // The whole file is one xz stream (or several back to back)
+    size_t NumFilters; // 0 == stored
+    lzma_filter Filters[LZMA_FILTERS_MAX + 1];
+    size_t FirstEntry;
+    size_t NumEntries;
+};
+
+typedef struct sevenzip_cursor_s
+{
+    const uint8_t * Data;
+    size_t Size;
+    size_t Pos;
+    bool Bad; // Ran off the end or into something we don't follow
+} sevenzip_cursor_t;
+typedef struct sevenzip_streams_s
+{
+    size_t NumBlocks;
+    solid_block_t * Blocks;
+    size_t * NumSubstreams; // Per block
+    size_t NumSubstreamsTotal;
+    uint64_t * SubstreamSizes;
+    bool * SubstreamHasCrc;
+    uint32_t * SubstreamCrcs;
+} sevenzip_streams_t;
+typedef struct solid_decoder_s
+{
+    int Fd;
+    const solid_block_t * Block;
+    lzma_stream Stream;
+    bool Live;
+    uint64_t InputPosition; // Into the packed stream
+    uint8_t * Input;
+    io_stats_t * IoStats;
+} solid_decoder_t;
+struct solid_member_s
+{
+    solid_decoder_t * Decoder;
+    uint8_t * Scratch;
+    uint64_t Left;
+    bool Finish; // An xz's only member, with the stream's checks to come after it
+    bool Bad;
+};
+
+
+// Decs
+static bool read_sevenzip(solid_archive_t *, uint64_t);
+static bool read_xz(solid_archive_t *, const char *, uint64_t);
+static bool read_header(sevenzip_cursor_t *, solid_archive_t *, uint64_t);
+static bool read_streams(sevenzip_cursor_t *, sevenzip_streams_t *, uint64_t);
+static bool read_folder(sevenzip_cursor_t *, solid_block_t *, size_t *, size_t *, size_t *);
+static void read_substreams(sevenzip_cursor_t *, sevenzip_streams_t *);
+static bool read_files(sevenzip_cursor_t *, sevenzip_streams_t *, solid_archive_t *);
+static void free_streams(sevenzip_streams_t *);
+static void free_block(solid_block_t *);
+static uint8_t read_byte(sevenzip_cursor_t *);
+static uint64_t read_number(sevenzip_cursor_t *);
+static size_t read_count(sevenzip_cursor_t *, size_t);
+static uint32_t read_u32(sevenzip_cursor_t *);
+static void skip_bytes(sevenzip_cursor_t *, uint64_t);
+static void read_bits(sevenzip_cursor_t *, size_t, bool *);
+static void read_digests(sevenzip_cursor_t *, size_t, bool *, uint32_t *);
+static char * read_name(sevenzip_cursor_t *);
+static bool start_decoder(solid_decoder_t *, int, const solid_block_t *, io_stats_t *);
+static bool decode(solid_decoder_t *, uint8_t *, size_t);
+static bool discard(solid_decoder_t *, uint8_t *, uint64_t);
+static bool finish_decoder(solid_decoder_t *, uint8_t *);
+static void end_decoder(solid_decoder_t *);
+static int compare_names(const void *, const void *, void *);
+static uint32_t get32(const uint8_t *);
+static uint64_t get64(const uint8_t *);
+
+
+// Init / Destroy
+solid_archive_t * open_solid_archive(const char * path)
+{
+    assert(path != NULL);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    solid_archive_t * ret = malloc(sizeof(solid_archive_t));
+    memset(ret, 0, sizeof(solid_archive_t));
+    ret->Fd = fd;
+
+    // Which it is goes by what's in it, not the name.
+    uint8_t signature[sizeof(sevenzip_signature)];
+    bool ok = false;
+    if (pread_fully(fd, signature, sizeof(signature), 0) == sizeof(signature))
+    {
+        if (memcmp(signature, sevenzip_signature, sizeof(signature)) == 0)
+            ok = read_sevenzip(ret, st.st_size);
+        else if (memcmp(signature, xz_signature, sizeof(signature)) == 0)
+            ok = read_xz(ret, path, st.st_size);
+    }
+    if (!ok)
+    {
+        close_solid_archive(ret);
+        return NULL;
+    }
+
+    // Each block's members are in a row.
+    for (size_t i = 0; i < ret->NumEntries; i++)
+    {
+        solid_block_t * block = ret->Blocks + ret->Entries[i].Block;
+        if (block->NumEntries++ == 0)
+            block->FirstEntry = i;
+    }
+
+    ret->ByName = malloc(sizeof(size_t) * (ret->NumEntries + 1));
+    for (size_t i = 0; i < ret->NumEntries; i++)
+    {
+        ret->ByName[i] = i;
+    }
+    qsort_r(ret->ByName, ret->NumEntries, sizeof(size_t), compare_names, ret);
+    return ret;
+}
+void close_solid_archive(solid_archive_t * archive)
+{
+    if (archive == NULL)
+        return;
+
+    for (size_t i = 0; i < archive->NumEntries; i++)
+    {
+        free(archive->Entries[i].Name);
+    }
+    for (size_t i = 0; i < archive->NumBlocks; i++)
+    {
+        free_block(archive->Blocks + i);
+    }
+
+    if (archive->Fd >= 0)
+        close(archive->Fd);
+    free(archive->Entries);
+    free(archive->ByName);
+    free(archive->Blocks);
+    free(archive);
+}
+static bool read_sevenzip(solid_archive_t * archive, uint64_t file_size)
+{
+    // The start header only says where the real one is, and checks itself.
+    uint8_t start[sevenzip_start_size];
+    if (pread_fully(archive->Fd, start, sevenzip_start_size, 0) != sevenzip_start_size || start[6] != 0)
+        return false;
+    if (lzma_crc32(start + 12, 20, 0) != get32(start + 8))
+        return false;
+
+    uint64_t header_offset = get64(start + 12);
+    uint64_t header_size = get64(start + 20);
+    archive->IoStats.CachedBytes += sevenzip_start_size;
+    if (header_size == 0)
+        return true;
+    if (header_size > max_header_size || header_offset > file_size - sevenzip_start_size || file_size - sevenzip_start_size - header_offset < header_size)
+        return false;
+
+    uint8_t * header = malloc(header_size);
+    bool ret = false;
+    if (pread_fully(archive->Fd, header, header_size, sevenzip_start_size + header_offset) != header_size || lzma_crc32(header, header_size, 0) != get32(start + 28))
+    {
+        free(header);
+        return false;
+    }
+    archive->IoStats.CachedBytes += header_size;
+
+    // An encoded header is the streams info for a block holding the real
+    // header.  There's nothing to say that can't nest so give up after a
+    // few goes.
+    for (int tries = 0; tries <= max_encoded_headers; tries++)
+    {
+        sevenzip_cursor_t cursor = { header, header_size, 0, false };
+        uint8_t id = read_byte(&cursor);
+        if (id == sevenzip_header)
+        {
+            ret = read_header(&cursor, archive, file_size);
+            break;
+        }
+        if (id != sevenzip_encoded_header)
+            break;
+
+        sevenzip_streams_t streams;
+        if (!read_streams(&cursor, &streams, file_size))
+            break;
+
+        uint8_t * decoded = NULL;
+        const solid_block_t * block = streams.Blocks;
+        if (streams.NumBlocks > 0 && block->Readable && block->Size > 0 && block->Size <= max_header_size)
+        {
+            solid_decoder_t decoder;
+            decoded = malloc(block->Size);
+            bool ok = start_decoder(&decoder, archive->Fd, block, &archive->IoStats) && decode(&decoder, decoded, block->Size);
+            end_decoder(&decoder);
+            if (!ok || (block->HasCrc && lzma_crc32(decoded, block->Size, 0) != block->Crc))
+            {
+                free(decoded);
+                decoded = NULL;
+            }
+        }
+
+        header_size = (decoded != NULL) ? block->Size : 0;
+        free_streams(&streams);
+        free(header);
+        header = decoded;
+        if (header == NULL)
+            break;
+    }
+
+    free(header);
+    return ret;
+}
+static bool read_xz(solid_archive_t * archive, const char * path, uint64_t file_size)
+{
+    // liblzma works out the size from the index at the end (of every
+    // stream, if there are a few back to back), seeking about as it likes.
+    lzma_stream stream = LZMA_STREAM_INIT;
+    lzma_index * index = NULL;
+    if (lzma_file_info_decoder(&stream, &index, UINT64_MAX, file_size) != LZMA_OK)
+        return false;
+
+    uint8_t * buffer = malloc(solid_input_size);
+    uint64_t position = 0;
+    lzma_ret ret = LZMA_OK;
+    while (ret == LZMA_OK)
+    {
+        if (stream.avail_in == 0)
+        {
+            size_t want = (file_size - position < solid_input_size) ? file_size - position : solid_input_size;
+            size_t got = pread_fully(archive->Fd, buffer, want, position);
+            archive->IoStats.CachedBytes += got;
+            position += got;
+            stream.next_in = buffer;
+            stream.avail_in = got;
+        }
+
+        ret = lzma_code(&stream, LZMA_RUN);
+        if (ret == LZMA_SEEK_NEEDED)
+        {
+            position = stream.seek_pos;
+            stream.avail_in = 0;
+            ret = LZMA_OK;
+        }
+    }
+
+    uint64_t size = (ret == LZMA_STREAM_END) ? lzma_index_uncompressed_size(index) : 0;
+    if (index != NULL)
+        lzma_index_end(index, NULL);
+    lzma_end(&stream);
+    free(buffer);
+    if (ret != LZMA_STREAM_END)
+        return false;
+
+    archive->NumBlocks = 1;
+    archive->Blocks = malloc(sizeof(solid_block_t));
+    memset(archive->Blocks, 0, sizeof(solid_block_t));
+    archive->Blocks->PackSize = file_size;
+    archive->Blocks->Size = size;
+    archive->Blocks->Readable = true;
+    archive->Blocks->Xz = true;
+    archive->Blocks->Filters[0].id = LZMA_VLI_UNKNOWN;
+    if (size == 0)
+        return true;
+
+    // Named after the file, less the .xz.
+    const char * name = strrchr(path, '/');
+    name = (name != NULL) ? name + 1 : path;
+    size_t name_len = strlen(name);
+    if (name_len > 3 && strcasecmp(name + name_len - 3, ".xz") == 0)
+        name_len -= 3;
+
+    archive->NumEntries = 1;
+    archive->Entries = malloc(sizeof(solid_entry_t));
+    memset(archive->Entries, 0, sizeof(solid_entry_t));
+    archive->Entries->Name = strndup(name, name_len);
+    archive->Entries->Size = size;
+    return true;
+}
+
+// Headers
+static bool read_header(sevenzip_cursor_t * cursor, solid_archive_t * archive, uint64_t file_size)
+{
+    // Archive properties and additional streams are never anything we
+    // need, but have to be got past.
+    uint8_t id = read_byte(cursor);
+    if (id == sevenzip_archive_properties)
+    {
+        while (read_byte(cursor) != sevenzip_end && !cursor->Bad)
+        {
+            skip_bytes(cursor, read_number(cursor));
+        }
+        id = read_byte(cursor);
+    }
+    if (id == sevenzip_additional_streams)
+    {
+        sevenzip_streams_t additional;
+        if (!read_streams(cursor, &additional, file_size))
+            return false;
+        free_streams(&additional);
+        id = read_byte(cursor);
+    }
+
+    sevenzip_streams_t streams;
+    memset(&streams, 0, sizeof(streams));
+    if (id == sevenzip_main_streams)
+    {
+        if (!read_streams(cursor, &streams, file_size))
+            return false;
+        id = read_byte(cursor);
+    }
+
+    bool ret = true;
+    if (id == sevenzip_files)
+    {
+        ret = read_files(cursor, &streams, archive);
+        id = read_byte(cursor);
+    }
+
+    // The blocks are the archive's now.
+    archive->NumBlocks = streams.NumBlocks;
+    archive->Blocks = streams.Blocks;
+    streams.NumBlocks = 0;
+    streams.Blocks = NULL;
+    free_streams(&streams);
+    return ret && id == sevenzip_end && !cursor->Bad;
+}
+static bool read_streams(sevenzip_cursor_t * cursor, sevenzip_streams_t * out_streams, uint64_t file_size)
+{
+    // Pack info says where the packed streams are, unpack info what blocks
+    // they make up, and substreams how each block divides into files.
+    memset(out_streams, 0, sizeof(*out_streams));
+    uint64_t pack_position = 0;
+    size_t num_packs = 0;
+    uint64_t * pack_sizes = NULL;
+    uint8_t id = read_byte(cursor);
+    if (id == sevenzip_pack_info)
+    {
+        pack_position = read_number(cursor);
+        num_packs = read_count(cursor, cursor->Size);
+        pack_sizes = calloc(num_packs + 1, sizeof(uint64_t));
+        while ((id = read_byte(cursor)) != sevenzip_end && !cursor->Bad)
+        {
+            if (id == sevenzip_size)
+            {
+                for (size_t i = 0; i < num_packs; i++)
+                {
+                    pack_sizes[i] = read_number(cursor);
+                }
+            }
+            else if (id == sevenzip_crc)
+            {
+                bool * has_crc = malloc(sizeof(bool) * (num_packs + 1));
+                uint32_t * crcs = malloc(sizeof(uint32_t) * (num_packs + 1));
+                read_digests(cursor, num_packs, has_crc, crcs);
+                free(has_crc);
+                free(crcs);
+            }
+            else
+                cursor->Bad = true;
+        }
+        id = read_byte(cursor);
+    }
+
+    size_t * packs_used = NULL;
+    if (id == sevenzip_unpack_info)
+    {
+        if (read_byte(cursor) != sevenzip_folder)
+            cursor->Bad = true;
+
+        size_t num_blocks = read_count(cursor, cursor->Size);
+        if (read_byte(cursor) != 0)
+            cursor->Bad = true; // Blocks kept in another stream; nobody does that
+
+        size_t * num_outs = calloc(num_blocks + 1, sizeof(size_t));
+        size_t * main_outs = calloc(num_blocks + 1, sizeof(size_t));
+        packs_used = calloc(num_blocks + 1, sizeof(size_t));
+        out_streams->Blocks = calloc(num_blocks + 1, sizeof(solid_block_t));
+        for (size_t i = 0; i < num_blocks && !cursor->Bad; i++)
+        {
+            out_streams->NumBlocks++;
+            if (!read_folder(cursor, out_streams->Blocks + i, num_outs + i, main_outs + i, packs_used + i))
+                cursor->Bad = true;
+        }
+
+        // A size for every coder's output; the block's is the one nothing
+        // else takes in.
+        if (read_byte(cursor) != sevenzip_unpack_size)
+            cursor->Bad = true;
+        for (size_t i = 0; i < out_streams->NumBlocks && !cursor->Bad; i++)
+        {
+            for (size_t out = 0; out < num_outs[i]; out++)
+            {
+                uint64_t size = read_number(cursor);
+                if (out == main_outs[i])
+                    out_streams->Blocks[i].Size = size;
+            }
+        }
+
+        id = read_byte(cursor);
+        if (id == sevenzip_crc)
+        {
+            bool * has_crc = malloc(sizeof(bool) * (out_streams->NumBlocks + 1));
+            uint32_t * crcs = malloc(sizeof(uint32_t) * (out_streams->NumBlocks + 1));
+            read_digests(cursor, out_streams->NumBlocks, has_crc, crcs);
+            for (size_t i = 0; i < out_streams->NumBlocks; i++)
+            {
+                out_streams->Blocks[i].HasCrc = has_crc[i];
+                out_streams->Blocks[i].Crc = crcs[i];
+            }
+            free(has_crc);
+            free(crcs);
+            id = read_byte(cursor);
+        }
+        if (id != sevenzip_end)
+            cursor->Bad = true;
+
+        free(num_outs);
+        free(main_outs);
+        id = read_byte(cursor);
+    }
+
+    // Blocks take the packed streams in order.  Only blocks with just the
+    // one can be read, and only if it's actually in the file.
+    uint64_t offset = sevenzip_start_size + pack_position;
+    for (size_t i = 0, pack = 0; i < out_streams->NumBlocks && !cursor->Bad; i++)
+    {
+        solid_block_t * block = out_streams->Blocks + i;
+        if (packs_used[i] > num_packs - pack)
+        {
+            cursor->Bad = true;
+            break;
+        }
+
+        block->PackOffset = offset;
+        block->PackSize = (packs_used[i] > 0) ? pack_sizes[pack] : 0;
+        for (size_t used = 0; used < packs_used[i]; used++)
+        {
+            offset += pack_sizes[pack++];
+        }
+        if (block->PackOffset > file_size || file_size - block->PackOffset < block->PackSize)
+            block->Readable = false;
+    }
+    free(pack_sizes);
+    free(packs_used);
+
+    if (id == sevenzip_substreams)
+    {
+        read_substreams(cursor, out_streams);
+        id = read_byte(cursor);
+    }
+    else
+    {
+        // One file per block.
+        out_streams->NumSubstreams = malloc(sizeof(size_t) * (out_streams->NumBlocks + 1));
+        out_streams->SubstreamSizes = malloc(sizeof(uint64_t) * (out_streams->NumBlocks + 1));
+        out_streams->SubstreamHasCrc = malloc(sizeof(bool) * (out_streams->NumBlocks + 1));
+        out_streams->SubstreamCrcs = malloc(sizeof(uint32_t) * (out_streams->NumBlocks + 1));
+        out_streams->NumSubstreamsTotal = out_streams->NumBlocks;
+        for (size_t i = 0; i < out_streams->NumBlocks; i++)
+        {
+            out_streams->NumSubstreams[i] = 1;
+            out_streams->SubstreamSizes[i] = out_streams->Blocks[i].Size;
+            out_streams->SubstreamHasCrc[i] = out_streams->Blocks[i].HasCrc;
+            out_streams->SubstreamCrcs[i] = out_streams->Blocks[i].Crc;
+        }
+    }
+
+    if (id != sevenzip_end || cursor->Bad)
+    {
+        free_streams(out_streams);
+        return false;
+    }
+
+    return true;
+}
+static bool read_folder(sevenzip_cursor_t * cursor, solid_block_t * block, size_t * out_num_outs, size_t * out_main_out, size_t * out_num_packed)
+{
+    // Every coder gets parsed so the cursor ends up in the right place,
+    // but only a straight chain of simple coders is readable: coder 0
+    // makes the block's output, and each takes its input from the next.
+    // That's a filter chain in the order liblzma wants it.
+    size_t num_coders = read_count(cursor, max_coders);
+    size_t total_in = 0, total_out = 0;
+    bool simple = (num_coders > 0), known = true, copy = false;
+    for (size_t i = 0; i < num_coders && !cursor->Bad; i++)
+    {
+        uint8_t flags = read_byte(cursor);
+        if (flags & 0x80)
+            return false;
+
+        uint64_t id = 0;
+        for (size_t j = 0; j < (flags & 0x0F); j++)
+        {
+            id = (id << 8) | read_byte(cursor);
+        }
+
+        size_t num_in = 1, num_out = 1;
+        if (flags & 0x10)
+        {
+            num_in = read_count(cursor, max_coders);
+            num_out = read_count(cursor, max_coders);
+            simple &= (num_in == 1 && num_out == 1);
+        }
+
+        const uint8_t * properties = NULL;
+        size_t properties_size = 0;
+        if (flags & 0x20)
+        {
+            properties_size = read_count(cursor, cursor->Size - cursor->Pos);
+            properties = cursor->Data + cursor->Pos;
+            skip_bytes(cursor, properties_size);
+        }
+
+        total_in += num_in;
+        total_out += num_out;
+
+        // A lone copy is a stored block; anything else has to be a filter
+        // liblzma knows, with properties it's happy with.
+        copy = (num_coders == 1 && id == sevenzip_copy);
+        lzma_filter * filter = block->Filters + block->NumFilters;
+        filter->id = LZMA_VLI_UNKNOWN;
+        filter->options = NULL;
+        for (size_t c = 0; c < sizeof(sevenzip_codecs) / sizeof(sevenzip_codecs[0]) && known && i < LZMA_FILTERS_MAX; c++)
+        {
+            if (sevenzip_codecs[c].Id == id)
+                filter->id = sevenzip_codecs[c].Filter;
+        }
+        if (filter->id != LZMA_VLI_UNKNOWN && lzma_properties_decode(filter, NULL, properties, properties_size) == LZMA_OK)
+            block->NumFilters++;
+        else
+            known = copy;
+    }
+    block->Filters[block->NumFilters].id = LZMA_VLI_UNKNOWN;
+    if (cursor->Bad || total_out == 0 || total_in + 1 < total_out)
+        return false;
+
+    // Bind pairs join one coder's input to another's output.  The block's
+    // output is the one left over.
+    bool linear = true;
+    bool * bound = calloc(total_out + 1, sizeof(bool));
+    for (size_t i = 0; i + 1 < total_out; i++)
+    {
+        uint64_t in = read_number(cursor);
+        uint64_t out = read_number(cursor);
+        if (out < total_out)
+            bound[out] = true;
+        linear &= (out == in + 1);
+    }
+
+    *out_num_outs = total_out;
+    *out_main_out = 0;
+    while (*out_main_out + 1 < total_out && bound[*out_main_out])
+    {
+        (*out_main_out)++;
+    }
+    free(bound);
+
+    *out_num_packed = total_in + 1 - total_out;
+    if (*out_num_packed > 1)
+    {
+        for (size_t i = 0; i < *out_num_packed; i++)
+        {
+            read_number(cursor);
+        }
+    }
+
+    block->Readable = simple && known && linear && *out_main_out == 0 && *out_num_packed == 1;
+    return !cursor->Bad;
+}
+static void read_substreams(sevenzip_cursor_t * cursor, sevenzip_streams_t * streams)
+{
+    // How many files each block holds (one unless it says), all of their
+    // sizes but the last, which is whatever the block has left, and the
+    // CRCs nobody knows yet.  A block holding one file with a CRC of its
+    // own already knows that one's.
+    size_t num_blocks = streams->NumBlocks;
+    streams->NumSubstreams = malloc(sizeof(size_t) * (num_blocks + 1));
+    for (size_t i = 0; i < num_blocks; i++)
+    {
+        streams->NumSubstreams[i] = 1;
+    }
+
+    uint8_t id = read_byte(cursor);
+    if (id == sevenzip_num_unpack_streams)
+    {
+        for (size_t i = 0; i < num_blocks; i++)
+        {
+            streams->NumSubstreams[i] = read_count(cursor, cursor->Size);
+        }
+        id = read_byte(cursor);
+    }
+
+    size_t total = 0;
+    for (size_t i = 0; i < num_blocks; i++)
+    {
+        total += streams->NumSubstreams[i];
+    }
+    if (cursor->Bad || total > cursor->Size)
+    {
+        cursor->Bad = true;
+        return;
+    }
+
+    streams->NumSubstreamsTotal = total;
+    streams->SubstreamSizes = malloc(sizeof(uint64_t) * (total + 1));
+    streams->SubstreamHasCrc = calloc(total + 1, sizeof(bool));
+    streams->SubstreamCrcs = calloc(total + 1, sizeof(uint32_t));
+    for (size_t i = 0, next = 0; i < num_blocks; i++)
+    {
+        uint64_t left = streams->Blocks[i].Size;
+        for (size_t j = 0; j + 1 < streams->NumSubstreams[i]; j++)
+        {
+            uint64_t size = (id == sevenzip_size) ? read_number(cursor) : 0;
+            cursor->Bad |= (size > left || id != sevenzip_size);
+            streams->SubstreamSizes[next++] = size;
+            left -= (size <= left) ? size : left;
+        }
+        if (streams->NumSubstreams[i] > 0)
+            streams->SubstreamSizes[next++] = left;
+    }
+    if (id == sevenzip_size)
+        id = read_byte(cursor);
+
+    size_t unknown = 0;
+    for (size_t i = 0; i < num_blocks; i++)
+    {
+        if (streams->NumSubstreams[i] != 1 || !streams->Blocks[i].HasCrc)
+            unknown += streams->NumSubstreams[i];
+    }
+
+    bool * has_crc = calloc(unknown + 1, sizeof(bool));
+    uint32_t * crcs = calloc(unknown + 1, sizeof(uint32_t));
+    if (id == sevenzip_crc)
+    {
+        read_digests(cursor, unknown, has_crc, crcs);
+        id = read_byte(cursor);
+    }
+    for (size_t i = 0, next = 0, next_unknown = 0; i < num_blocks; i++)
+    {
+        if (streams->NumSubstreams[i] == 1 && streams->Blocks[i].HasCrc)
+        {
+            streams->SubstreamHasCrc[next] = true;
+            streams->SubstreamCrcs[next++] = streams->Blocks[i].Crc;
+            continue;
+        }
+
+        for (size_t j = 0; j < streams->NumSubstreams[i]; j++, next++, next_unknown++)
+        {
+            streams->SubstreamHasCrc[next] = has_crc[next_unknown];
+            streams->SubstreamCrcs[next] = crcs[next_unknown];
+        }
+    }
+    free(has_crc);
+    free(crcs);
+
+    if (id != sevenzip_end)
+        cursor->Bad = true;
+}
+static bool read_files(sevenzip_cursor_t * cursor, sevenzip_streams_t * streams, solid_archive_t * archive)
+{
+    // Each property says how long it is, so the ones we don't care about
+    // (times, attributes, ...) are just skipped.  Files without a stream
+    // are directories or empty, and only files with one use up a
+    // substream.
+    size_t num_files = read_count(cursor, cursor->Size);
+    bool * empty = calloc(num_files + 1, sizeof(bool));
+    char ** names = calloc(num_files + 1, sizeof(char *));
+    while (!cursor->Bad)
+    {
+        uint8_t type = read_byte(cursor);
+        if (type == sevenzip_end)
+            break;
+
+        uint64_t size = read_number(cursor);
+        if (size > cursor->Size - cursor->Pos)
+        {
+            cursor->Bad = true;
+            break;
+        }
+
+        sevenzip_cursor_t property = { cursor->Data + cursor->Pos, size, 0, false };
+        cursor->Pos += size;
+        if (type == sevenzip_empty_stream)
+            read_bits(&property, num_files, empty);
+        else if (type == sevenzip_name)
+        {
+            if (read_byte(&property) != 0)
+                property.Bad = true;
+            for (size_t i = 0; i < num_files && !property.Bad; i++)
+            {
+                names[i] = read_name(&property);
+            }
+        }
+
+        cursor->Bad |= property.Bad;
+    }
+
+    archive->Entries = malloc(sizeof(solid_entry_t) * (num_files + 1));
+    size_t block = 0, in_block = 0, substream = 0;
+    uint64_t offset = 0;
+    for (size_t i = 0; i < num_files && !cursor->Bad; i++)
+    {
+        if (empty[i])
+            continue;
+
+        while (block < streams->NumBlocks && in_block >= streams->NumSubstreams[block])
+        {
+            block++;
+            in_block = 0;
+            offset = 0;
+        }
+        if (block == streams->NumBlocks)
+        {
+            cursor->Bad = true;
+            break;
+        }
+
+        solid_entry_t * entry = archive->Entries + archive->NumEntries;
+        entry->Size = streams->SubstreamSizes[substream];
+        entry->HasCrc = streams->SubstreamHasCrc[substream];
+        entry->Crc = streams->SubstreamCrcs[substream];
+        entry->Block = block;
+        entry->Offset = offset;
+        offset += entry->Size;
+        in_block++;
+        substream++;
+        if (entry->Size == 0)
+            continue;
+
+        entry->Name = (names[i] != NULL) ? names[i] : strdup("");
+        names[i] = NULL;
+        archive->NumEntries++;
+    }
+
+    for (size_t i = 0; i < num_files; i++)
+    {
+        free(names[i]);
+    }
+    free(names);
+    free(empty);
+    return !cursor->Bad;
+}
+static void free_streams(sevenzip_streams_t * streams)
+{
+    for (size_t i = 0; i < streams->NumBlocks; i++)
+    {
+        free_block(streams->Blocks + i);
+    }
+
+    free(streams->Blocks);
+    free(streams->NumSubstreams);
+    free(streams->SubstreamSizes);
+    free(streams->SubstreamHasCrc);
+    free(streams->SubstreamCrcs);
+    memset(streams, 0, sizeof(*streams));
+}
+static void free_block(solid_block_t * block)
+{
+    for (size_t i = 0; i < block->NumFilters; i++)
+    {
+        free(block->Filters[i].options);
+    }
+
+    block->NumFilters = 0;
+}
+
+// Fields
+static uint8_t read_byte(sevenzip_cursor_t * cursor)
+{
+    if (cursor->Pos >= cursor->Size)
+    {
+        cursor->Bad = true;
+        return 0;
+    }
+
+    return cursor->Data[cursor->Pos++];
+}
+static uint64_t read_number(sevenzip_cursor_t * cursor)
+{
+    // Each leading one in the first byte means another byte follows (low
+    // byte first); what's left of the first byte goes on top.
+    uint8_t first = read_byte(cursor);
+    uint64_t ret = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        uint8_t mask = 0x80 >> i;
+        if (!(first & mask))
+            return ret | ((uint64_t)(first & (mask - 1)) << (8 * i));
+
+        ret |= (uint64_t)read_byte(cursor) << (8 * i);
+    }
+
+    return ret;
+}
+static size_t read_count(sevenzip_cursor_t * cursor, size_t limit)
+{
+    // Counts get sized arrays, so anything the header couldn't possibly
+    // hold is a bad header.
+    uint64_t ret = read_number(cursor);
+    if (ret > limit)
+    {
+        cursor->Bad = true;
+        return 0;
+    }
+
+    return ret;
+}
+static uint32_t read_u32(sevenzip_cursor_t * cursor)
+{
+    if (cursor->Size - cursor->Pos < 4 || cursor->Pos > cursor->Size)
+    {
+        cursor->Bad = true;
+        return 0;
+    }
+
+    cursor->Pos += 4;
+    return get32(cursor->Data + cursor->Pos - 4);
+}
+static void skip_bytes(sevenzip_cursor_t * cursor, uint64_t count)
+{
+    if (count > cursor->Size - cursor->Pos)
+        cursor->Bad = true;
+    else
+        cursor->Pos += count;
+}
+static void read_bits(sevenzip_cursor_t * cursor, size_t count, bool * out_bits)
+{
+    // Most significant bit first.
+    uint8_t byte = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (i % 8 == 0)
+            byte = read_byte(cursor);
+        out_bits[i] = (byte & (0x80 >> (i % 8))) != 0;
+    }
+}
+static void read_digests(sevenzip_cursor_t * cursor, size_t count, bool * out_defined, uint32_t * out_crcs)
+{
+    if (read_byte(cursor) != 0)
+        memset(out_defined, 1, sizeof(bool) * count);
+    else
+        read_bits(cursor, count, out_defined);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        out_crcs[i] = out_defined[i] ? read_u32(cursor) : 0;
+    }
+}
+static char * read_name(sevenzip_cursor_t * cursor)
+{
+    // UTF-16LE up to a NUL, out as UTF-8.  Stray surrogates come out as
+    // U+FFFD.
+    size_t units = 0;
+    for (;;)
+    {
+        if (cursor->Size - cursor->Pos < 2 * (units + 1))
+        {
+            cursor->Bad = true;
+            return NULL;
+        }
+
+        const uint8_t * unit = cursor->Data + cursor->Pos + 2 * units;
+        if (unit[0] == 0 && unit[1] == 0)
+            break;
+        units++;
+    }
+
+    const uint8_t * in = cursor->Data + cursor->Pos;
+    char * ret = malloc(units * 3 + 1);
+    size_t len = 0;
+    for (size_t i = 0; i < units; i++)
+    {
+        uint32_t c = in[2 * i] | (in[2 * i + 1] << 8);
+        if (c >= 0xD800 && c < 0xDC00 && i + 1 < units)
+        {
+            uint32_t low = in[2 * i + 2] | (in[2 * i + 3] << 8);
+            if (low >= 0xDC00 && low < 0xE000)
+            {
+                c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                i++;
+            }
+        }
+        if (c >= 0xD800 && c < 0xE000)
+            c = 0xFFFD;
+
+        if (c < 0x80)
+            ret[len++] = c;
+        else if (c < 0x800)
+        {
+            ret[len++] = 0xC0 | (c >> 6);
+            ret[len++] = 0x80 | (c & 0x3F);
+        }
+        else if (c < 0x10000)
+        {
+            ret[len++] = 0xE0 | (c >> 12);
+            ret[len++] = 0x80 | ((c >> 6) & 0x3F);
+            ret[len++] = 0x80 | (c & 0x3F);
+        }
+        else
+        {
+            ret[len++] = 0xF0 | (c >> 18);
+            ret[len++] = 0x80 | ((c >> 12) & 0x3F);
+            ret[len++] = 0x80 | ((c >> 6) & 0x3F);
+            ret[len++] = 0x80 | (c & 0x3F);
+        }
+    }
+    ret[len] = '\0';
+
+    cursor->Pos += 2 * (units + 1);
+    return ret;
+}
+
+// Procs
+const solid_entry_t * find_solid_entry(const solid_archive_t * archive, const char * name)
+{
+    assert(archive != NULL);
+    assert(name != NULL);
+
+    size_t low = 0, high = archive->NumEntries;
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        const solid_entry_t * entry = archive->Entries + archive->ByName[mid];
+        int cmp = strcmp(entry->Name, name);
+        if (cmp == 0)
+            return entry;
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return NULL;
+}
+bool can_read_solid_entry(const solid_archive_t * archive, const solid_entry_t * entry)
+{
+    assert(archive != NULL);
+    assert(entry != NULL);
+
+    return archive->Blocks[entry->Block].Readable;
+}
+bool unpack_solid_block(solid_archive_t * archive, size_t block_index, const bool * wanted, solid_unpacked_t unpacked, void * context)
+{
+    assert(archive != NULL);
+    assert(block_index < archive->NumBlocks);
+    assert(unpacked != NULL);
+
+    // Nothing past the last member anyone wants gets decoded.
+    const solid_block_t * block = archive->Blocks + block_index;
+    size_t end = block->FirstEntry;
+    for (size_t i = block->FirstEntry; i < block->FirstEntry + block->NumEntries; i++)
+    {
+        if (wanted == NULL || wanted[i])
+            end = i + 1;
+    }
+    if (end == block->FirstEntry)
+        return true;
+    if (!block->Readable)
+        return false;
+
+    solid_decoder_t decoder;
+    uint8_t * scratch = malloc(solid_discard_size);
+    bool ret = start_decoder(&decoder, archive->Fd, block, &archive->IoStats);
+    uint64_t position = 0;
+    for (size_t i = block->FirstEntry; i < end && ret; i++)
+    {
+        const solid_entry_t * entry = archive->Entries + i;
+        ret = (entry->Offset >= position) && discard(&decoder, scratch, entry->Offset - position);
+        position = entry->Offset + entry->Size;
+        if (!ret || !(wanted == NULL || wanted[i]))
+        {
+            ret = ret && discard(&decoder, scratch, entry->Size);
+            continue;
+        }
+
+        // Whatever of it went unread still has to be got past, and an xz
+        // only says whether it was any good at the very end.
+        solid_member_t member = { &decoder, scratch, entry->Size, block->Xz && i + 1 == block->FirstEntry + block->NumEntries, false };
+        unpacked(entry, i, &member, context);
+        ret = !member.Bad && discard(&decoder, scratch, member.Left);
+        if (ret && member.Left > 0 && member.Finish)
+            ret = finish_decoder(&decoder, scratch);
+    }
+
+    end_decoder(&decoder);
+    free(scratch);
+    return ret;
+}
+size_t read_solid_member(solid_member_t * member, void * buf, size_t buflen)
+{
+    assert(member != NULL);
+    assert(buf != NULL || buflen == 0);
+
+    if (buflen > member->Left)
+        buflen = member->Left;
+    if (member->Bad || buflen == 0)
+        return 0;
+
+    member->Bad = !decode(member->Decoder, buf, buflen);
+    member->Left -= member->Bad ? 0 : buflen;
+    if (!member->Bad && member->Left == 0 && member->Finish)
+        member->Bad = !finish_decoder(member->Decoder, member->Scratch);
+    return member->Bad ? 0 : buflen;
+}
+
+// Decoding
+static bool start_decoder(solid_decoder_t * decoder, int fd, const solid_block_t * block, io_stats_t * io_stats)
+{
+    memset(decoder, 0, sizeof(*decoder));
+    decoder->Fd = fd;
+    decoder->Block = block;
+    decoder->IoStats = io_stats;
+    if (!block->Xz && block->NumFilters == 0)
+        return true;
+
+    lzma_stream init = LZMA_STREAM_INIT;
+    decoder->Stream = init;
+    lzma_ret ret;
+    if (block->Xz)
+        ret = lzma_stream_decoder(&decoder->Stream, UINT64_MAX, LZMA_CONCATENATED);
+    else
+        ret = lzma_raw_decoder(&decoder->Stream, block->Filters);
+    decoder->Live = (ret == LZMA_OK);
+    decoder->Input = malloc(solid_input_size);
+    return decoder->Live;
+}
+static bool decode(solid_decoder_t * decoder, uint8_t * out, size_t outlen)
+{
+    // Exactly outlen more bytes of the block, or false.
+    const solid_block_t * block = decoder->Block;
+    if (!decoder->Live)
+    {
+        if (block->PackSize - decoder->InputPosition < outlen)
+            return false;
+
+        size_t got = pread_fully(decoder->Fd, out, outlen, block->PackOffset + decoder->InputPosition);
+        decoder->IoStats->CachedBytes += got;
+        decoder->InputPosition += got;
+        return got == outlen;
+    }
+
+    lzma_stream * stream = &decoder->Stream;
+    while (outlen > 0)
+    {
+        if (stream->avail_in == 0 && decoder->InputPosition < block->PackSize)
+        {
+            uint64_t left = block->PackSize - decoder->InputPosition;
+            size_t want = (left < solid_input_size) ? left : solid_input_size;
+            size_t got = pread_fully(decoder->Fd, decoder->Input, want, block->PackOffset + decoder->InputPosition);
+            decoder->IoStats->CachedBytes += got;
+            decoder->InputPosition += (got == want) ? got : left;
+            stream->next_in = decoder->Input;
+            stream->avail_in = got;
+        }
+
+        // LZMA (as opposed to LZMA2) in a 7z doesn't always say where it
+        // ends; it just stops being asked.
+        lzma_action action = (stream->avail_in == 0 && decoder->InputPosition == block->PackSize) ? LZMA_FINISH : LZMA_RUN;
+        stream->next_out = out;
+        stream->avail_out = outlen;
+        lzma_ret ret = lzma_code(stream, action);
+        size_t made = stream->next_out - out;
+        out += made;
+        outlen -= made;
+        if (ret == LZMA_STREAM_END)
+            return outlen == 0;
+        if (ret != LZMA_OK || (made == 0 && action == LZMA_FINISH))
+            return false;
+    }
+
+    return true;
+}
+static bool discard(solid_decoder_t * decoder, uint8_t * scratch, uint64_t length)
+{
+    while (length > 0)
+    {
+        size_t step = (length < solid_discard_size) ? length : solid_discard_size;
+        if (!decode(decoder, scratch, step))
+            return false;
+        length -= step;
+    }
+
+    return true;
+}
+static bool finish_decoder(solid_decoder_t * decoder, uint8_t * scratch)
+{
+    // Run what's left of the input through so its checks get made; not a
+    // byte more should come out.
+    lzma_stream * stream = &decoder->Stream;
+    const solid_block_t * block = decoder->Block;
+    for (;;)
+    {
+        if (stream->avail_in == 0 && decoder->InputPosition < block->PackSize)
+        {
+            uint64_t left = block->PackSize - decoder->InputPosition;
+            size_t want = (left < solid_input_size) ? left : solid_input_size;
+            size_t got = pread_fully(decoder->Fd, decoder->Input, want, block->PackOffset + decoder->InputPosition);
+            decoder->IoStats->CachedBytes += got;
+            decoder->InputPosition += (got == want) ? got : left;
+            stream->next_in = decoder->Input;
+            stream->avail_in = got;
+        }
+
+        lzma_action action = (stream->avail_in == 0 && decoder->InputPosition == block->PackSize) ? LZMA_FINISH : LZMA_RUN;
+        stream->next_out = scratch;
+        stream->avail_out = solid_discard_size;
+        lzma_ret ret = lzma_code(stream, action);
+        if (stream->avail_out != solid_discard_size)
+            return false;
+        if (ret == LZMA_STREAM_END)
+            return true;
+        if (ret != LZMA_OK)
+            return false;
+    }
+}
+static void end_decoder(solid_decoder_t * decoder)
+{
+    if (decoder->Live)
+        lzma_end(&decoder->Stream);
+    free(decoder->Input);
+    decoder->Live = false;
+    decoder->Input = NULL;
+}
+
+// Bookkeeping
+static int compare_names(const void * a, const void * b, void * arg)
+{
+    const solid_archive_t * archive = arg;
+    return strcmp(archive->Entries[*(const size_t *)a].Name, archive->Entries[*(const size_t *)b].Name);
+}
+static uint32_t get32(const uint8_t * p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+static uint64_t get64(const uint8_t * p)
+{
+    return (uint64_t)get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
@@ -0,0 +1,64 @@
+/* Solid archives: 7z (LZMA, LZMA2 and the filters that go in front of
+ * them) and standalone .xz.  A solid block only comes apart front to
+ * back, so members aren't read one at a time; a block is decoded once,
+ * start to finish, and every member wanted from it is handed over in
+ * turn to be read as it's decoded.  Nothing is ever written to disk and
+ * no member is ever held whole.
+ *
+ * An .xz is an archive of one member named after it, minus the .xz.
+ * Directories and empty files aren't listed.  Blocks that need anything
+ * else (BCJ2, AES, PPMd, ...) are listed but can't be read.
+ */
+
+#ifndef _SOLID_ARCHIVE_H
+#define _SOLID_ARCHIVE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "io_helper.h"
+
+
+typedef struct solid_entry_s
+{
+    char * Name;
+    uint64_t Size;
+    uint32_t Crc;
+    bool HasCrc; // xz checks its own
+    size_t Block;
+    uint64_t Offset; // Into the block's output
+} solid_entry_t;
+typedef struct solid_block_s solid_block_t;
+typedef struct solid_archive_s
+{
+    int Fd;
+    size_t NumEntries;
+    solid_entry_t * Entries; // Archive order, which is block order
+    size_t * ByName; // Indexes into Entries, sorted by name
+    size_t NumBlocks;
+    solid_block_t * Blocks;
+    io_stats_t IoStats;
+} solid_archive_t;
+
+// Gets each wanted member to read front to back with read_solid_member,
+// as much of it as it likes; the rest is decoded past once it returns.
+typedef struct solid_member_s solid_member_t;
+typedef void (*solid_unpacked_t)(const solid_entry_t * entry, size_t index, solid_member_t * member, void * context);
+
+// Procs
+// NULL if it isn't a 7z or xz we can make sense of.
+solid_archive_t * open_solid_archive(const char * path);
+void close_solid_archive(solid_archive_t * archive);
+const solid_entry_t * find_solid_entry(const solid_archive_t * archive, const char * name);
+bool can_read_solid_entry(const solid_archive_t * archive, const solid_entry_t * entry);
+
+// Decodes the block once, as far as the last member wanted (by entry
+// index; NULL for all of them), calling unpacked for each wanted member
+// in order.  False if the block turned out to be bad part way.
+bool unpack_solid_block(solid_archive_t * archive, size_t block, const bool * wanted, solid_unpacked_t unpacked, void * context);
+// The next buflen bytes of the member, or what's left of it.  Anything
+// less means the block went bad; an xz only finds out at its very end, so
+// its last bytes come back short if its check fails.
+size_t read_solid_member(solid_member_t * member, void * buf, size_t buflen);
+
+#endif
@@ -0,0 +1,619 @@
+#define _GNU_SOURCE // pipe2
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <lzma.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "io_helper.h"
+#include "tar_stream.h"
+#include "libraries/asprintf.h"
+
+extern char ** environ;
+
+
+/* A tar is a run of 512 byte blocks: a header, then the member's data
+ * padded out to a whole block, then the next header.  Two blocks of zeros
+ * mark the end (one is plenty for us).  Numbers are octal text, or for
+ * big ones (GNU) binary with the top bit of the first byte set.
+ *
+ * Some headers describe the member after them: GNU 'L' carries a name
+ * too long for the header, pax 'x' carries key=value records that
+ * override the next header's path and size.
+ */
+static const size_t tar_block_size = 512;
+static const size_t tar_name_offset = 0;
+static const size_t tar_name_size = 100;
+static const size_t tar_size_offset = 124;
+static const size_t tar_size_size = 12;
+static const size_t tar_checksum_offset = 148;
+static const size_t tar_checksum_size = 8;
+static const size_t tar_type_offset = 156;
+static const size_t tar_magic_offset = 257;
+static const size_t tar_prefix_offset = 345;
+static const size_t tar_prefix_size = 155;
+static const uint64_t max_extended_size = 1024 * 1024; // Long names and pax records; anything bigger is nonsense
+
+static const size_t stream_buffer_size = 1024 * 1024;
+
+typedef enum tar_filter_e
+{
+    TAR_PLAIN = 0,
+    TAR_GZIP,
+    TAR_XZ,
+    TAR_ZSTD, // Through a zstd process; Fd is the pipe from it
+} tar_filter_t;
+struct tar_stream_s
+{
+    int Fd;
+    tar_filter_t Filter;
+    pid_t Child;
+    uint64_t ArchiveSize;
+    z_stream Gzip;
+    lzma_stream Xz;
+    uint8_t * Input; // Compressed bytes not yet decoded
+    size_t InputLength;
+    size_t InputPosition;
+    bool InputEnded;
+    bool Ended; // Nothing more will come out
+    bool Finished; // Past the end of the archive
+    bool Failed;
+    uint8_t * Scratch; // Where skipped bytes go
+    char * Name;
+    uint64_t Left; // Of the current member
+    uint64_t Padding; // After it
+    io_stats_t IoStats;
+};
+
+
+// Decs
+static tar_filter_t get_tar_filter(const char *);
+static bool start_zstd(tar_stream_t *);
+static size_t read_stream(tar_stream_t *, void *, size_t);
+static bool fill_input(tar_stream_t *);
+static size_t decode_gzip(tar_stream_t *, uint8_t *, size_t);
+static size_t decode_xz(tar_stream_t *, uint8_t *, size_t);
+static bool skip_stream(tar_stream_t *, uint64_t);
+static void finish_stream(tar_stream_t *);
+static char * read_extended(tar_stream_t *, uint64_t);
+static void read_pax(const char *, uint64_t, char **, uint64_t *, bool *);
+static bool check_header(const uint8_t *);
+static bool parse_number(const uint8_t *, size_t, uint64_t *);
+static char * get_header_name(const uint8_t *);
+static bool is_zero_block(const uint8_t *);
+static bool has_suffix(const char *, const char *);
+
+
+// Init / Destroy
+tar_stream_t * open_tar_stream(const char * path)
+{
+    assert(path != NULL);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    // Front to back, once; the kernel may as well read well ahead.
+    struct stat st;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    tar_stream_t * ret = malloc(sizeof(tar_stream_t));
+    memset(ret, 0, sizeof(*ret));
+    ret->Fd = fd;
+    ret->Child = -1;
+    ret->ArchiveSize = (fstat(fd, &st) == 0) ? st.st_size : 0;
+    ret->Filter = get_tar_filter(path);
+    ret->Scratch = malloc(stream_buffer_size);
+
+    bool started = true;
+    if (ret->Filter == TAR_GZIP)
+    {
+        // 32 has zlib take the gzip wrapper (or a bare zlib one).
+        started = inflateInit2(&ret->Gzip, MAX_WBITS + 32) == Z_OK;
+    }
+    else if (ret->Filter == TAR_XZ)
+    {
+        lzma_stream init = LZMA_STREAM_INIT;
+        ret->Xz = init;
+        started = lzma_stream_decoder(&ret->Xz, UINT64_MAX, LZMA_CONCATENATED) == LZMA_OK;
+    }
+    else if (ret->Filter == TAR_ZSTD)
+    {
+        started = start_zstd(ret);
+        if (!started)
+            fprintf(stderr, "Can't read %s: couldn't run zstd to decompress it\n", path);
+    }
+    if (ret->Filter == TAR_GZIP || ret->Filter == TAR_XZ)
+        ret->Input = malloc(stream_buffer_size);
+
+    if (!started)
+    {
+        ret->Filter = TAR_PLAIN;
+        close_tar_stream(ret);
+        return NULL;
+    }
+
+    return ret;
+}
+void close_tar_stream(tar_stream_t * stream)
+{
+    if (stream == NULL)
+        return;
+
+    // A zstd we walked out on gets SIGPIPE (or this) and goes away.
+    close(stream->Fd);
+    if (stream->Child > 0)
+    {
+        kill(stream->Child, SIGTERM);
+        waitpid(stream->Child, NULL, 0);
+    }
+
+    if (stream->Filter == TAR_GZIP)
+        inflateEnd(&stream->Gzip);
+    else if (stream->Filter == TAR_XZ)
+        lzma_end(&stream->Xz);
+    free(stream->Input);
+    free(stream->Scratch);
+    free(stream->Name);
+    free(stream);
+}
+static tar_filter_t get_tar_filter(const char * path)
+{
+    if (has_suffix(path, ".gz") || has_suffix(path, ".tgz"))
+        return TAR_GZIP;
+    if (has_suffix(path, ".xz") || has_suffix(path, ".txz"))
+        return TAR_XZ;
+    if (has_suffix(path, ".zst") || has_suffix(path, ".tzst"))
+        return TAR_ZSTD;
+
+    return TAR_PLAIN;
+}
+static bool start_zstd(tar_stream_t * stream)
+{
+    // zstd reads the archive itself and we read what it writes.  Its
+    // complaints (a bad frame, say) go straight to our stderr.
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) != 0)
+        return false;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, stream->Fd, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+    char * argv[] = { "zstd", "-dcq", NULL };
+    int result = posix_spawnp(&stream->Child, "zstd", &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipe_fds[1]);
+    if (result != 0)
+    {
+        stream->Child = -1;
+        close(pipe_fds[0]);
+        return false;
+    }
+
+    close(stream->Fd);
+    stream->Fd = pipe_fds[0];
+    return true;
+}
+
+// Procs
+bool next_tar_member(tar_stream_t * stream, tar_member_t * out_member)
+{
+    assert(stream != NULL);
+    assert(out_member != NULL);
+
+    if (stream->Finished || stream->Failed || !skip_stream(stream, stream->Left + stream->Padding))
+        return false;
+    stream->Left = 0;
+    stream->Padding = 0;
+    free(stream->Name);
+    stream->Name = NULL;
+
+    // Whatever came before the header it belongs to.
+    char * long_name = NULL;
+    char * pax_name = NULL;
+    uint64_t pax_size = 0;
+    bool has_pax_size = false;
+    uint8_t header[tar_block_size];
+    bool ret = false;
+    while (!ret && !stream->Failed)
+    {
+        // Running out exactly between members is an archive missing its
+        // end marker, which tar itself lets go with a warning.
+        size_t got = read_stream(stream, header, tar_block_size);
+        if (got == 0 && !stream->Failed)
+        {
+            finish_stream(stream);
+            break;
+        }
+        if (got != tar_block_size || (!is_zero_block(header) && !check_header(header)))
+        {
+            stream->Failed = true;
+            break;
+        }
+        if (is_zero_block(header))
+        {
+            finish_stream(stream);
+            break;
+        }
+
+        uint64_t size;
+        if (!parse_number(header + tar_size_offset, tar_size_size, &size))
+        {
+            stream->Failed = true;
+            break;
+        }
+        if (has_pax_size)
+            size = pax_size;
+        uint64_t padding = (tar_block_size - size % tar_block_size) % tar_block_size;
+
+        char type = header[tar_type_offset];
+        if (type == 'L' || type == 'x')
+        {
+            char * extended = read_extended(stream, size);
+            if (extended == NULL || !skip_stream(stream, padding))
+            {
+                free(extended);
+                stream->Failed = true;
+                break;
+            }
+
+            if (type == 'L')
+            {
+                free(long_name);
+                long_name = extended;
+            }
+            else
+            {
+                read_pax(extended, size, &pax_name, &pax_size, &has_pax_size);
+                free(extended);
+            }
+            continue;
+        }
+        if (type != '0' && type != '\0' && type != '7')
+        {
+            // Directories, links, devices, pax globals and the like.
+            has_pax_size = false;
+            if (!skip_stream(stream, size + padding))
+                stream->Failed = true;
+            continue;
+        }
+
+        stream->Name = (pax_name != NULL) ? pax_name : (long_name != NULL) ? long_name : get_header_name(header);
+        if (stream->Name == pax_name)
+            pax_name = NULL;
+        else if (stream->Name == long_name)
+            long_name = NULL;
+        stream->Left = size;
+        stream->Padding = padding;
+        ret = true;
+    }
+    free(long_name);
+    free(pax_name);
+    if (!ret)
+        return false;
+
+    // Member names are relative whatever the archive says.
+    const char * name = stream->Name;
+    while (*name == '/' || strncmp(name, "./", 2) == 0)
+    {
+        name += (*name == '/') ? 1 : 2;
+    }
+    out_member->Name = name;
+    out_member->Size = stream->Left;
+    return true;
+}
+size_t read_tar_member(tar_stream_t * stream, void * buf, size_t buflen)
+{
+    assert(stream != NULL);
+    assert(buf != NULL || buflen == 0);
+
+    if (buflen > stream->Left)
+        buflen = stream->Left;
+    size_t ret = read_stream(stream, buf, buflen);
+    stream->Left -= ret;
+    if (ret < buflen)
+        stream->Failed = true;
+    return ret;
+}
+bool is_tar_stream_intact(const tar_stream_t * stream)
+{
+    assert(stream != NULL);
+
+    return !stream->Failed;
+}
+void get_tar_io_stats(const tar_stream_t * stream, io_stats_t * out_stats)
+{
+    assert(stream != NULL);
+    assert(out_stats != NULL);
+
+    *out_stats = stream->IoStats;
+}
+
+// Decoding
+static size_t read_stream(tar_stream_t * stream, void * buf, size_t buflen)
+{
+    // Exactly buflen bytes of tar unless the stream ends (or breaks) first.
+    size_t ret = 0;
+    while (ret < buflen && !stream->Ended && !stream->Failed)
+    {
+        if (stream->Filter == TAR_GZIP)
+        {
+            ret += decode_gzip(stream, (uint8_t *)buf + ret, buflen - ret);
+            continue;
+        }
+        if (stream->Filter == TAR_XZ)
+        {
+            ret += decode_xz(stream, (uint8_t *)buf + ret, buflen - ret);
+            continue;
+        }
+
+        ssize_t got = read(stream->Fd, (uint8_t *)buf + ret, buflen - ret);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            stream->Failed = true;
+        else if (got == 0)
+            stream->Ended = true;
+        else
+            ret += got;
+
+        // zstd's reading isn't ours to count until it's done.
+        if (got > 0 && stream->Filter == TAR_PLAIN)
+            stream->IoStats.CachedBytes += got;
+    }
+
+    return ret;
+}
+static bool fill_input(tar_stream_t * stream)
+{
+    // False once the archive has nothing more to give.
+    if (stream->InputPosition < stream->InputLength)
+        return true;
+    if (stream->InputEnded)
+        return false;
+
+    for (;;)
+    {
+        ssize_t got = read(stream->Fd, stream->Input, stream_buffer_size);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            stream->Failed = true;
+
+        stream->InputPosition = 0;
+        stream->InputLength = (got > 0) ? got : 0;
+        stream->InputEnded = (got <= 0);
+        stream->IoStats.CachedBytes += stream->InputLength;
+        return got > 0;
+    }
+}
+static size_t decode_gzip(tar_stream_t * stream, uint8_t * buf, size_t buflen)
+{
+    // gzip files can be several gzip streams end to end; each one that
+    // ends with more input behind it starts the next.
+    z_stream * z = &stream->Gzip;
+    bool more = fill_input(stream);
+    z->next_in = stream->Input + stream->InputPosition;
+    z->avail_in = stream->InputLength - stream->InputPosition;
+    z->next_out = buf;
+    z->avail_out = buflen;
+    int result = inflate(z, Z_NO_FLUSH);
+    size_t made = buflen - z->avail_out;
+    stream->InputPosition = stream->InputLength - z->avail_in;
+
+    if (result == Z_STREAM_END)
+    {
+        if (fill_input(stream))
+            inflateReset(z);
+        else
+            stream->Ended = true;
+    }
+    else if ((result != Z_OK && result != Z_BUF_ERROR) || (made == 0 && !more))
+    {
+        // Broken, or cut off before the gzip trailer.
+        stream->Failed = true;
+    }
+
+    return made;
+}
+static size_t decode_xz(tar_stream_t * stream, uint8_t * buf, size_t buflen)
+{
+    lzma_stream * xz = &stream->Xz;
+    bool more = fill_input(stream);
+    xz->next_in = stream->Input + stream->InputPosition;
+    xz->avail_in = stream->InputLength - stream->InputPosition;
+    xz->next_out = buf;
+    xz->avail_out = buflen;
+    lzma_ret result = lzma_code(xz, more ? LZMA_RUN : LZMA_FINISH);
+    size_t made = buflen - xz->avail_out;
+    stream->InputPosition = stream->InputLength - xz->avail_in;
+
+    if (result == LZMA_STREAM_END)
+        stream->Ended = true;
+    else if (result != LZMA_OK || (made == 0 && !more))
+        stream->Failed = true;
+
+    return made;
+}
+static bool skip_stream(tar_stream_t * stream, uint64_t count)
+{
+    // Reading past it is the only way by; there's no seeking in a stream.
+    while (count > 0)
+    {
+        size_t want = (count < stream_buffer_size) ? count : stream_buffer_size;
+        size_t got = read_stream(stream, stream->Scratch, want);
+        count -= got;
+        if (got < want)
+        {
+            stream->Failed = true;
+            return false;
+        }
+    }
+
+    return true;
+}
+static void finish_stream(tar_stream_t * stream)
+{
+    // Read what follows the end of the archive (padding out to a record
+    // and the compression's own trailer) so its checks get made.  zstd
+    // says how its check went by how it exits.
+    stream->Finished = true;
+    while (read_stream(stream, stream->Scratch, stream_buffer_size) > 0)
+    {
+    }
+
+    if (stream->Child > 0)
+    {
+        int status = 0;
+        close(stream->Fd);
+        stream->Fd = -1;
+        waitpid(stream->Child, &status, 0);
+        stream->Child = -1;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            stream->Failed = true;
+        else
+            stream->IoStats.CachedBytes += stream->ArchiveSize;
+    }
+}
+static char * read_extended(tar_stream_t * stream, uint64_t size)
+{
+    // The data of a long name or pax header, NUL terminated.
+    if (size > max_extended_size)
+        return NULL;
+
+    char * ret = malloc(size + 1);
+    if (read_stream(stream, ret, size) != size)
+    {
+        free(ret);
+        return NULL;
+    }
+
+    ret[size] = '\0';
+    return ret;
+}
+static void read_pax(const char * records, uint64_t size, char ** out_name, uint64_t * out_size, bool * out_has_size)
+{
+    // "<length> <key>=<value>\n" over and over, the length counting all of
+    // it.  Only the path and size matter to us.
+    uint64_t pos = 0;
+    while (pos < size)
+    {
+        char * end;
+        unsigned long long length = strtoull(records + pos, &end, 10);
+        if (length == 0 || *end != ' ' || length > size - pos)
+            return;
+
+        const char * key = end + 1;
+        const char * equals = memchr(key, '=', records + pos + length - key);
+        const char * value_end = records + pos + length - 1; // The newline
+        if (equals != NULL && *value_end == '\n')
+        {
+            size_t key_len = equals - key;
+            if (key_len == 4 && strncmp(key, "path", 4) == 0)
+            {
+                free(*out_name);
+                *out_name = strndup(equals + 1, value_end - equals - 1);
+            }
+            else if (key_len == 4 && strncmp(key, "size", 4) == 0)
+            {
+                *out_size = strtoull(equals + 1, NULL, 10);
+                *out_has_size = true;
+            }
+        }
+        pos += length;
+    }
+}
+
+// Headers
+static bool check_header(const uint8_t * header)
+{
+    // The checksum is the sum of every byte with its own field as spaces.
+    // Some old tars summed signed bytes, so either sum will do.
+    uint64_t stored;
+    if (!parse_number(header + tar_checksum_offset, tar_checksum_size, &stored))
+        return false;
+
+    int64_t sum = 0, signed_sum = 0;
+    for (size_t i = 0; i < tar_block_size; i++)
+    {
+        bool in_field = (i >= tar_checksum_offset && i < tar_checksum_offset + tar_checksum_size);
+        sum += in_field ? ' ' : header[i];
+        signed_sum += in_field ? ' ' : (int8_t)header[i];
+    }
+
+    return (uint64_t)sum == stored || (uint64_t)signed_sum == stored;
+}
+static bool parse_number(const uint8_t * field, size_t length, uint64_t * out_value)
+{
+    // Base 256 when the top bit is set, octal text otherwise (padded with
+    // spaces or NULs at either end).
+    uint64_t value = 0;
+    if (field[0] & 0x80)
+    {
+        value = field[0] & 0x7F;
+        for (size_t i = 1; i < length; i++)
+        {
+            if (value >> 56)
+                return false;
+            value = (value << 8) | field[i];
+        }
+
+        *out_value = value;
+        return true;
+    }
+
+    size_t i = 0;
+    while (i < length && field[i] == ' ')
+    {
+        i++;
+    }
+    for (; i < length && field[i] >= '0' && field[i] <= '7'; i++)
+    {
+        value = (value << 3) | (field[i] - '0');
+    }
+    if (i < length && field[i] != ' ' && field[i] != '\0')
+        return false;
+
+    *out_value = value;
+    return true;
+}
+static char * get_header_name(const uint8_t * header)
+{
+    // ustar splits long paths into a prefix and a name.
+    char * ret;
+    const char * name = (const char *)header + tar_name_offset;
+    const char * prefix = (const char *)header + tar_prefix_offset;
+    bool ustar = memcmp(header + tar_magic_offset, "ustar", 5) == 0;
+    if (ustar && prefix[0] != '\0')
+        asprintf(&ret, "%.*s/%.*s", (int)strnlen(prefix, tar_prefix_size), prefix, (int)strnlen(name, tar_name_size), name);
+    else
+        ret = strndup(name, tar_name_size);
+    return ret;
+}
+static bool is_zero_block(const uint8_t * block)
+{
+    for (size_t i = 0; i < tar_block_size; i++)
+    {
+        if (block[i] != 0)
+            return false;
+    }
+
+    return true;
+}
+static bool has_suffix(const char * text, const char * suffix)
+{
+    size_t text_len = strlen(text);
+    size_t suffix_len = strlen(suffix);
+    return text_len >= suffix_len && strcasecmp(text + text_len - suffix_len, suffix) == 0;
+}
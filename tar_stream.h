@@ -0,0 +1,47 @@
+/* Tar archives, plain or compressed with gzip, xz or zstd, read as a
+ * stream: one pass front to back, never a seek, nothing extracted.  Tars
+ * have no index, so members are met as their headers go by; the caller
+ * reads the ones it wants and the rest are read past.
+ *
+ * gzip and xz are decoded here.  zstd is piped through the zstd tool,
+ * which has to be on the PATH.  Once the end of the archive turns up the
+ * rest of the stream is read too, so a bad checksum in the compression
+ * is caught even after the last member.
+ *
+ * ustar, GNU (long names, base-256 sizes) and pax (path, size) headers
+ * are understood.  Anything that isn't a regular file is passed over.
+ */
+
+#ifndef _TAR_STREAM_H
+#define _TAR_STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "io_helper.h"
+
+
+typedef struct tar_member_s
+{
+    const char * Name; // Good until the next member
+    uint64_t Size;
+} tar_member_t;
+typedef struct tar_stream_s tar_stream_t;
+
+// Procs
+// How to decompress it goes by the name.  NULL if it can't be opened (or
+// the decompressor started).
+tar_stream_t * open_tar_stream(const char * path);
+void close_tar_stream(tar_stream_t * stream);
+
+// Moves on to the next regular file, reading past whatever is left of
+// the last.  False at the end of the archive, or when it turned out bad.
+bool next_tar_member(tar_stream_t * stream, tar_member_t * out_member);
+// The current member's bytes, in order.  Short only at its end (or if
+// the archive is cut short).
+size_t read_tar_member(tar_stream_t * stream, void * buf, size_t buflen);
+// False if anything so far was damaged, truncated or didn't decompress.
+bool is_tar_stream_intact(const tar_stream_t * stream);
+void get_tar_io_stats(const tar_stream_t * stream, io_stats_t * out_stats);
+
+#endif
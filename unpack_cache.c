@@ -0,0 +1,242 @@
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hash_helper.h"
+#include "io_helper.h"
+#include "unpack_cache.h"
+#include "libraries/asprintf.h"
+
+
+/* Nothing is kept in memory between calls; the directory is the cache.
+ * Looking for room reads the whole directory, which is nothing next to
+ * unpacking the member that's about to go in.
+ */
+struct unpack_cache_s
+{
+    char * Dir;
+    size_t Limit;
+};
+typedef struct unpacked_file_s
+{
+    char * Name;
+    size_t Size;
+    int64_t MtimeNs;
+} unpacked_file_t;
+
+static const char * unpacked_suffix = ".rom";
+static const char * unpacking_prefix = ".unpacking."; // Still being written
+static const size_t copy_chunk_size = 1024 * 1024;
+
+// What a run that died part way left behind is fair game once it's this
+// old; nobody takes an hour to write one member.
+static const int64_t abandoned_ns = 3600ll * 1000000000;
+
+
+// Decs
+static char * get_unpacked_path(const unpack_cache_t *, const rom_entry_t *);
+static void make_room(const unpack_cache_t *, size_t);
+static int compare_unpacked(const void *, const void *);
+
+
+// Init / Destroy
+unpack_cache_t * open_unpack_cache(const char * dir, size_t limit)
+{
+    assert(dir != NULL);
+
+    // Made if it isn't there yet.
+    struct stat st;
+    mkdir(dir, 0700);
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode) || access(dir, W_OK | X_OK) != 0)
+    {
+        fprintf(stderr, "Can't use unpack cache %s: not a directory we can write to\n", dir);
+        return NULL;
+    }
+
+    unpack_cache_t * ret = malloc(sizeof(unpack_cache_t));
+    ret->Dir = strdup(dir);
+    ret->Limit = limit;
+    return ret;
+}
+void close_unpack_cache(unpack_cache_t * cache)
+{
+    if (cache == NULL)
+        return;
+
+    free(cache->Dir);
+    free(cache);
+}
+
+// Procs
+FILE * lookup_unpack_cache(unpack_cache_t * cache, const rom_entry_t * rom)
+{
+    assert(cache != NULL);
+    assert(rom != NULL);
+
+    char * path = get_unpacked_path(cache, rom);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    free(path);
+    if (fd < 0)
+        return NULL;
+
+    // A hash collision (or someone else's file) is as good as a miss.
+    // Otherwise it's just been used, which is what keeps it around.
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (size_t)st.st_size != rom->Size)
+    {
+        close(fd);
+        return NULL;
+    }
+    futimens(fd, NULL);
+
+    FILE * ret = fdopen(fd, "rb");
+    if (ret == NULL)
+        close(fd);
+    return ret;
+}
+bool store_unpack_cache(unpack_cache_t * cache, const rom_entry_t * rom, nds_read_t reader, void * context)
+{
+    assert(cache != NULL);
+    assert(rom != NULL);
+    assert(reader != NULL);
+
+    if (rom->Size > cache->Limit)
+        return false;
+    make_room(cache, rom->Size);
+
+    // Room is claimed up front so a full tmpfs fails now rather than
+    // halfway through.
+    char * temp;
+    asprintf(&temp, "%s/%sXXXXXX", cache->Dir, unpacking_prefix);
+    int fd = mkstemp(temp);
+    if (fd < 0)
+    {
+        free(temp);
+        return false;
+    }
+
+    bool ret = rom->Size == 0 || posix_fallocate(fd, 0, rom->Size) == 0;
+    uint8_t * buf = malloc(copy_chunk_size);
+    for (size_t offset = 0; ret && offset < rom->Size; )
+    {
+        size_t want = (rom->Size - offset < copy_chunk_size) ? rom->Size - offset : copy_chunk_size;
+        size_t got = reader(context, buf, want, offset);
+        ret = got == want && write_fully(fd, buf, got);
+        offset += got;
+    }
+    free(buf);
+
+    char * path = get_unpacked_path(cache, rom);
+    ret = close(fd) == 0 && ret && rename(temp, path) == 0;
+    if (!ret)
+        unlink(temp);
+    free(path);
+    free(temp);
+    return ret;
+}
+void drop_unpack_cache(unpack_cache_t * cache, const rom_entry_t * rom)
+{
+    assert(cache != NULL);
+    assert(rom != NULL);
+
+    char * path = get_unpacked_path(cache, rom);
+    unlink(path);
+    free(path);
+}
+static char * get_unpacked_path(const unpack_cache_t * cache, const rom_entry_t * rom)
+{
+    // Everything that makes it the same member, hashed down to a name.
+    char * key;
+    asprintf(&key, "%" PRIu64 " %" PRIu64 " %" PRId64 " %zu %s", (uint64_t)rom->Device, (uint64_t)rom->Inode, rom->MtimeNs, rom->Size, rom->Member);
+    SHA512_HASH * hash = get_sha512(key, strlen(key));
+    free(key);
+
+    char name[33];
+    for (int i = 0; i < 16; i++)
+    {
+        snprintf(name + i * 2, 3, "%02x", hash->bytes[i]);
+    }
+    free(hash);
+
+    char * ret;
+    asprintf(&ret, "%s/%s%s", cache->Dir, name, unpacked_suffix);
+    return ret;
+}
+static void make_room(const unpack_cache_t * cache, size_t size)
+{
+    DIR * dir = opendir(cache->Dir);
+    if (dir == NULL)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t now_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+
+    size_t count = 0, capacity = 0, total = 0;
+    unpacked_file_t * files = NULL;
+    for (struct dirent * ent = readdir(dir); ent != NULL; ent = readdir(dir))
+    {
+        struct stat st;
+        if (fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode))
+            continue;
+
+        int64_t mtime_ns = stat_mtime_ns(&st);
+        size_t name_len = strlen(ent->d_name);
+        size_t suffix_len = strlen(unpacked_suffix);
+        if (strncmp(ent->d_name, unpacking_prefix, strlen(unpacking_prefix)) == 0)
+        {
+            if (now_ns - mtime_ns > abandoned_ns)
+                unlinkat(dirfd(dir), ent->d_name, 0);
+            continue;
+        }
+        if (name_len <= suffix_len || strcmp(ent->d_name + name_len - suffix_len, unpacked_suffix) != 0)
+            continue;
+
+        if (count == capacity)
+        {
+            capacity = (capacity > 0) ? capacity * 2 : 64;
+            files = realloc(files, sizeof(unpacked_file_t) * capacity);
+        }
+        files[count].Name = strdup(ent->d_name);
+        files[count].Size = st.st_size;
+        files[count].MtimeNs = mtime_ns;
+        total += st.st_size;
+        count++;
+    }
+
+    // Oldest out first until the new one fits.  Someone else may have
+    // beaten us to a file; that's room made all the same.
+    if (total + size > cache->Limit)
+    {
+        qsort(files, count, sizeof(unpacked_file_t), compare_unpacked);
+        for (size_t i = 0; i < count && total + size > cache->Limit; i++)
+        {
+            unlinkat(dirfd(dir), files[i].Name, 0);
+            total -= files[i].Size;
+        }
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        free(files[i].Name);
+    }
+    free(files);
+    closedir(dir);
+}
+
+// Bookkeeping
+static int compare_unpacked(const void * a, const void * b)
+{
+    const unpacked_file_t * file_a = a;
+    const unpacked_file_t * file_b = b;
+    return (file_a->MtimeNs < file_b->MtimeNs) ? -1 : (file_a->MtimeNs > file_b->MtimeNs);
+}
@@ -0,0 +1,41 @@
+/* The unpack cache keeps members that have been taken out of archives as
+ * plain files in a directory (tmpfs, ideally) so the next run over the
+ * same archives loads them like any other ROM rather than inflating or
+ * decoding them all over again.  A member is the same member while the
+ * archive's device, inode and mtime and the member's name and size all
+ * match; the file is named after a hash of those, so a changed archive
+ * simply misses and its old files age out.
+ *
+ * The directory is held under a size limit by throwing out whatever was
+ * used longest ago (a hit bumps the file's mtime).  Files are written
+ * under a temporary name and renamed into place, so any number of runs
+ * can share a directory; between them they can overshoot the limit by
+ * the members they're writing at the time.
+ */
+
+#ifndef _UNPACK_CACHE_H
+#define _UNPACK_CACHE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include "cartridge.h"
+#include "scanner.h"
+
+
+typedef struct unpack_cache_s unpack_cache_t;
+
+// Procs
+// NULL (and a message on stderr) if the directory can't be made or used.
+unpack_cache_t * open_unpack_cache(const char * dir, size_t limit);
+void close_unpack_cache(unpack_cache_t * cache);
+
+// Both are safe to call from any number of threads at once.
+// The member's bytes, open for reading, or NULL if they aren't there.
+FILE * lookup_unpack_cache(unpack_cache_t * cache, const rom_entry_t * rom);
+// Copies the member (all rom->Size bytes of it) out of reader.  False if it
+// didn't go in: too big for the limit, out of room or a short read.
+bool store_unpack_cache(unpack_cache_t * cache, const rom_entry_t * rom, nds_read_t reader, void * context);
+// For a copy that turned out not to be the member after all.
+void drop_unpack_cache(unpack_cache_t * cache, const rom_entry_t * rom);
+
+#endif
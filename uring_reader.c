@@ -0,0 +1,623 @@
+#define _GNU_SOURCE // O_DIRECT
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+
+#include "io_helper.h"
+#include "scanner.h"
+#include "uring_reader.h"
+
+
+/* The arena is one big anonymous mapping handed out as a ring: ROMs are
+ * allocated at the head in schedule order and freed (possibly out of
+ * order) by the workers; the tail only moves once the oldest ROM is
+ * released.  Since the workers consume in roughly schedule order that's
+ * all the allocator we need.  When the kernel lets us, the arena is
+ * registered as a fixed buffer so reads skip the per-request page pinning.
+ */
+static const size_t arena_alignment = 4096;
+static const size_t read_chunk_size = 1024 * 1024;
+static const size_t max_fixed_buffer = 1024 * 1024 * 1024;
+
+typedef enum uring_rom_state_e
+{
+    URING_ROM_PENDING = 0, // Not looked at yet
+    URING_ROM_LOADING, // Has arena space and reads in flight
+    URING_ROM_READY, // Fully read in
+    URING_ROM_SKIPPED, // We couldn't (or wouldn't) read it; the caller loads it instead
+} uring_rom_state_t;
+typedef struct uring_rom_s
+{
+    uring_rom_state_t State;
+    int Fd;
+    size_t Size;
+    size_t Offset; // Into the arena
+    size_t Submitted; // Bytes asked for so far
+    size_t Completed; // Bytes that have landed
+    unsigned InFlight;
+    bool Direct; // Opened O_DIRECT
+    bool Failed;
+    bool Freed;
+} uring_rom_t;
+typedef struct uring_chunk_s
+{
+    size_t Rom;
+    size_t Offset; // Into the file
+    size_t Length;
+} uring_chunk_t;
+
+struct uring_reader_s
+{
+    // The ring itself
+    int RingFd;
+    unsigned SqEntries;
+    unsigned * SqHead;
+    unsigned * SqTail;
+    unsigned * SqMask;
+    unsigned * SqArray;
+    unsigned * CqHead;
+    unsigned * CqTail;
+    unsigned * CqMask;
+    void * Sqes;
+    void * Cqes;
+    void * SqRing;
+    void * CqRing;
+    size_t SqRingSize;
+    size_t CqRingSize;
+    size_t SqesSize;
+    unsigned ToSubmit;
+    bool FixedBuffer;
+
+    // Where the ROMs land
+    uint8_t * Arena;
+    size_t ArenaSize;
+    size_t ArenaHead;
+    size_t * Blocks; // ROM indexes in allocation order (circular)
+    size_t FirstBlock;
+    size_t NumBlocks;
+
+    // What's being read
+    const rom_list_t * Roms;
+    uring_rom_t * States;
+    size_t NextRom; // Next place in the schedule to give arena space to
+    size_t NextSubmit; // Oldest place in the schedule that may still need reads issued
+    uring_chunk_t * Chunks;
+    unsigned * FreeChunks;
+    unsigned NumFreeChunks;
+    unsigned QueueDepth;
+    unsigned InFlight;
+    bool Cold;
+    io_stats_t Stats;
+
+    pthread_t Thread;
+    pthread_mutex_t Lock;
+    pthread_cond_t RomReady; // Workers wait on this
+    pthread_cond_t SpaceFreed; // The I/O thread waits on this
+    bool Stop;
+};
+
+
+#ifdef __NR_io_uring_setup
+
+// Decs
+static int setup_ring(uring_reader_t *, unsigned);
+static void teardown_ring(uring_reader_t *);
+static void * io_thread(void *);
+static bool arena_alloc(uring_reader_t *, size_t, size_t *);
+static void arena_free(uring_reader_t *, size_t);
+static void open_next_rom(uring_reader_t *);
+static void queue_reads(uring_reader_t *);
+static void reap_completions(uring_reader_t *);
+static void settle_rom(uring_reader_t *, size_t);
+
+
+// Init / Destroy
+uring_reader_t * create_uring_reader(const rom_list_t * roms, size_t arena_size, unsigned queue_depth, bool cold)
+{
+    assert(roms != NULL);
+
+    if (queue_depth < 1)
+        queue_depth = 1;
+    arena_size = (arena_size + arena_alignment - 1) & ~(arena_alignment - 1);
+
+    uring_reader_t * ret = malloc(sizeof(uring_reader_t));
+    memset(ret, 0, sizeof(*ret));
+    ret->RingFd = -1;
+    if (setup_ring(ret, queue_depth) != 0)
+    {
+        free(ret);
+        return NULL;
+    }
+
+    // Untouched arena pages cost nothing, so the size is a ceiling not a
+    // cost.  (Unless they're hugetlbfs pages, which were set aside for
+    // this sort of thing anyway.)
+    ret->ArenaSize = arena_size;
+    ret->Arena = alloc_large(arena_size);
+    if (ret->Arena == NULL)
+    {
+        teardown_ring(ret);
+        free(ret);
+        return NULL;
+    }
+
+    // Registration pins the arena; RLIMIT_MEMLOCK may well say no.
+    if (arena_size <= max_fixed_buffer)
+    {
+        struct iovec iov = { ret->Arena, arena_size };
+        ret->FixedBuffer = (syscall(__NR_io_uring_register, ret->RingFd, IORING_REGISTER_BUFFERS, &iov, 1) == 0);
+    }
+
+    ret->Roms = roms;
+    ret->Cold = cold;
+    ret->States = malloc(sizeof(uring_rom_t) * (roms->NumEntries + 1));
+    ret->Blocks = malloc(sizeof(size_t) * (roms->NumEntries + 1));
+    memset(ret->States, 0, sizeof(uring_rom_t) * (roms->NumEntries + 1));
+    for (size_t i = 0; i < roms->NumEntries; i++)
+    {
+        ret->States[i].Fd = -1;
+    }
+
+    ret->QueueDepth = (queue_depth < ret->SqEntries) ? queue_depth : ret->SqEntries;
+    ret->Chunks = malloc(sizeof(uring_chunk_t) * ret->QueueDepth);
+    ret->FreeChunks = malloc(sizeof(unsigned) * ret->QueueDepth);
+    for (unsigned i = 0; i < ret->QueueDepth; i++)
+    {
+        ret->FreeChunks[i] = i;
+    }
+    ret->NumFreeChunks = ret->QueueDepth;
+
+    pthread_mutex_init(&ret->Lock, NULL);
+    pthread_cond_init(&ret->RomReady, NULL);
+    pthread_cond_init(&ret->SpaceFreed, NULL);
+    pthread_create(&ret->Thread, NULL, io_thread, ret);
+
+    return ret;
+}
+void free_uring_reader(uring_reader_t * reader)
+{
+    if (reader == NULL)
+        return;
+
+    pthread_mutex_lock(&reader->Lock);
+    reader->Stop = true;
+    pthread_cond_signal(&reader->SpaceFreed);
+    pthread_mutex_unlock(&reader->Lock);
+    pthread_join(reader->Thread, NULL);
+
+    for (size_t i = 0; i < reader->Roms->NumEntries; i++)
+    {
+        if (reader->States[i].Fd >= 0)
+            close(reader->States[i].Fd);
+    }
+
+    teardown_ring(reader);
+    free_large(reader->Arena, reader->ArenaSize);
+    pthread_cond_destroy(&reader->RomReady);
+    pthread_cond_destroy(&reader->SpaceFreed);
+    pthread_mutex_destroy(&reader->Lock);
+    free(reader->States);
+    free(reader->Blocks);
+    free(reader->Chunks);
+    free(reader->FreeChunks);
+    free(reader);
+}
+void get_uring_io_stats(uring_reader_t * reader, io_stats_t * out_stats)
+{
+    assert(reader != NULL);
+    assert(out_stats != NULL);
+
+    pthread_mutex_lock(&reader->Lock);
+    *out_stats = reader->Stats;
+    pthread_mutex_unlock(&reader->Lock);
+}
+
+// Handing ROMs out
+uint8_t * acquire_uring_rom(uring_reader_t * reader, size_t index, size_t * out_size)
+{
+    assert(reader != NULL);
+    assert(index < reader->Roms->NumEntries);
+
+    pthread_mutex_lock(&reader->Lock);
+    uring_rom_t * rom = reader->States + index;
+    while (rom->State == URING_ROM_PENDING || rom->State == URING_ROM_LOADING)
+    {
+        pthread_cond_wait(&reader->RomReady, &reader->Lock);
+    }
+
+    uint8_t * ret = NULL;
+    if (rom->State == URING_ROM_READY)
+    {
+        ret = reader->Arena + rom->Offset;
+        *out_size = rom->Size;
+    }
+    pthread_mutex_unlock(&reader->Lock);
+
+    return ret;
+}
+void release_uring_rom(uring_reader_t * reader, size_t index)
+{
+    assert(reader != NULL);
+    assert(index < reader->Roms->NumEntries);
+
+    pthread_mutex_lock(&reader->Lock);
+    if (reader->States[index].State == URING_ROM_READY && !reader->States[index].Freed)
+    {
+        arena_free(reader, index);
+        pthread_cond_signal(&reader->SpaceFreed);
+    }
+    pthread_mutex_unlock(&reader->Lock);
+}
+
+
+// The I/O thread
+static void * io_thread(void * arg)
+{
+    uring_reader_t * reader = arg;
+
+    pthread_mutex_lock(&reader->Lock);
+    while (!reader->Stop)
+    {
+        // Give out arena space in schedule order for as long as it lasts.
+        while (reader->NextRom < reader->Roms->NumEntries)
+        {
+            size_t index = reader->Roms->Schedule[reader->NextRom];
+            uring_rom_t * rom = reader->States + index;
+            if (rom->Fd < 0 && rom->State == URING_ROM_PENDING)
+                open_next_rom(reader);
+            if (rom->State == URING_ROM_SKIPPED)
+            {
+                reader->NextRom++;
+                continue;
+            }
+            if (!arena_alloc(reader, rom->Size, &rom->Offset))
+                break;
+
+            reader->Blocks[(reader->FirstBlock + reader->NumBlocks) % (reader->Roms->NumEntries + 1)] = index;
+            reader->NumBlocks++;
+            rom->State = URING_ROM_LOADING;
+            reader->NextRom++;
+        }
+
+        queue_reads(reader);
+        if (reader->InFlight == 0 && reader->ToSubmit == 0)
+        {
+            // Either we're done or the arena is full of ROMs the workers
+            // haven't gotten around to yet.
+            if (reader->NextRom >= reader->Roms->NumEntries)
+                break;
+            pthread_cond_wait(&reader->SpaceFreed, &reader->Lock);
+            continue;
+        }
+
+        // Submit and wait for something to come back.
+        unsigned to_submit = reader->ToSubmit;
+        reader->ToSubmit = 0;
+        pthread_mutex_unlock(&reader->Lock);
+        int ret = syscall(__NR_io_uring_enter, reader->RingFd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        pthread_mutex_lock(&reader->Lock);
+        if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            break;
+        if (ret >= 0 && (unsigned)ret < to_submit)
+            reader->ToSubmit += to_submit - ret;
+
+        reap_completions(reader);
+    }
+
+    // Anything we never got to (or gave up on) goes back to the workers.
+    // Anything still in flight has to land before the arena can go away.
+    while (reader->InFlight > 0)
+    {
+        pthread_mutex_unlock(&reader->Lock);
+        int ret = syscall(__NR_io_uring_enter, reader->RingFd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        pthread_mutex_lock(&reader->Lock);
+        if (ret < 0 && errno != EINTR)
+            break;
+        reap_completions(reader);
+    }
+    for (size_t i = 0; i < reader->Roms->NumEntries; i++)
+    {
+        if (reader->States[i].State == URING_ROM_PENDING || reader->States[i].State == URING_ROM_LOADING)
+            reader->States[i].State = URING_ROM_SKIPPED;
+    }
+    pthread_cond_broadcast(&reader->RomReady);
+    pthread_mutex_unlock(&reader->Lock);
+
+    return NULL;
+}
+static void open_next_rom(uring_reader_t * reader)
+{
+    // Called with the lock held; opening can be slow on network storage
+    // so let go of it while we do.  Nobody else touches Fd or Size.
+    // Archive members (and tars, which are read as they're decoded)
+    // aren't files we can read straight into the arena.
+    size_t index = reader->Roms->Schedule[reader->NextRom];
+    const char * path = reader->Roms->Entries[index].Path;
+    bool member = (reader->Roms->Entries[index].Member != NULL || reader->Roms->Entries[index].Tar);
+
+    pthread_mutex_unlock(&reader->Lock);
+    struct stat st;
+    int fd = (reader->Cold && !member) ? open(path, O_RDONLY | O_CLOEXEC | O_DIRECT) : -1;
+    bool direct = (fd >= 0);
+    if (fd < 0 && !member)
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)))
+    {
+        close(fd);
+        fd = -1;
+    }
+    pthread_mutex_lock(&reader->Lock);
+
+    uring_rom_t * rom = reader->States + index;
+    if (fd < 0 || st.st_size == 0 || (size_t)st.st_size > reader->ArenaSize)
+    {
+        if (fd >= 0)
+            close(fd);
+        rom->State = URING_ROM_SKIPPED;
+        pthread_cond_broadcast(&reader->RomReady);
+        return;
+    }
+
+    rom->Fd = fd;
+    rom->Size = st.st_size;
+    rom->Direct = direct;
+}
+static void queue_reads(uring_reader_t * reader)
+{
+    // Oldest ROM first so the one the workers want next finishes first.
+    while (reader->NumFreeChunks > 0 && reader->NextSubmit < reader->NextRom)
+    {
+        size_t rom_index = reader->Roms->Schedule[reader->NextSubmit];
+        uring_rom_t * rom = reader->States + rom_index;
+        if (rom->State != URING_ROM_LOADING || rom->Failed || rom->Submitted >= rom->Size)
+        {
+            reader->NextSubmit++;
+            continue;
+        }
+
+        unsigned tail = *reader->SqTail;
+        if (tail - __atomic_load_n(reader->SqHead, __ATOMIC_ACQUIRE) >= reader->SqEntries)
+            break;
+
+        unsigned slot = reader->FreeChunks[--reader->NumFreeChunks];
+        uring_chunk_t * chunk = reader->Chunks + slot;
+        chunk->Rom = rom_index;
+        chunk->Offset = rom->Submitted;
+        chunk->Length = (rom->Size - rom->Submitted < read_chunk_size) ? rom->Size - rom->Submitted : read_chunk_size;
+
+        unsigned index = tail & *reader->SqMask;
+        struct io_uring_sqe * sqe = (struct io_uring_sqe *)reader->Sqes + index;
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = (reader->FixedBuffer) ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = rom->Fd;
+        sqe->off = chunk->Offset;
+        sqe->addr = (uint64_t)(uintptr_t)(reader->Arena + rom->Offset + chunk->Offset);
+        sqe->len = chunk->Length;
+        if (rom->Direct) // Arena space is rounded up so the tail can be too.
+            sqe->len = (chunk->Length + arena_alignment - 1) & ~(arena_alignment - 1);
+        sqe->buf_index = 0;
+        sqe->user_data = slot;
+        reader->SqArray[index] = index;
+        __atomic_store_n(reader->SqTail, tail + 1, __ATOMIC_RELEASE);
+
+        rom->Submitted += chunk->Length;
+        rom->InFlight++;
+        reader->InFlight++;
+        reader->ToSubmit++;
+    }
+}
+static void reap_completions(uring_reader_t * reader)
+{
+    unsigned head = *reader->CqHead;
+    unsigned tail = __atomic_load_n(reader->CqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++)
+    {
+        struct io_uring_cqe * cqe = (struct io_uring_cqe *)reader->Cqes + (head & *reader->CqMask);
+        unsigned slot = cqe->user_data;
+        int res = cqe->res;
+        uring_chunk_t * chunk = reader->Chunks + slot;
+        uring_rom_t * rom = reader->States + chunk->Rom;
+
+        rom->InFlight--;
+        reader->InFlight--;
+        reader->FreeChunks[reader->NumFreeChunks++] = slot;
+
+        // Short reads on a regular file mean it shrank under us (or
+        // something odder).  Either way the ordinary loader can deal.
+        if (res < 0 || (size_t)res != chunk->Length)
+            rom->Failed = true;
+        else
+            rom->Completed += res;
+        if (res > 0 && rom->Direct)
+            reader->Stats.DirectBytes += res;
+        else if (res > 0)
+            reader->Stats.CachedBytes += res;
+
+        settle_rom(reader, chunk->Rom);
+    }
+    __atomic_store_n(reader->CqHead, head, __ATOMIC_RELEASE);
+}
+static void settle_rom(uring_reader_t * reader, size_t index)
+{
+    // A ROM is done once nothing is in flight and it either all arrived
+    // or something went wrong.  Failed ROMs hand their space straight back.
+    uring_rom_t * rom = reader->States + index;
+    if (rom->InFlight > 0)
+        return;
+
+    if (rom->Failed)
+    {
+        rom->State = URING_ROM_SKIPPED;
+        arena_free(reader, index);
+    }
+    else if (rom->Completed == rom->Size)
+    {
+        rom->State = URING_ROM_READY;
+    }
+    else
+    {
+        return;
+    }
+
+    if (reader->Cold && !rom->Direct)
+        posix_fadvise(rom->Fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(rom->Fd);
+    rom->Fd = -1;
+    pthread_cond_broadcast(&reader->RomReady);
+}
+
+
+// The arena
+static bool arena_alloc(uring_reader_t * reader, size_t size, size_t * out_offset)
+{
+    size = (size + arena_alignment - 1) & ~(arena_alignment - 1);
+    if (size > reader->ArenaSize)
+        return false;
+
+    if (reader->NumBlocks == 0)
+    {
+        reader->ArenaHead = size;
+        *out_offset = 0;
+        return true;
+    }
+
+    size_t tail = reader->States[reader->Blocks[reader->FirstBlock]].Offset;
+    if (reader->ArenaHead > tail)
+    {
+        // Not wrapped: room at the end, or failing that at the start.
+        if (reader->ArenaSize - reader->ArenaHead >= size)
+        {
+            *out_offset = reader->ArenaHead;
+            reader->ArenaHead += size;
+            return true;
+        }
+        if (tail >= size)
+        {
+            *out_offset = 0;
+            reader->ArenaHead = size;
+            return true;
+        }
+        return false;
+    }
+
+    // Wrapped: the only room is between the head and the tail.
+    if (tail - reader->ArenaHead >= size)
+    {
+        *out_offset = reader->ArenaHead;
+        reader->ArenaHead += size;
+        return true;
+    }
+    return false;
+}
+static void arena_free(uring_reader_t * reader, size_t index)
+{
+    // Mark it and then let the tail catch up over everything that's free.
+    size_t capacity = reader->Roms->NumEntries + 1;
+    reader->States[index].Freed = true;
+    while (reader->NumBlocks > 0 && reader->States[reader->Blocks[reader->FirstBlock]].Freed)
+    {
+        reader->FirstBlock = (reader->FirstBlock + 1) % capacity;
+        reader->NumBlocks--;
+    }
+    if (reader->NumBlocks == 0)
+        reader->ArenaHead = 0;
+}
+
+
+// The ring
+static int setup_ring(uring_reader_t * reader, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    reader->RingFd = syscall(__NR_io_uring_setup, entries, &params);
+    if (reader->RingFd < 0)
+        return -1;
+
+    reader->SqEntries = params.sq_entries;
+    reader->SqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    reader->CqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (reader->CqRingSize > reader->SqRingSize)
+            reader->SqRingSize = reader->CqRingSize;
+        reader->CqRingSize = reader->SqRingSize;
+    }
+
+    reader->SqRing = mmap(NULL, reader->SqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, reader->RingFd, IORING_OFF_SQ_RING);
+    if (reader->SqRing == MAP_FAILED)
+    {
+        reader->SqRing = NULL;
+        teardown_ring(reader);
+        return -1;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        reader->CqRing = reader->SqRing;
+    else
+        reader->CqRing = mmap(NULL, reader->CqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, reader->RingFd, IORING_OFF_CQ_RING);
+    if (reader->CqRing == MAP_FAILED)
+    {
+        reader->CqRing = NULL;
+        teardown_ring(reader);
+        return -1;
+    }
+
+    reader->SqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    reader->Sqes = mmap(NULL, reader->SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, reader->RingFd, IORING_OFF_SQES);
+    if (reader->Sqes == MAP_FAILED)
+    {
+        reader->Sqes = NULL;
+        teardown_ring(reader);
+        return -1;
+    }
+
+    uint8_t * sq = reader->SqRing;
+    uint8_t * cq = reader->CqRing;
+    reader->SqHead = (unsigned *)(sq + params.sq_off.head);
+    reader->SqTail = (unsigned *)(sq + params.sq_off.tail);
+    reader->SqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    reader->SqArray = (unsigned *)(sq + params.sq_off.array);
+    reader->CqHead = (unsigned *)(cq + params.cq_off.head);
+    reader->CqTail = (unsigned *)(cq + params.cq_off.tail);
+    reader->CqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    reader->Cqes = cq + params.cq_off.cqes;
+
+    return 0;
+}
+static void teardown_ring(uring_reader_t * reader)
+{
+    if (reader->Sqes != NULL)
+        munmap(reader->Sqes, reader->SqesSize);
+    if (reader->CqRing != NULL && reader->CqRing != reader->SqRing)
+        munmap(reader->CqRing, reader->CqRingSize);
+    if (reader->SqRing != NULL)
+        munmap(reader->SqRing, reader->SqRingSize);
+    if (reader->RingFd >= 0)
+        close(reader->RingFd);
+}
+
+#else
+
+// No io_uring in these headers; everybody uses the ordinary loader.
+uring_reader_t * create_uring_reader(const rom_list_t * roms, size_t arena_size, unsigned queue_depth, bool cold) { return NULL; }
+void free_uring_reader(uring_reader_t * reader) { }
+void get_uring_io_stats(uring_reader_t * reader, io_stats_t * out_stats) { }
+uint8_t * acquire_uring_rom(uring_reader_t * reader, size_t index, size_t * out_size) { return NULL; }
+void release_uring_rom(uring_reader_t * reader, size_t index) { }
+
+#endif
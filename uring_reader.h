@@ -0,0 +1,39 @@
+/* An io_uring backed read-ahead engine.  A single I/O thread walks the
+ * ROM list ahead of the workers, keeping a queue full of large reads
+ * spread over as many ROMs as fit in its buffer arena, so the device
+ * sees real queue depth instead of one fread at a time.  Workers pick
+ * up finished images and analyze them straight out of the arena.
+ *
+ * Everything here is optional.  If the kernel (or a seccomp profile)
+ * says no to io_uring, create_uring_reader returns NULL; if a particular
+ * ROM can't be read ahead, acquire_uring_rom returns NULL.  Either way
+ * the caller just loads the ROM the ordinary way.
+ *
+ * A cold reader keeps out of the page cache: O_DIRECT where the
+ * filesystem takes it, otherwise each ROM is dropped once it's in.
+ */
+
+#ifndef _URING_READER_H
+#define _URING_READER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "io_helper.h"
+#include "scanner.h"
+
+
+typedef struct uring_reader_s uring_reader_t;
+
+// Procs
+uring_reader_t * create_uring_reader(const rom_list_t * roms, size_t arena_size, unsigned queue_depth, bool cold);
+void free_uring_reader(uring_reader_t * reader);
+void get_uring_io_stats(uring_reader_t * reader, io_stats_t * out_stats);
+
+// The reader loads in the list's schedule order (which is how the worker
+// pool hands ROMs out) so that's the order to ask in.  Indexes are into
+// the list itself.  Every acquire needs a release.
+uint8_t * acquire_uring_rom(uring_reader_t * reader, size_t index, size_t * out_size);
+void release_uring_rom(uring_reader_t * reader, size_t index);
+
+#endif
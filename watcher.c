@@ -0,0 +1,557 @@
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "hash_helper.h"
+#include "io_helper.h"
+#include "scanner.h"
+#include "watcher.h"
+#include "worker_pool.h"
+#include "libraries/asprintf.h"
+
+
+/* Events are collected until things go quiet for a moment (or have been
+ * busy for too long) and then everything touched is looked at as one
+ * batch on the worker pool.  A new file counts as finished when whoever
+ * wrote it closes it or renames it into place; a bare create is ignored
+ * since the file is probably still being written.  If the kernel drops
+ * events on the floor we fall back to walking the roots again.
+ *
+ * Only directories are watched, so a root that's a single file is
+ * audited once and then left alone.
+ */
+static const int settle_ms = 500;
+static const int max_settle_ms = 5000;
+static const uint32_t watch_mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE | IN_ONLYDIR;
+static const size_t event_buffer_size = 64 * 1024;
+
+// What the last report for every path we've seen hashed to, and the
+// size and mtime it was made from.  Only the digests are kept since
+// reports run to tens of kilobytes for a big ROM and all we ever do with
+// the old one is ask whether the new one differs.  Open addressing, never
+// shrinks; a path that went away keeps its slot without a report.
+typedef struct watch_result_s
+{
+    char * Path;
+    bool HasReport;
+    uint32_t ReportCrc;
+    SHA512_HASH ReportHash;
+    size_t Size;
+    int64_t MtimeNs;
+    bool Seen;
+} watch_result_t;
+
+typedef struct watch_results_s
+{
+    size_t Count;
+    size_t Capacity;
+    watch_result_t * Slots;
+} watch_results_t;
+
+typedef struct watcher_s
+{
+    int Fd;
+    char ** WatchPaths; // By watch descriptor
+    int NumWatchPaths;
+    bool WarnedLimit;
+
+    char * const * Roots;
+    int NumRoots;
+    int NumThreads;
+    worker_job_t Job;
+    void * Context; // Only for the first pass
+    const worker_limits_t * Limits; // Asked about against Context like Job is
+    FILE * Out;
+
+    pthread_mutex_t Lock;
+    watch_results_t Results;
+    bool FirstPass;
+
+    char ** Pending;
+    size_t NumPending;
+    size_t PendingCapacity;
+    bool Rescan;
+} watcher_t;
+
+static volatile sig_atomic_t stop_watching = 0;
+
+
+// Decs
+static void on_signal(int);
+static char * watch_job(const rom_entry_t *, size_t, void *);
+static size_t watch_cost(const rom_entry_t *, size_t, void *);
+static unsigned watch_device_limit(const rom_entry_t *, size_t, void *);
+static void watch_limits(const watcher_t *, worker_limits_t *);
+static void read_events(watcher_t *);
+static void run_batch(watcher_t *);
+static void add_watch(watcher_t *, const char *);
+static void add_tree(watcher_t *, const char *);
+static void forget_tree(watcher_t *, const char *, bool);
+static void refresh_archive(watcher_t *, const char *);
+static void push_pending(watcher_t *, const char *);
+static int compare_paths(const void *, const void *);
+static watch_result_t * find_result(watch_results_t *, const char *, bool);
+static void rescan(watcher_t *);
+static void free_results(watch_results_t *);
+
+
+// Running
+int run_watch(char * const * roots, int num_roots, rom_list_t * roms, int num_threads, worker_job_t job, void * context, const worker_limits_t * limits, FILE * out)
+{
+    assert(roms != NULL);
+    assert(job != NULL);
+    assert(out != NULL);
+
+    watcher_t watcher;
+    memset(&watcher, 0, sizeof(watcher));
+    watcher.Fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (watcher.Fd < 0)
+    {
+        fprintf(stderr, "Can't watch for changes: %s\n", strerror(errno));
+        return -1;
+    }
+    watcher.Roots = roots;
+    watcher.NumRoots = num_roots;
+    watcher.NumThreads = num_threads;
+    watcher.Job = job;
+    watcher.Context = context;
+    watcher.Limits = limits;
+    watcher.Out = out;
+    pthread_mutex_init(&watcher.Lock, NULL);
+
+    // Watch first and audit second so nothing written during the first
+    // pass slips through the gap.
+    for (size_t i = 0; i < roms->NumDirectories; i++)
+    {
+        add_watch(&watcher, roms->Directories[i]);
+    }
+
+    worker_limits_t pool_limits;
+    watch_limits(&watcher, &pool_limits);
+    watcher.FirstPass = true;
+    run_worker_pool(roms, num_threads, watch_job, &watcher, &pool_limits, out);
+    watcher.FirstPass = false;
+    watcher.Context = NULL;
+
+    // Anything that changed between the walk and the watches going up
+    // turns up in one quick look around.
+    watcher.Rescan = true;
+
+    // No SA_RESTART; we want poll to wake up and notice.
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    int64_t first_event = now_ms();
+    while (!stop_watching)
+    {
+        // Sleep until something happens, then until it stops happening.
+        int timeout = -1;
+        if (watcher.NumPending > 0 || watcher.Rescan)
+        {
+            int64_t left = first_event + max_settle_ms - now_ms();
+            timeout = (left < settle_ms) ? ((left > 0) ? (int)left : 0) : settle_ms;
+        }
+
+        struct pollfd pfd = { watcher.Fd, POLLIN, 0 };
+        int ret = poll(&pfd, 1, timeout);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            break;
+
+        if (ret == 0)
+        {
+            run_batch(&watcher);
+            continue;
+        }
+
+        bool was_idle = (watcher.NumPending == 0 && !watcher.Rescan);
+        read_events(&watcher);
+        if (was_idle)
+            first_event = now_ms();
+    }
+
+    close(watcher.Fd);
+    for (int i = 0; i < watcher.NumWatchPaths; i++)
+    {
+        free(watcher.WatchPaths[i]);
+    }
+    for (size_t i = 0; i < watcher.NumPending; i++)
+    {
+        free(watcher.Pending[i]);
+    }
+    free(watcher.WatchPaths);
+    free(watcher.Pending);
+    free_results(&watcher.Results);
+    pthread_mutex_destroy(&watcher.Lock);
+
+    return 0;
+}
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop_watching = 1;
+}
+static char * watch_job(const rom_entry_t * rom, size_t index, void * context)
+{
+    // Runs on the worker threads.  Remember the report and work out what
+    // (if anything) is worth saying about it.
+    watcher_t * watcher = context;
+    char * report = watcher->Job(rom, index, watcher->Context);
+    if (report == NULL)
+        return NULL;
+
+    // Hashed outside the lock; the other workers have reports of their own.
+    digest_context_t digest;
+    uint32_t crc;
+    SHA512_HASH hash;
+    digest_init(&digest);
+    digest_update(&digest, report, strlen(report));
+    digest_finish(&digest, &crc, &hash);
+
+    pthread_mutex_lock(&watcher->Lock);
+    watch_result_t * last = find_result(&watcher->Results, rom->Path, true);
+    char * ret = NULL;
+    if (watcher->FirstPass)
+        ret = report;
+    else if (!last->HasReport)
+        asprintf(&ret, "Added %s\n%s", rom->Path, report);
+    else if (last->ReportCrc != crc || memcmp(&last->ReportHash, &hash, sizeof(hash)) != 0)
+        asprintf(&ret, "Changed %s\n%s", rom->Path, report);
+
+    last->HasReport = true;
+    last->ReportCrc = crc;
+    last->ReportHash = hash;
+    last->Size = rom->Size;
+    last->MtimeNs = rom->MtimeNs;
+    pthread_mutex_unlock(&watcher->Lock);
+
+    if (ret != report)
+        free(report);
+    return ret;
+}
+static size_t watch_cost(const rom_entry_t * rom, size_t index, void * context)
+{
+    watcher_t * watcher = context;
+    return watcher->Limits->Cost(rom, index, watcher->Context);
+}
+static unsigned watch_device_limit(const rom_entry_t * rom, size_t index, void * context)
+{
+    watcher_t * watcher = context;
+    return watcher->Limits->DeviceLimit(rom, index, watcher->Context);
+}
+static void watch_limits(const watcher_t * watcher, worker_limits_t * out_limits)
+{
+    // The caller's limits, but asked about against the caller's context.
+    memset(out_limits, 0, sizeof(*out_limits));
+    if (watcher->Limits == NULL)
+        return;
+
+    out_limits->Budget = watcher->Limits->Budget;
+    out_limits->Cost = (watcher->Limits->Cost != NULL) ? watch_cost : NULL;
+    out_limits->DeviceLimit = (watcher->Limits->DeviceLimit != NULL) ? watch_device_limit : NULL;
+}
+
+// Events
+static void read_events(watcher_t * watcher)
+{
+    // inotify hands back whole events, and malloc's alignment is plenty
+    // for walking them in place.
+    char * buffer = malloc(event_buffer_size);
+    ssize_t got;
+    while ((got = read(watcher->Fd, buffer, event_buffer_size)) > 0)
+    {
+        for (char * pos = buffer; pos < buffer + got;)
+        {
+            struct inotify_event * event = (struct inotify_event *)pos;
+            pos += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                watcher->Rescan = true;
+                continue;
+            }
+            if (event->wd < 0 || event->wd >= watcher->NumWatchPaths || watcher->WatchPaths[event->wd] == NULL)
+                continue;
+            if (event->mask & IN_IGNORED)
+            {
+                free(watcher->WatchPaths[event->wd]);
+                watcher->WatchPaths[event->wd] = NULL;
+                continue;
+            }
+            if (event->len == 0)
+                continue;
+
+            char * path;
+            asprintf(&path, "%s/%s", watcher->WatchPaths[event->wd], event->name);
+            if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+                add_tree(watcher, path);
+            else if (event->mask & IN_ISDIR)
+                forget_tree(watcher, path, (event->mask & IN_MOVED_FROM) != 0);
+            else if ((event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)) && is_archive_path(path))
+                refresh_archive(watcher, path);
+            else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE))
+                push_pending(watcher, path);
+            free(path);
+        }
+    }
+
+    free(buffer);
+}
+static void run_batch(watcher_t * watcher)
+{
+    if (watcher->Rescan)
+        rescan(watcher);
+
+    // The same file tends to turn up a few times in a burst.
+    qsort(watcher->Pending, watcher->NumPending, sizeof(char *), compare_paths);
+
+    rom_list_t batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.Entries = malloc(sizeof(rom_entry_t) * (watcher->NumPending + 1));
+    batch.Schedule = malloc(sizeof(size_t) * (watcher->NumPending + 1));
+    for (size_t i = 0; i < watcher->NumPending; i++)
+    {
+        const char * path = watcher->Pending[i];
+        if (i > 0 && strcmp(path, watcher->Pending[i - 1]) == 0)
+            continue;
+
+        // Whatever isn't (or is no longer) a ROM is gone as far as we care.
+        if (scan_file(path, batch.Entries + batch.NumEntries))
+        {
+            batch.Schedule[batch.NumEntries] = batch.NumEntries;
+            batch.NumEntries++;
+            continue;
+        }
+
+        watch_result_t * last = find_result(&watcher->Results, path, false);
+        if (last != NULL && last->HasReport)
+        {
+            fprintf(watcher->Out, "Removed %s\n\n", path);
+            last->HasReport = false;
+        }
+    }
+    fflush(watcher->Out);
+
+    schedule_largest_first(&batch);
+    worker_limits_t pool_limits;
+    watch_limits(watcher, &pool_limits);
+    run_worker_pool(&batch, watcher->NumThreads, watch_job, watcher, &pool_limits, watcher->Out);
+
+    for (size_t i = 0; i < batch.NumEntries; i++)
+    {
+        free(batch.Entries[i].Path);
+        free(batch.Entries[i].Member);
+    }
+    for (size_t i = 0; i < watcher->NumPending; i++)
+    {
+        free(watcher->Pending[i]);
+    }
+    free(batch.Entries);
+    free(batch.Schedule);
+    watcher->NumPending = 0;
+}
+
+// Watches
+static void add_watch(watcher_t * watcher, const char * dir)
+{
+    // Watching a directory twice hands back the same descriptor.  The
+    // first name it was found under sticks, so a symlink back up the tree
+    // doesn't rename the real thing.
+    int wd = inotify_add_watch(watcher->Fd, dir, watch_mask);
+    if (wd < 0)
+    {
+        if (errno == ENOSPC && !watcher->WarnedLimit)
+            fprintf(stderr, "Out of inotify watches; raise fs.inotify.max_user_watches to watch everything\n");
+        watcher->WarnedLimit |= (errno == ENOSPC);
+        return;
+    }
+
+    if (wd >= watcher->NumWatchPaths)
+    {
+        int grown = (wd + 1 > watcher->NumWatchPaths * 2) ? wd + 1 : watcher->NumWatchPaths * 2;
+        watcher->WatchPaths = realloc(watcher->WatchPaths, sizeof(char *) * grown);
+        memset(watcher->WatchPaths + watcher->NumWatchPaths, 0, sizeof(char *) * (grown - watcher->NumWatchPaths));
+        watcher->NumWatchPaths = grown;
+    }
+
+    if (watcher->WatchPaths[wd] == NULL)
+        watcher->WatchPaths[wd] = strdup(dir);
+}
+static void add_tree(watcher_t * watcher, const char * dir)
+{
+    // A directory that just showed up may already be full (mv, cp -r).
+    char * roots[] = { (char *)dir };
+    rom_list_t * roms = scan_roots(roots, 1, 1);
+    for (size_t i = 0; i < roms->NumDirectories; i++)
+    {
+        add_watch(watcher, roms->Directories[i]);
+    }
+    for (size_t i = 0; i < roms->NumEntries; i++)
+    {
+        push_pending(watcher, roms->Entries[i].Path);
+    }
+
+    free_rom_list(roms);
+}
+static void forget_tree(watcher_t * watcher, const char * dir, bool moved)
+{
+    // Everything we knew about under the directory gets looked at again
+    // (and found missing).  A deleted directory's watches go away on their
+    // own; a moved one's would carry on reporting under the old name.
+    size_t len = strlen(dir);
+    for (size_t i = 0; i < watcher->Results.Capacity; i++)
+    {
+        const watch_result_t * result = watcher->Results.Slots + i;
+        if (result->HasReport && strncmp(result->Path, dir, len) == 0 && result->Path[len] == '/')
+            push_pending(watcher, result->Path);
+    }
+
+    for (int wd = 0; moved && wd < watcher->NumWatchPaths; wd++)
+    {
+        const char * path = watcher->WatchPaths[wd];
+        if (path != NULL && strncmp(path, dir, len) == 0 && (path[len] == '/' || path[len] == '\0'))
+        {
+            inotify_rm_watch(watcher->Fd, wd);
+            free(watcher->WatchPaths[wd]);
+            watcher->WatchPaths[wd] = NULL;
+        }
+    }
+}
+static void refresh_archive(watcher_t * watcher, const char * path)
+{
+    // Whatever is in it now gets looked at, and so does whatever used to
+    // be (which is how members that went away get noticed).
+    rom_entry_t * entries;
+    size_t count = scan_archive(path, &entries);
+    for (size_t i = 0; i < count; i++)
+    {
+        push_pending(watcher, entries[i].Path);
+        free(entries[i].Path);
+        free(entries[i].Member);
+    }
+    free(entries);
+
+    forget_tree(watcher, path, false);
+}
+static void push_pending(watcher_t * watcher, const char * path)
+{
+    if (watcher->NumPending == watcher->PendingCapacity)
+    {
+        watcher->PendingCapacity = (watcher->PendingCapacity == 0) ? 64 : watcher->PendingCapacity * 2;
+        watcher->Pending = realloc(watcher->Pending, sizeof(char *) * watcher->PendingCapacity);
+    }
+
+    watcher->Pending[watcher->NumPending++] = strdup(path);
+}
+static int compare_paths(const void * a, const void * b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Bookkeeping
+static void rescan(watcher_t * watcher)
+{
+    // Either events were lost or there was a window with nobody listening,
+    // so walk the roots and compare.  Only what's new, gone, or has a
+    // different size or mtime gets audited again.
+    rom_list_t * roms = scan_roots(watcher->Roots, watcher->NumRoots, watcher->NumThreads);
+    for (size_t i = 0; i < roms->NumDirectories; i++)
+    {
+        add_watch(watcher, roms->Directories[i]);
+    }
+
+    for (size_t i = 0; i < watcher->Results.Capacity; i++)
+    {
+        watcher->Results.Slots[i].Seen = false;
+    }
+    for (size_t i = 0; i < roms->NumEntries; i++)
+    {
+        const rom_entry_t * rom = roms->Entries + i;
+        watch_result_t * last = find_result(&watcher->Results, rom->Path, false);
+        if (last == NULL || !last->HasReport || last->Size != rom->Size || last->MtimeNs != rom->MtimeNs)
+            push_pending(watcher, rom->Path);
+        if (last != NULL)
+            last->Seen = true;
+    }
+    for (size_t i = 0; i < watcher->Results.Capacity; i++)
+    {
+        const watch_result_t * result = watcher->Results.Slots + i;
+        if (result->HasReport && !result->Seen)
+            push_pending(watcher, result->Path);
+    }
+
+    free_rom_list(roms);
+    watcher->Rescan = false;
+}
+static watch_result_t * find_result(watch_results_t * results, const char * path, bool create)
+{
+    // Returns the slot for path, or NULL if it's new and create is false.
+    if (create && (results->Count + 1) * 2 > results->Capacity)
+    {
+        watch_results_t grown;
+        grown.Count = 0;
+        grown.Capacity = (results->Capacity == 0) ? 1024 : results->Capacity * 2;
+        grown.Slots = calloc(grown.Capacity, sizeof(watch_result_t));
+
+        for (size_t i = 0; i < results->Capacity; i++)
+        {
+            if (results->Slots[i].Path == NULL)
+                continue;
+
+            watch_result_t * moved = find_result(&grown, results->Slots[i].Path, true);
+            free(moved->Path);
+            *moved = results->Slots[i];
+        }
+
+        free(results->Slots);
+        *results = grown;
+    }
+    if (results->Capacity == 0)
+        return NULL;
+
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (const char * c = path; *c != '\0'; c++)
+    {
+        hash = (hash ^ (uint8_t)*c) * 0x100000001b3ull;
+    }
+
+    size_t slot = hash % results->Capacity;
+    while (results->Slots[slot].Path != NULL)
+    {
+        if (strcmp(results->Slots[slot].Path, path) == 0)
+            return results->Slots + slot;
+        slot = (slot + 1) % results->Capacity;
+    }
+
+    if (!create)
+        return NULL;
+
+    memset(results->Slots + slot, 0, sizeof(watch_result_t));
+    results->Slots[slot].Path = strdup(path);
+    results->Count++;
+    return results->Slots + slot;
+}
+static void free_results(watch_results_t * results)
+{
+    for (size_t i = 0; i < results->Capacity; i++)
+    {
+        free(results->Slots[i].Path);
+    }
+
+    free(results->Slots);
+}
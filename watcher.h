@@ -0,0 +1,27 @@
+/* Watch mode.  After the usual full pass the roots are watched with
+ * inotify and only the ROMs that were written, renamed into place or
+ * removed get looked at again.  The last report for every ROM is kept in
+ * memory so what comes out after the first pass is just what changed:
+ *
+ *   Added <path>      followed by the new report
+ *   Changed <path>    followed by the new report
+ *   Removed <path>
+ *
+ * A ROM that was rewritten with the same contents reports nothing.
+ */
+
+#ifndef _WATCHER_H
+#define _WATCHER_H
+
+#include <stdio.h>
+#include "scanner.h"
+#include "worker_pool.h"
+
+
+// Procs
+// Runs until SIGINT or SIGTERM.  The first pass hands job the list's own
+// indexes and context; later passes hand it a NULL context.  The same
+// goes for the limits' callbacks, and limits may be NULL.
+int run_watch(char * const * roots, int num_roots, rom_list_t * roms, int num_threads, worker_job_t job, void * context, const worker_limits_t * limits, FILE * out);
+
+#endif
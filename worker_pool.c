@@ -0,0 +1,342 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "scanner.h"
+#include "worker_pool.h"
+
+
+/* Jobs are handed out in schedule order.  Finished reports land in a
+ * slot per ROM (by list index) and whoever fills the slot the output is
+ * waiting on prints every consecutive finished slot from there, one
+ * worker at a time and outside the lock.  Anything that finishes early
+ * sits in its slot until its turn comes.  A schedule that runs far ahead
+ * of the list (largest first, say, with a small ROM first in the list)
+ * could pile up every report that way, so once held_output_limit bytes
+ * of them are waiting the only job handed out is the one the output is
+ * waiting on.
+ *
+ * Jobs counted against a device's limit sit in a lane for that device;
+ * everything else shares lane 0.  A worker takes the earliest job in the
+ * schedule that fits the budget from any lane with room, and if there
+ * isn't one waits for a running job to give its share back.  With no
+ * limits at all there's just lane 0, every job costs nothing, and that's
+ * simply the front of the schedule.
+ */
+typedef struct worker_lane_s
+{
+    dev_t Device;
+    unsigned Limit; // 0 == no limit
+    unsigned Running;
+
+    size_t * Positions; // Its places in the schedule, in order
+    size_t NumPositions;
+    size_t Capacity;
+    size_t Next; // First of those not handed out yet
+} worker_lane_t;
+
+static const size_t held_output_limit = 64 * 1024 * 1024;
+
+typedef struct worker_pool_s
+{
+    pthread_mutex_t Lock;
+    const rom_list_t * Roms;
+    worker_job_t Job;
+    void * Context;
+    FILE * Out;
+
+    size_t NextOutput; // Next ROM whose report gets printed
+    bool Printing; // Somebody is printing; they'll pick up whatever's ready
+    size_t HeldBytes; // Finished reports waiting on their turn (or the printer)
+    char ** Results;
+    bool * Started;
+    bool * Finished;
+
+    pthread_cond_t Returned; // Signalled whenever a job gives back what it held
+    size_t Budget;
+    size_t InUse;
+    size_t * Costs; // By list index; NULL when there's no budget
+    worker_lane_t * Lanes;
+    size_t NumLanes;
+    size_t * JobLanes; // By list index
+} worker_pool_t;
+
+
+// Decs
+static void * worker_thread(void *);
+static void plan_lanes(worker_pool_t *, const worker_limits_t *);
+static void push_position(worker_lane_t *, size_t);
+static bool next_job(worker_pool_t *, size_t *);
+static bool job_fits(const worker_pool_t *, size_t);
+static void finish_job(worker_pool_t *, size_t, char *);
+
+
+// Running
+void run_worker_pool(const rom_list_t * roms, int num_threads, worker_job_t job, void * context, const worker_limits_t * limits, FILE * out)
+{
+    assert(roms != NULL);
+    assert(job != NULL);
+    assert(out != NULL);
+
+    if (num_threads < 1)
+        num_threads = 1;
+    if ((size_t)num_threads > roms->NumEntries)
+        num_threads = (roms->NumEntries > 0) ? roms->NumEntries : 1;
+
+    worker_pool_t pool;
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.Lock, NULL);
+    pthread_cond_init(&pool.Returned, NULL);
+    pool.Roms = roms;
+    pool.Job = job;
+    pool.Context = context;
+    pool.Out = out;
+    pool.Results = malloc(sizeof(char *) * (roms->NumEntries + 1));
+    pool.Started = malloc(sizeof(bool) * (roms->NumEntries + 1));
+    pool.Finished = malloc(sizeof(bool) * (roms->NumEntries + 1));
+    memset(pool.Results, 0, sizeof(char *) * (roms->NumEntries + 1));
+    memset(pool.Started, 0, sizeof(bool) * (roms->NumEntries + 1));
+    memset(pool.Finished, 0, sizeof(bool) * (roms->NumEntries + 1));
+
+    // Costs are worked out once up front.  Anything over the budget is
+    // charged the whole budget so it can still run, alone.
+    if (limits != NULL && limits->Budget > 0 && limits->Cost != NULL)
+    {
+        pool.Budget = limits->Budget;
+        pool.Costs = malloc(sizeof(size_t) * (roms->NumEntries + 1));
+        for (size_t i = 0; i < roms->NumEntries; i++)
+        {
+            size_t cost = limits->Cost(roms->Entries + i, i, context);
+            pool.Costs[i] = (cost < pool.Budget) ? cost : pool.Budget;
+        }
+    }
+    plan_lanes(&pool, limits);
+
+    // The calling thread is worker 0.
+    pthread_t * threads = malloc(sizeof(pthread_t) * num_threads);
+    for (int i = 1; i < num_threads; i++)
+    {
+        pthread_create(threads + i, NULL, worker_thread, &pool);
+    }
+    worker_thread(&pool);
+    for (int i = 1; i < num_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    assert(pool.NextOutput == roms->NumEntries);
+
+    for (size_t i = 0; i < pool.NumLanes; i++)
+    {
+        free(pool.Lanes[i].Positions);
+    }
+
+    free(threads);
+    free(pool.Results);
+    free(pool.Started);
+    free(pool.Finished);
+    free(pool.Costs);
+    free(pool.Lanes);
+    free(pool.JobLanes);
+    pthread_cond_destroy(&pool.Returned);
+    pthread_mutex_destroy(&pool.Lock);
+}
+static void * worker_thread(void * arg)
+{
+    worker_pool_t * pool = arg;
+
+    size_t index;
+    while (next_job(pool, &index))
+    {
+        char * result = pool->Job(pool->Roms->Entries + index, index, pool->Context);
+        finish_job(pool, index, result);
+    }
+
+    return NULL;
+}
+static void plan_lanes(worker_pool_t * pool, const worker_limits_t * limits)
+{
+    // Walking the schedule in order keeps every lane in order too.  There
+    // are only ever a handful of devices so finding one is a plain search.
+    const rom_list_t * roms = pool->Roms;
+    pool->Lanes = malloc(sizeof(worker_lane_t));
+    memset(pool->Lanes, 0, sizeof(worker_lane_t));
+    pool->NumLanes = 1;
+    pool->JobLanes = malloc(sizeof(size_t) * (roms->NumEntries + 1));
+
+    for (size_t next = 0; next < roms->NumEntries; next++)
+    {
+        size_t index = roms->Schedule[next];
+        const rom_entry_t * rom = roms->Entries + index;
+        unsigned limit = (limits != NULL && limits->DeviceLimit != NULL) ? limits->DeviceLimit(rom, index, pool->Context) : 0;
+
+        size_t lane = 0;
+        if (limit > 0)
+        {
+            for (lane = 1; lane < pool->NumLanes && pool->Lanes[lane].Device != rom->Device; lane++)
+                ;
+            if (lane == pool->NumLanes)
+            {
+                pool->Lanes = realloc(pool->Lanes, sizeof(worker_lane_t) * (pool->NumLanes + 1));
+                memset(pool->Lanes + lane, 0, sizeof(worker_lane_t));
+                pool->Lanes[lane].Device = rom->Device;
+                pool->Lanes[lane].Limit = limit;
+                pool->NumLanes++;
+            }
+        }
+
+        pool->JobLanes[index] = lane;
+        push_position(pool->Lanes + lane, next);
+    }
+}
+static void push_position(worker_lane_t * lane, size_t position)
+{
+    if (lane->NumPositions == lane->Capacity)
+    {
+        lane->Capacity = (lane->Capacity == 0) ? 256 : lane->Capacity * 2;
+        lane->Positions = realloc(lane->Positions, sizeof(size_t) * lane->Capacity);
+    }
+
+    lane->Positions[lane->NumPositions++] = position;
+}
+static bool next_job(worker_pool_t * pool, size_t * out_index)
+{
+    // False once every job has been handed out.
+    const rom_list_t * roms = pool->Roms;
+    bool ret = false;
+
+    pthread_mutex_lock(&pool->Lock);
+    while (1)
+    {
+        worker_lane_t * best_lane = NULL;
+        size_t best = SIZE_MAX;
+        bool left = false;
+
+        // Holding too much output only the job it's waiting on may start.
+        // It's either running already or there's nothing else it could be
+        // waiting for, so this always comes right.
+        if (pool->HeldBytes >= held_output_limit)
+        {
+            size_t index = pool->NextOutput;
+            if (index < roms->NumEntries && !pool->Started[index] && job_fits(pool, index))
+            {
+                pool->Started[index] = true;
+                pool->InUse += (pool->Costs != NULL) ? pool->Costs[index] : 0;
+                pool->Lanes[pool->JobLanes[index]].Running++;
+                *out_index = index;
+                ret = true;
+                break;
+            }
+
+            pthread_cond_wait(&pool->Returned, &pool->Lock);
+            continue;
+        }
+
+        for (size_t i = 0; i < pool->NumLanes; i++)
+        {
+            worker_lane_t * lane = pool->Lanes + i;
+            while (lane->Next < lane->NumPositions && pool->Started[roms->Schedule[lane->Positions[lane->Next]]])
+                lane->Next++;
+            if (lane->Next < lane->NumPositions)
+                left = true;
+            if (lane->Limit > 0 && lane->Running >= lane->Limit)
+                continue;
+
+            // Only worth looking as far as the best so far.
+            for (size_t next = lane->Next; next < lane->NumPositions && lane->Positions[next] < best; next++)
+            {
+                size_t index = roms->Schedule[lane->Positions[next]];
+                size_t cost = (pool->Costs != NULL) ? pool->Costs[index] : 0;
+                if (pool->Started[index] || cost > pool->Budget - pool->InUse)
+                    continue;
+
+                best = lane->Positions[next];
+                best_lane = lane;
+                break;
+            }
+        }
+
+        if (best_lane != NULL)
+        {
+            size_t index = roms->Schedule[best];
+            pool->Started[index] = true;
+            pool->InUse += (pool->Costs != NULL) ? pool->Costs[index] : 0;
+            best_lane->Running++;
+            *out_index = index;
+            ret = true;
+            break;
+        }
+        if (!left)
+            break;
+
+        pthread_cond_wait(&pool->Returned, &pool->Lock);
+    }
+    pthread_mutex_unlock(&pool->Lock);
+
+    return ret;
+}
+static bool job_fits(const worker_pool_t * pool, size_t index)
+{
+    const worker_lane_t * lane = pool->Lanes + pool->JobLanes[index];
+    size_t cost = (pool->Costs != NULL) ? pool->Costs[index] : 0;
+    return (lane->Limit == 0 || lane->Running < lane->Limit) && cost <= pool->Budget - pool->InUse;
+}
+static void finish_job(worker_pool_t * pool, size_t index, char * result)
+{
+    pthread_mutex_lock(&pool->Lock);
+
+    // Anyone waiting on what this job held can have another look.
+    worker_lane_t * lane = pool->Lanes + pool->JobLanes[index];
+    size_t cost = (pool->Costs != NULL) ? pool->Costs[index] : 0;
+    lane->Running--;
+    pool->InUse -= cost;
+    if (cost > 0 || lane->Limit > 0)
+        pthread_cond_broadcast(&pool->Returned);
+
+    pool->Results[index] = result;
+    pool->Finished[index] = true;
+    pool->HeldBytes += (result != NULL) ? strlen(result) : 0;
+
+    // One printer at a time keeps the output in order; anyone else just
+    // leaves their report for it.  The lock is dropped while it writes.
+    if (pool->Printing)
+    {
+        pthread_mutex_unlock(&pool->Lock);
+        return;
+    }
+    pool->Printing = true;
+    while (pool->NextOutput < pool->Roms->NumEntries && pool->Finished[pool->NextOutput])
+    {
+        size_t first = pool->NextOutput;
+        while (pool->NextOutput < pool->Roms->NumEntries && pool->Finished[pool->NextOutput])
+            pool->NextOutput++;
+        size_t last = pool->NextOutput;
+        pthread_mutex_unlock(&pool->Lock);
+
+        // Nobody else touches these slots once they're behind NextOutput.
+        size_t printed = 0;
+        for (size_t i = first; i < last; i++)
+        {
+            if (pool->Results[i] != NULL)
+            {
+                fputs(pool->Results[i], pool->Out);
+                printed += strlen(pool->Results[i]);
+                free(pool->Results[i]);
+                pool->Results[i] = NULL;
+            }
+        }
+        fflush(pool->Out);
+
+        pthread_mutex_lock(&pool->Lock);
+        pool->HeldBytes -= printed;
+        pthread_cond_broadcast(&pool->Returned);
+    }
+    pool->Printing = false;
+
+    pthread_mutex_unlock(&pool->Lock);
+}
@@ -0,0 +1,43 @@
+/* The worker pool runs a job over every ROM in a list with a number of
+ * threads.  Each job hands back its piece of the report as a string and
+ * the pool prints those strictly in list order no matter which thread
+ * finishes first, so a parallel run reads exactly like a serial one.
+ */
+
+#ifndef _WORKER_POOL_H
+#define _WORKER_POOL_H
+
+#include <stdio.h>
+#include "scanner.h"
+
+
+// Returns a malloc'd chunk of report (or NULL for nothing to say).
+// The index is the ROM's position in the list.
+typedef char * (*worker_job_t)(const rom_entry_t * rom, size_t index, void * context);
+
+// What a job will hold on to while it runs (bytes of memory, say).
+typedef size_t (*worker_cost_t)(const rom_entry_t * rom, size_t index, void * context);
+
+// How many jobs reading from the ROM's device may run at once, or 0 if
+// this one doesn't count (it reads nothing, or the device doesn't mind).
+typedef unsigned (*worker_device_limit_t)(const rom_entry_t * rom, size_t index, void * context);
+
+// Optionally the pool keeps what runs at once within limits.  With a
+// budget, when the next job in the schedule doesn't fit in what's left
+// the first one after it that does goes instead, so smaller ROMs fill the
+// gaps around big ones.  A job costing more than the whole budget gets
+// the pool to itself.  Device limits work the same way: a job whose
+// device is busy enough waits while jobs from other devices go ahead.
+// Both callbacks are handed the same context as the job.
+typedef struct worker_limits_s
+{
+    size_t Budget; // 0 == no budget
+    worker_cost_t Cost;
+    worker_device_limit_t DeviceLimit; // NULL == no device limits
+} worker_limits_t;
+
+// Procs
+// limits may be NULL.
+void run_worker_pool(const rom_list_t * roms, int num_threads, worker_job_t job, void * context, const worker_limits_t * limits, FILE * out);
+
+#endif
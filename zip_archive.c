@@ -0,0 +1,475 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "io_helper.h"
+#include "zip_archive.h"
+
+
+/* Everything in a zip is little endian and nothing is aligned, so fields
+ * are picked out a byte at a time.  The end of central directory record
+ * sits within the last 64K (it can be followed by a comment) and points
+ * at the central directory, or at a Zip64 record that does when any of
+ * the counts or offsets overflowed.
+ */
+static const uint32_t zip_local_signature = 0x04034b50;
+static const uint32_t zip_central_signature = 0x02014b50;
+static const uint32_t zip_end_signature = 0x06054b50;
+static const uint32_t zip64_end_signature = 0x06064b50;
+static const uint32_t zip64_locator_signature = 0x07064b50;
+static const size_t zip_end_size = 22;
+static const size_t zip64_locator_size = 20;
+static const size_t zip64_end_size = 56;
+static const size_t zip_central_size = 46;
+static const size_t zip_local_size = 30;
+static const size_t zip_max_comment = 0xFFFF;
+
+static const uint16_t zip_flag_encrypted = 0x0001;
+static const uint16_t zip_method_stored = 0;
+static const uint16_t zip_method_deflated = 8;
+
+/* Deflated members are read through one inflate stream that only ever
+ * goes forwards.  Every checkpoint_interval bytes the first time through
+ * it leaves a copy of itself behind (about 40K with the window), and
+ * going backwards starts again from the closest copy.  Big members space
+ * them out so there are never more than max_checkpoints.
+ */
+static const size_t zip_input_size = 256 * 1024;
+static const size_t zip_discard_size = 64 * 1024;
+static const uint64_t checkpoint_interval = 4 * 1024 * 1024;
+static const size_t max_checkpoints = 64;
+
+typedef struct zip_checkpoint_s
+{
+    uint64_t Position; // Uncompressed
+    uint64_t InputPosition; // Compressed bytes Stream had taken in
+    z_stream Stream;
+} zip_checkpoint_t;
+
+struct zip_member_s
+{
+    int Fd;
+    uint16_t Method;
+    uint64_t DataOffset; // Where the compressed bytes start in the archive
+    uint64_t CompressedSize;
+    uint64_t Size;
+    io_stats_t IoStats;
+
+    // Deflated members only
+    z_stream Stream;
+    bool Live; // Stream is set up
+    bool Ended; // and has hit the end (or a bad patch)
+    uint64_t Position; // Uncompressed bytes Stream has put out
+    uint64_t InputPosition; // Compressed bytes read into Input so far
+    uint8_t * Input;
+    uint8_t * Discard;
+    uint64_t Interval;
+    size_t NumCheckpoints;
+    zip_checkpoint_t * Checkpoints;
+};
+
+
+// Decs
+static bool read_central_directory(zip_archive_t *, uint64_t, uint64_t, uint64_t);
+static bool find_end_record(int, uint64_t, uint64_t *, uint64_t *, uint64_t *);
+static void read_zip64_extra(const uint8_t *, size_t, zip_entry_t *);
+static int compare_entries(const void *, const void *);
+static bool restart_member(zip_member_t *, uint64_t);
+static size_t inflate_member(zip_member_t *, uint8_t *, size_t);
+static uint16_t get16(const uint8_t *);
+static uint32_t get32(const uint8_t *);
+static uint64_t get64(const uint8_t *);
+
+
+// Init / Destroy
+zip_archive_t * open_zip_archive(const char * path)
+{
+    assert(path != NULL);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    zip_archive_t * ret = malloc(sizeof(zip_archive_t));
+    memset(ret, 0, sizeof(zip_archive_t));
+    ret->Fd = fd;
+
+    uint64_t count, cd_offset, cd_size;
+    if (!find_end_record(fd, st.st_size, &count, &cd_offset, &cd_size) || cd_offset + cd_size > (uint64_t)st.st_size || !read_central_directory(ret, count, cd_offset, cd_size))
+    {
+        close_zip_archive(ret);
+        return NULL;
+    }
+
+    return ret;
+}
+void close_zip_archive(zip_archive_t * archive)
+{
+    if (archive == NULL)
+        return;
+
+    for (size_t i = 0; i < archive->NumEntries; i++)
+    {
+        free(archive->Entries[i].Name);
+    }
+
+    if (archive->Fd >= 0)
+        close(archive->Fd);
+    free(archive->Entries);
+    free(archive);
+}
+zip_member_t * open_zip_member(zip_archive_t * archive, const zip_entry_t * entry)
+{
+    assert(archive != NULL);
+    assert(entry != NULL);
+
+    if (!can_read_zip_entry(entry))
+        return NULL;
+
+    // The local header repeats most of the central one but has its own
+    // idea of how long the extra field is.
+    uint8_t local[zip_local_size];
+    if (pread_fully(archive->Fd, local, zip_local_size, entry->HeaderOffset) != zip_local_size || get32(local) != zip_local_signature)
+        return NULL;
+
+    zip_member_t * ret = malloc(sizeof(zip_member_t));
+    memset(ret, 0, sizeof(zip_member_t));
+    ret->Fd = archive->Fd;
+    ret->Method = entry->Method;
+    ret->DataOffset = entry->HeaderOffset + zip_local_size + get16(local + 26) + get16(local + 28);
+    ret->CompressedSize = entry->CompressedSize;
+    ret->Size = entry->Size;
+    ret->IoStats.CachedBytes = zip_local_size;
+
+    ret->Interval = checkpoint_interval;
+    while (ret->Size / ret->Interval >= max_checkpoints)
+        ret->Interval *= 2;
+    return ret;
+}
+void close_zip_member(zip_member_t * member)
+{
+    if (member == NULL)
+        return;
+
+    for (size_t i = 0; i < member->NumCheckpoints; i++)
+    {
+        inflateEnd(&member->Checkpoints[i].Stream);
+    }
+
+    if (member->Live)
+        inflateEnd(&member->Stream);
+    free(member->Checkpoints);
+    free(member->Input);
+    free(member->Discard);
+    free(member);
+}
+static bool find_end_record(int fd, uint64_t file_size, uint64_t * out_count, uint64_t * out_offset, uint64_t * out_size)
+{
+    // Search backwards from the end; the comment could hold anything, the
+    // signature included, so the first hit from the end wins.
+    if (file_size < zip_end_size)
+        return false;
+
+    size_t tail_size = (file_size < zip_end_size + zip_max_comment) ? file_size : zip_end_size + zip_max_comment;
+    uint8_t * tail = malloc(tail_size);
+    uint64_t tail_offset = file_size - tail_size;
+    bool ret = false;
+    if (pread_fully(fd, tail, tail_size, tail_offset) == tail_size)
+    {
+        for (size_t pos = tail_size - zip_end_size + 1; pos-- > 0;)
+        {
+            const uint8_t * end = tail + pos;
+            if (get32(end) != zip_end_signature)
+                continue;
+
+            // Split archives are out.
+            if (get16(end + 4) != 0 || get16(end + 6) != 0)
+                break;
+
+            *out_count = get16(end + 10);
+            *out_size = get32(end + 12);
+            *out_offset = get32(end + 16);
+            ret = true;
+            if (*out_count != 0xFFFF && *out_size != 0xFFFFFFFF && *out_offset != 0xFFFFFFFF)
+                break;
+
+            // Something overflowed so the real numbers are in the Zip64
+            // record, which the locator right before us points to.
+            uint8_t locator[zip64_locator_size];
+            uint8_t end64[zip64_end_size];
+            uint64_t end_offset = tail_offset + pos;
+            ret = false;
+            if (end_offset < zip64_locator_size || pread_fully(fd, locator, zip64_locator_size, end_offset - zip64_locator_size) != zip64_locator_size || get32(locator) != zip64_locator_signature)
+                break;
+            if (pread_fully(fd, end64, zip64_end_size, get64(locator + 8)) != zip64_end_size || get32(end64) != zip64_end_signature)
+                break;
+
+            *out_count = get64(end64 + 32);
+            *out_size = get64(end64 + 40);
+            *out_offset = get64(end64 + 48);
+            ret = true;
+            break;
+        }
+    }
+
+    free(tail);
+    return ret;
+}
+static bool read_central_directory(zip_archive_t * archive, uint64_t count, uint64_t offset, uint64_t size)
+{
+    // Each entry is at least zip_central_size so the count can't be more
+    // than the directory has room for.
+    if (count > size / zip_central_size)
+        return false;
+
+    uint8_t * cd = malloc(size + 1);
+    if (pread_fully(archive->Fd, cd, size, offset) != size)
+    {
+        free(cd);
+        return false;
+    }
+
+    archive->Entries = malloc(sizeof(zip_entry_t) * (count + 1));
+    size_t pos = 0;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        if (size - pos < zip_central_size || get32(cd + pos) != zip_central_signature)
+            break;
+
+        const uint8_t * header = cd + pos;
+        size_t name_len = get16(header + 28);
+        size_t extra_len = get16(header + 30);
+        size_t comment_len = get16(header + 32);
+        if (size - pos - zip_central_size < name_len + extra_len + comment_len)
+            break;
+
+        zip_entry_t * entry = archive->Entries + archive->NumEntries++;
+        entry->Flags = get16(header + 8);
+        entry->Method = get16(header + 10);
+        entry->Crc = get32(header + 16);
+        entry->CompressedSize = get32(header + 20);
+        entry->Size = get32(header + 24);
+        entry->HeaderOffset = get32(header + 42);
+        entry->Name = strndup((const char *)header + zip_central_size, name_len);
+        read_zip64_extra(header + zip_central_size + name_len, extra_len, entry);
+
+        pos += zip_central_size + name_len + extra_len + comment_len;
+    }
+
+    free(cd);
+
+    // By name so finding one is a binary search.
+    qsort(archive->Entries, archive->NumEntries, sizeof(zip_entry_t), compare_entries);
+    return (archive->NumEntries == count);
+}
+static void read_zip64_extra(const uint8_t * extra, size_t extra_len, zip_entry_t * entry)
+{
+    // Only the fields that overflowed are there, and always in this order.
+    for (size_t pos = 0; extra_len - pos >= 4;)
+    {
+        uint16_t id = get16(extra + pos);
+        size_t len = get16(extra + pos + 2);
+        if (extra_len - pos - 4 < len)
+            return;
+
+        const uint8_t * field = extra + pos + 4;
+        size_t used = 0;
+        if (id == 0x0001)
+        {
+            if (entry->Size == 0xFFFFFFFF && len - used >= 8)
+            {
+                entry->Size = get64(field + used);
+                used += 8;
+            }
+            if (entry->CompressedSize == 0xFFFFFFFF && len - used >= 8)
+            {
+                entry->CompressedSize = get64(field + used);
+                used += 8;
+            }
+            if (entry->HeaderOffset == 0xFFFFFFFF && len - used >= 8)
+                entry->HeaderOffset = get64(field + used);
+            return;
+        }
+
+        pos += 4 + len;
+    }
+}
+
+// Procs
+const zip_entry_t * find_zip_entry(const zip_archive_t * archive, const char * name)
+{
+    assert(archive != NULL);
+    assert(name != NULL);
+
+    zip_entry_t key;
+    key.Name = (char *)name;
+    return bsearch(&key, archive->Entries, archive->NumEntries, sizeof(zip_entry_t), compare_entries);
+}
+bool can_read_zip_entry(const zip_entry_t * entry)
+{
+    assert(entry != NULL);
+
+    return !(entry->Flags & zip_flag_encrypted) && (entry->Method == zip_method_stored || entry->Method == zip_method_deflated);
+}
+size_t read_zip_member(zip_member_t * member, void * buf, size_t buflen, size_t offset)
+{
+    assert(member != NULL);
+    assert(buf != NULL || buflen == 0);
+
+    if (offset >= member->Size)
+        return 0;
+    if (buflen > member->Size - offset)
+        buflen = member->Size - offset;
+
+    // Stored members are just a piece of the archive.
+    if (member->Method == zip_method_stored)
+    {
+        if (offset + buflen > member->CompressedSize)
+            buflen = (offset < member->CompressedSize) ? member->CompressedSize - offset : 0;
+        size_t got = pread_fully(member->Fd, buf, buflen, member->DataOffset + offset);
+        member->IoStats.CachedBytes += got;
+        return got;
+    }
+
+    // Carry on from where the stream is if nothing closer is on hand,
+    // otherwise go back to the last checkpoint at or before offset.
+    const zip_checkpoint_t * closest = NULL;
+    for (size_t i = 0; i < member->NumCheckpoints && member->Checkpoints[i].Position <= offset; i++)
+    {
+        closest = member->Checkpoints + i;
+    }
+    bool carry_on = member->Live && member->Position <= offset && (closest == NULL || closest->Position <= member->Position);
+    if (!carry_on && !restart_member(member, (closest != NULL) ? (size_t)(closest - member->Checkpoints) : SIZE_MAX))
+        return 0;
+
+    while (member->Position < offset && !member->Ended)
+    {
+        size_t skip = (offset - member->Position < zip_discard_size) ? offset - member->Position : zip_discard_size;
+        if (inflate_member(member, member->Discard, skip) == 0)
+            break;
+    }
+    if (member->Position != offset)
+        return 0;
+
+    size_t got = 0;
+    while (got < buflen && !member->Ended)
+    {
+        size_t step = inflate_member(member, (uint8_t *)buf + got, buflen - got);
+        if (step == 0)
+            break;
+        got += step;
+    }
+
+    return got;
+}
+void get_zip_io_stats(const zip_member_t * member, io_stats_t * out_stats)
+{
+    assert(member != NULL);
+    assert(out_stats != NULL);
+
+    *out_stats = member->IoStats;
+}
+static bool restart_member(zip_member_t * member, size_t checkpoint)
+{
+    // From the top, or from a checkpoint's copy of the stream.  Anything
+    // the stream had taken in but not used went with the copy.
+    if (member->Live)
+        inflateEnd(&member->Stream);
+    member->Live = false;
+    member->Ended = false;
+    if (member->Input == NULL)
+    {
+        member->Input = malloc(zip_input_size);
+        member->Discard = malloc(zip_discard_size);
+        member->Checkpoints = malloc(sizeof(zip_checkpoint_t) * max_checkpoints);
+    }
+
+    int ret;
+    if (checkpoint == SIZE_MAX)
+    {
+        memset(&member->Stream, 0, sizeof(z_stream));
+        ret = inflateInit2(&member->Stream, -MAX_WBITS);
+        member->Position = 0;
+        member->InputPosition = 0;
+    }
+    else
+    {
+        zip_checkpoint_t * from = member->Checkpoints + checkpoint;
+        ret = inflateCopy(&member->Stream, &from->Stream);
+        member->Position = from->Position;
+        member->InputPosition = from->InputPosition;
+    }
+
+    member->Stream.next_in = member->Input;
+    member->Stream.avail_in = 0;
+    member->Live = (ret == Z_OK);
+    return member->Live;
+}
+static size_t inflate_member(zip_member_t * member, uint8_t * out, size_t outlen)
+{
+    // One go at filling out.  Returns how much came out; 0 means the end.
+    z_stream * stream = &member->Stream;
+    if (stream->avail_in == 0)
+    {
+        uint64_t left = member->CompressedSize - member->InputPosition;
+        size_t want = (left < zip_input_size) ? left : zip_input_size;
+        size_t got = pread_fully(member->Fd, member->Input, want, member->DataOffset + member->InputPosition);
+        member->IoStats.CachedBytes += got;
+        member->InputPosition += got;
+        stream->next_in = member->Input;
+        stream->avail_in = got;
+    }
+
+    stream->next_out = out;
+    stream->avail_out = (outlen > UINT32_MAX) ? UINT32_MAX : outlen;
+    int ret = inflate(stream, Z_NO_FLUSH);
+    size_t made = stream->next_out - out;
+    member->Position += made;
+    if (ret != Z_OK || (made == 0 && stream->avail_in == 0))
+        member->Ended = true;
+
+    // The first time past each interval leave a copy of the stream behind.
+    // Whatever it still holds of Input wasn't used so doesn't count.  The
+    // copies never move; zlib's state points back at its z_stream.
+    if (member->Position >= (member->NumCheckpoints + 1) * member->Interval && member->NumCheckpoints < max_checkpoints && !member->Ended)
+    {
+        zip_checkpoint_t * checkpoint = member->Checkpoints + member->NumCheckpoints;
+        if (inflateCopy(&checkpoint->Stream, stream) == Z_OK)
+        {
+            checkpoint->Position = member->Position;
+            checkpoint->InputPosition = member->InputPosition - stream->avail_in;
+            member->NumCheckpoints++;
+        }
+    }
+
+    return made;
+}
+static int compare_entries(const void * a, const void * b)
+{
+    return strcmp(((const zip_entry_t *)a)->Name, ((const zip_entry_t *)b)->Name);
+}
+static uint16_t get16(const uint8_t * p)
+{
+    return p[0] | (p[1] << 8);
+}
+static uint32_t get32(const uint8_t * p)
+{
+    return (uint32_t)get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+static uint64_t get64(const uint8_t * p)
+{
+    return (uint64_t)get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
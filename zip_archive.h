@@ -0,0 +1,56 @@
+/* Zip archives, read in place.  Opening one reads just its central
+ * directory (Zip64 included); members are then read by offset, as if
+ * they'd been extracted, without anything ever touching the disk.
+ *
+ * Stored members are a plain pread into the archive.  Deflated ones are
+ * inflated on the way; reading backwards restarts from the nearest of a
+ * handful of checkpoints taken the first time through, so hopping around
+ * a member costs at most a few megabytes of inflating and memory stays
+ * bounded no matter how big the member is.
+ *
+ * Encrypted members, split archives and methods other than store and
+ * deflate are listed but can't be read.
+ */
+
+#ifndef _ZIP_ARCHIVE_H
+#define _ZIP_ARCHIVE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "io_helper.h"
+
+
+typedef struct zip_entry_s
+{
+    char * Name; // As stored, directories and all
+    uint16_t Flags;
+    uint16_t Method;
+    uint32_t Crc;
+    uint64_t CompressedSize;
+    uint64_t Size;
+    uint64_t HeaderOffset; // Of the member's local header
+} zip_entry_t;
+typedef struct zip_archive_s
+{
+    int Fd;
+    size_t NumEntries;
+    zip_entry_t * Entries; // Sorted by name
+} zip_archive_t;
+typedef struct zip_member_s zip_member_t;
+
+// Procs
+// NULL if it isn't a zip we can read.
+zip_archive_t * open_zip_archive(const char * path);
+void close_zip_archive(zip_archive_t * archive);
+const zip_entry_t * find_zip_entry(const zip_archive_t * archive, const char * name);
+bool can_read_zip_entry(const zip_entry_t * entry);
+
+// A member keeps using the archive's descriptor; close it first.  One
+// member is only ever read by one thread at a time.
+zip_member_t * open_zip_member(zip_archive_t * archive, const zip_entry_t * entry);
+void close_zip_member(zip_member_t * member);
+size_t read_zip_member(zip_member_t * member, void * buf, size_t buflen, size_t offset); // Short only at the end (or on a bad archive)
+void get_zip_io_stats(const zip_member_t * member, io_stats_t * out_stats);
+
+#endif